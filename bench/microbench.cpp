@@ -0,0 +1,251 @@
+// bench: microbenchmarks of the hot paths that do not need a socket, reported as ns/op and allocations/op.
+//
+//   bench [--filter <substring>] [--min-time <seconds>]
+//
+// Every benchmark is run with a doubling number of iterations until one run takes at least --min-time
+// (0.2 s by default), that last run is the one reported. Allocations are counted by replacing the global
+// operator new, so only what the measured code allocates itself shows up.
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <functional>
+#include <new>
+#include <string>
+#include <string_view>
+#include <vector>
+#include "../include/keyspace.hpp"
+#include "../include/resp_parser.hpp"
+#include "../include/resp_writer.hpp"
+#include "../include/stream.hpp"
+
+namespace {
+
+std::atomic<uint64_t> g_allocations = 0;
+
+} // namespace
+
+void* operator new(size_t size) {
+    g_allocations.fetch_add(1, std::memory_order_relaxed);
+    if (void* p = std::malloc(size == 0 ? 1 : size)) {
+        return p;
+    }
+    throw std::bad_alloc();
+}
+
+void operator delete(void* p) noexcept {
+    std::free(p);
+}
+
+void operator delete(void* p, size_t) noexcept {
+    std::free(p);
+}
+
+using namespace redis_server;
+
+namespace {
+
+using Clock = std::chrono::steady_clock;
+
+// Keeps the compiler from dropping a result that is never used
+template <typename T>
+void doNotOptimize(const T& value) {
+    asm volatile("" : : "r,m"(value) : "memory");
+}
+
+struct Options {
+    std::string filter;
+    double min_time = 0.2;
+};
+
+// Runs body(iterations) until it is slow enough to time, then prints one line
+void runBenchmark(const Options& options, std::string_view name, const std::function<void(size_t)>& body) {
+    if (!options.filter.empty() && name.find(options.filter) == std::string_view::npos) {
+        return;
+    }
+    for (size_t iterations = 1;; iterations *= 2) {
+        uint64_t allocations = g_allocations.load(std::memory_order_relaxed);
+        auto start = Clock::now();
+        body(iterations);
+        double seconds = std::chrono::duration<double>(Clock::now() - start).count();
+        allocations = g_allocations.load(std::memory_order_relaxed) - allocations;
+        if (seconds >= options.min_time || iterations >= (size_t(1) << 40)) {
+            std::printf("%-40.*s %12zu %12.1f %14.2f\n", static_cast<int>(name.size()), name.data(), iterations,
+                        seconds * 1e9 / iterations, static_cast<double>(allocations) / iterations);
+            return;
+        }
+    }
+}
+
+std::string command(std::initializer_list<std::string_view> args) {
+    std::string out = "*" + std::to_string(args.size()) + "\r\n";
+    for (std::string_view arg : args) {
+        appendBulkString(out, arg);
+    }
+    return out;
+}
+
+std::string keyName(size_t i) {
+    return "key:" + std::to_string(i);
+}
+
+void parserBenchmarks(const Options& options) {
+    std::string set = command({"SET", "key:12345", "some value of a few bytes"});
+    runBenchmark(options, "resp/parse SET", [&](size_t iterations) {
+        RespParser parser;
+        RespFrame frame;
+        for (size_t i = 0; i < iterations; ++i) {
+            doNotOptimize(parser.parse(set, frame));
+        }
+    });
+
+    std::string pipeline;
+    for (int i = 0; i < 16; ++i) {
+        pipeline += command({"GET", keyName(i)});
+    }
+    runBenchmark(options, "resp/parse pipeline of 16 GET", [&](size_t iterations) {
+        RespParser parser;
+        RespFrame frame;
+        for (size_t i = 0; i < iterations; ++i) {
+            for (std::string_view rest = pipeline; !rest.empty(); rest.remove_prefix(frame.raw.size())) {
+                parser.parse(rest, frame);
+            }
+            doNotOptimize(frame);
+        }
+    });
+
+    // A frame split by the network: the parser resumes after the first half instead of starting over
+    std::string_view first_half = std::string_view(set).substr(0, set.size() / 2);
+    runBenchmark(options, "resp/parse SET in two reads", [&](size_t iterations) {
+        RespParser parser;
+        RespFrame frame;
+        for (size_t i = 0; i < iterations; ++i) {
+            parser.parse(first_half, frame);
+            doNotOptimize(parser.parse(set, frame));
+        }
+    });
+}
+
+void writerBenchmarks(const Options& options) {
+    std::vector<std::string> one = {"some value of a few bytes"};
+    runBenchmark(options, "reply/bulk string", [&](size_t iterations) {
+        for (size_t i = 0; i < iterations; ++i) {
+            doNotOptimize(formatBulkStrings(one));
+        }
+    });
+
+    std::vector<std::string> ten;
+    for (int i = 0; i < 10; ++i) {
+        ten.push_back(keyName(i));
+    }
+    runBenchmark(options, "reply/array of 10 bulk strings", [&](size_t iterations) {
+        for (size_t i = 0; i < iterations; ++i) {
+            doNotOptimize(formatBulkStrings(ten, true));
+        }
+    });
+    runBenchmark(options, "reply/format_resp_array of 10", [&](size_t iterations) {
+        for (size_t i = 0; i < iterations; ++i) {
+            doNotOptimize(formatRespArray(ten, true));
+        }
+    });
+}
+
+void keyspaceBenchmarks(const Options& options) {
+    constexpr size_t kKeys = 100000;
+    Shard shard;
+    std::vector<std::string> keys;
+    std::vector<std::string> missing;
+    for (size_t i = 0; i < kKeys; ++i) {
+        keys.push_back(keyName(i));
+        missing.push_back("missing:" + std::to_string(i));
+        shard.setString(keys.back(), StringValue(std::string_view("value")));
+    }
+
+    runBenchmark(options, "keyspace/strings.find hit (100k keys)", [&](size_t iterations) {
+        for (size_t i = 0; i < iterations; ++i) {
+            doNotOptimize(shard.strings.find(keys[i % kKeys]));
+        }
+    });
+    runBenchmark(options, "keyspace/strings.find miss (100k keys)", [&](size_t iterations) {
+        for (size_t i = 0; i < iterations; ++i) {
+            doNotOptimize(shard.strings.find(missing[i % kKeys]));
+        }
+    });
+    runBenchmark(options, "keyspace/findString hit (100k keys)", [&](size_t iterations) {
+        for (size_t i = 0; i < iterations; ++i) {
+            doNotOptimize(shard.findString(keys[i % kKeys]));
+        }
+    });
+    runBenchmark(options, "keyspace/setString overwrite", [&](size_t iterations) {
+        for (size_t i = 0; i < iterations; ++i) {
+            shard.setString(keys[i % kKeys], StringValue(int64_t(i)));
+        }
+    });
+}
+
+void streamBenchmarks(const Options& options) {
+    constexpr size_t kIds = 1024;
+    std::vector<StreamId> ids;
+    for (size_t i = 0; i < kIds; ++i) {
+        ids.push_back({1700000000000 + i / 4, i % 4});
+    }
+    runBenchmark(options, "stream/id compare (greater, less)", [&](size_t iterations) {
+        size_t greater = 0;
+        for (size_t i = 0; i < iterations; ++i) {
+            const StreamId& a = ids[i % kIds];
+            const StreamId& b = ids[(i * 7) % kIds];
+            greater += (a > b) + (a < b);
+        }
+        doNotOptimize(greater);
+    });
+    runBenchmark(options, "stream/id parse", [&](size_t iterations) {
+        for (size_t i = 0; i < iterations; ++i) {
+            doNotOptimize(StreamId::parse("1700000000123-7"));
+        }
+    });
+
+    constexpr size_t kEntries = 100000;
+    Stream stream;
+    std::vector<std::string_view> fields = {"temperature", "21", "humidity", "40"};
+    for (size_t i = 0; i < kEntries; ++i) {
+        stream.append({1700000000000 + i, 0}, fields);
+    }
+    runBenchmark(options, "stream/range 100 of 100k entries", [&](size_t iterations) {
+        std::string out;
+        for (size_t i = 0; i < iterations; ++i) {
+            out.clear();
+            uint64_t start = 1700000000000 + (i * 997) % (kEntries - 100);
+            doNotOptimize(appendStreamEntries(out, stream, {start, 0}, {start + 99, UINT64_MAX}));
+        }
+    });
+    runBenchmark(options, "stream/range all of 100k entries", [&](size_t iterations) {
+        std::string out;
+        for (size_t i = 0; i < iterations; ++i) {
+            out.clear();
+            doNotOptimize(appendStreamEntries(out, stream, StreamId::min(), StreamId::max()));
+        }
+    });
+}
+
+} // namespace
+
+int main(int argc, char* argv[]) {
+    Options options;
+    for (int i = 1; i + 1 < argc; i += 2) {
+        std::string arg = argv[i];
+        if (arg == "--filter") {
+            options.filter = argv[i + 1];
+        } else if (arg == "--min-time") {
+            options.min_time = std::stod(argv[i + 1]);
+        } else {
+            std::fprintf(stderr, "Unknown option %s\n", arg.c_str());
+            return 1;
+        }
+    }
+    std::printf("%-40s %12s %12s %14s\n", "benchmark", "iterations", "ns/op", "allocs/op");
+    parserBenchmarks(options);
+    writerBenchmarks(options);
+    keyspaceBenchmarks(options);
+    streamBenchmarks(options);
+    return 0;
+}
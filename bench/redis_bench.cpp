@@ -0,0 +1,422 @@
+// redis-bench: closed-loop load generator. Every connection sends a pipeline of commands, waits for all
+// their replies and sends the next one, the latency of a request runs from the write of its pipeline to
+// the arrival of its reply.
+//
+//   redis-bench [-h host] [-p port] [-c connections] [-n requests | --duration seconds] [-P pipeline]
+//               [-r keyspace] [-d value_size] [--threads n] [--streams n] [--mix get:50,set:50] [--json]
+//
+// --mix weighs the commands sent: get, set, incr, xadd, xrange and xread. XRANGE and XREAD ask for the
+// last millisecond of a stream so their replies stay small while XADD keeps appending.
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <initializer_list>
+#include <iostream>
+#include <memory>
+#include <optional>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <vector>
+#include <asio.hpp>
+#include "../include/latency_histogram.hpp"
+
+using asio::ip::tcp;
+using redis_server::LatencyHistogram;
+using Clock = std::chrono::steady_clock;
+
+namespace {
+
+enum Kind { Get, Set, Incr, Xadd, Xrange, Xread, kKinds };
+constexpr std::string_view kKindNames[kKinds] = {"GET", "SET", "INCR", "XADD", "XRANGE", "XREAD"};
+
+struct Config {
+    std::string host = "127.0.0.1";
+    std::string port = "6379";
+    size_t connections = 50;
+    long long requests = 100000;
+    double duration = 0; // seconds, replaces requests when set
+    size_t pipeline = 1;
+    uint64_t keyspace = 10000;
+    size_t value_size = 3;
+    size_t threads = 1;
+    uint64_t streams = 16;
+    unsigned weights[kKinds] = {50, 50, 0, 0, 0, 0};
+    bool json = false;
+};
+
+struct Stats {
+    LatencyHistogram all;
+    LatencyHistogram commands[kKinds];
+    uint64_t errors = 0;
+
+    void merge(const Stats& other) {
+        all.merge(other.all);
+        for (size_t i = 0; i < kKinds; ++i) {
+            commands[i].merge(other.commands[i]);
+        }
+        errors += other.errors;
+    }
+};
+
+// Shared by all connections: how many requests are left to send, or until when to send them
+struct Budget {
+    std::atomic<long long> remaining;
+    std::optional<Clock::time_point> deadline;
+
+    // Claims up to wanted requests
+    size_t claim(size_t wanted) {
+        if (deadline) {
+            return Clock::now() < *deadline ? wanted : 0;
+        }
+        long long left = remaining.load(std::memory_order_relaxed);
+        while (left > 0) {
+            long long taken = std::min<long long>(left, static_cast<long long>(wanted));
+            if (remaining.compare_exchange_weak(left, left - taken, std::memory_order_relaxed)) {
+                return static_cast<size_t>(taken);
+            }
+        }
+        return 0;
+    }
+};
+
+// Position just past the reply starting at pos, npos if it is not complete yet
+size_t replyEnd(std::string_view data, size_t pos) {
+    size_t line_end = data.find("\r\n", pos);
+    if (pos >= data.size() || line_end == std::string_view::npos) {
+        return std::string_view::npos;
+    }
+    char type = data[pos];
+    size_t next = line_end + 2;
+    if (type == '+' || type == '-' || type == ':') {
+        return next;
+    }
+    long long length = std::stoll(std::string(data.substr(pos + 1, line_end - pos - 1)));
+    if (type == '$') {
+        if (length < 0) {
+            return next;
+        }
+        return data.size() < next + length + 2 ? std::string_view::npos : next + length + 2;
+    }
+    if (type == '*') {
+        for (long long i = 0; i < length && next != std::string_view::npos; ++i) {
+            next = replyEnd(data, next);
+        }
+        return next;
+    }
+    throw std::runtime_error("unexpected reply type '" + std::string(1, type) + "'");
+}
+
+void appendCommand(std::string& out, std::initializer_list<std::string_view> args) {
+    out += '*';
+    out += std::to_string(args.size());
+    out += "\r\n";
+    for (std::string_view arg : args) {
+        out += '$';
+        out += std::to_string(arg.size());
+        out += "\r\n";
+        out += arg;
+        out += "\r\n";
+    }
+}
+
+class Connection : public std::enable_shared_from_this<Connection> {
+public:
+    Connection(asio::io_context& io_context, const Config& config, Budget& budget, uint64_t seed)
+        : socket_(asio::make_strand(io_context)), config_(config), budget_(budget), rng_(seed | 1),
+          value_(config.value_size, 'x') {
+        for (unsigned weight : config.weights) {
+            total_weight_ += weight;
+        }
+    }
+
+    void start(const tcp::resolver::results_type& endpoints) {
+        auto self(shared_from_this());
+        asio::async_connect(socket_, endpoints, [this, self](asio::error_code ec, const tcp::endpoint&) {
+            if (ec) {
+                std::cerr << "Could not connect: " << ec.message() << std::endl;
+                return;
+            }
+            socket_.set_option(tcp::no_delay(true));
+            sendBatch();
+        });
+    }
+
+    const Stats& stats() const { return stats_; }
+
+private:
+    uint64_t random() {
+        // xorshift64, plenty for picking keys
+        rng_ ^= rng_ << 13;
+        rng_ ^= rng_ >> 7;
+        rng_ ^= rng_ << 17;
+        return rng_;
+    }
+
+    Kind pickKind() {
+        uint64_t pick = random() % total_weight_;
+        for (size_t i = 0; i < kKinds; ++i) {
+            if (pick < config_.weights[i]) {
+                return static_cast<Kind>(i);
+            }
+            pick -= config_.weights[i];
+        }
+        return Get;
+    }
+
+    void appendRequest(Kind kind) {
+        std::string key = std::to_string(random() % config_.keyspace);
+        std::string stream = "stream:" + std::to_string(random() % config_.streams);
+        auto now_ms = std::chrono::duration_cast<std::chrono::milliseconds>(
+            std::chrono::system_clock::now().time_since_epoch()).count();
+        std::string since = std::to_string(now_ms - 1);
+        switch (kind) {
+        case Get: appendCommand(out_, {"GET", "key:" + key}); break;
+        case Set: appendCommand(out_, {"SET", "key:" + key, value_}); break;
+        case Incr: appendCommand(out_, {"INCR", "counter:" + key}); break;
+        case Xadd: appendCommand(out_, {"XADD", stream, "*", "field", value_}); break;
+        case Xrange: appendCommand(out_, {"XRANGE", stream, since, "+"}); break;
+        case Xread: appendCommand(out_, {"XREAD", "STREAMS", stream, since + "-0"}); break;
+        default: break;
+        }
+    }
+
+    void sendBatch() {
+        size_t count = budget_.claim(config_.pipeline);
+        if (count == 0) {
+            asio::error_code ignored;
+            socket_.close(ignored);
+            return;
+        }
+        out_.clear();
+        inflight_.clear();
+        next_reply_ = 0;
+        for (size_t i = 0; i < count; ++i) {
+            Kind kind = pickKind();
+            appendRequest(kind);
+            inflight_.push_back(kind);
+        }
+        sent_at_ = Clock::now();
+        auto self(shared_from_this());
+        asio::async_write(socket_, asio::buffer(out_), [this, self](asio::error_code ec, size_t) {
+            if (ec) {
+                std::cerr << "Write error: " << ec.message() << std::endl;
+                return;
+            }
+            read();
+        });
+    }
+
+    void read() {
+        auto self(shared_from_this());
+        socket_.async_read_some(asio::buffer(buffer_), [this, self](asio::error_code ec, size_t length) {
+            if (ec) {
+                std::cerr << "Read error: " << ec.message() << std::endl;
+                return;
+            }
+            in_.append(buffer_.data(), length);
+            auto now = Clock::now();
+            uint64_t latency = std::chrono::duration_cast<std::chrono::nanoseconds>(now - sent_at_).count();
+            size_t consumed = 0;
+            while (next_reply_ < inflight_.size()) {
+                size_t end = replyEnd(in_, consumed);
+                if (end == std::string_view::npos) {
+                    break;
+                }
+                stats_.errors += in_[consumed] == '-';
+                stats_.all.record(latency);
+                stats_.commands[inflight_[next_reply_]].record(latency);
+                consumed = end;
+                ++next_reply_;
+            }
+            in_.erase(0, consumed);
+            if (next_reply_ < inflight_.size()) {
+                read();
+            } else {
+                sendBatch();
+            }
+        });
+    }
+
+    tcp::socket socket_;
+    const Config& config_;
+    Budget& budget_;
+    uint64_t rng_;
+    unsigned total_weight_ = 0;
+    std::string value_;
+    std::string out_;
+    std::string in_;
+    std::array<char, 65536> buffer_;
+    std::vector<Kind> inflight_; // commands of the pipeline in flight, in order
+    size_t next_reply_ = 0;
+    Clock::time_point sent_at_;
+    Stats stats_;
+};
+
+// "get:50,set:50"
+void parseMix(const std::string& text, Config& config) {
+    std::fill(std::begin(config.weights), std::end(config.weights), 0);
+    std::istringstream in(text);
+    std::string item;
+    while (std::getline(in, item, ',')) {
+        size_t colon = item.find(':');
+        std::string name = item.substr(0, colon);
+        std::transform(name.begin(), name.end(), name.begin(), [](unsigned char c) { return std::toupper(c); });
+        auto it = std::find(std::begin(kKindNames), std::end(kKindNames), name);
+        if (it == std::end(kKindNames)) {
+            throw std::runtime_error("Unknown command in --mix: " + name);
+        }
+        config.weights[it - std::begin(kKindNames)] = colon == std::string::npos ? 1 : std::stoul(item.substr(colon + 1));
+    }
+    if (std::all_of(std::begin(config.weights), std::end(config.weights), [](unsigned w) { return w == 0; })) {
+        throw std::runtime_error("--mix needs at least one command with a weight above 0");
+    }
+}
+
+Config parseArgs(int argc, char* argv[]) {
+    Config config;
+    for (int i = 1; i < argc; ++i) {
+        std::string arg = argv[i];
+        if (arg == "--json") {
+            config.json = true;
+            continue;
+        }
+        if (i + 1 >= argc) {
+            throw std::runtime_error("Missing value for " + arg);
+        }
+        std::string value = argv[++i];
+        if (arg == "-h") {
+            config.host = value;
+        } else if (arg == "-p") {
+            config.port = value;
+        } else if (arg == "-c") {
+            config.connections = std::max(1, std::stoi(value));
+        } else if (arg == "-n") {
+            config.requests = std::stoll(value);
+        } else if (arg == "--duration") {
+            config.duration = std::stod(value);
+        } else if (arg == "-P") {
+            config.pipeline = std::max(1, std::stoi(value));
+        } else if (arg == "-r") {
+            config.keyspace = std::max(1ULL, std::stoull(value));
+        } else if (arg == "-d") {
+            config.value_size = std::stoul(value);
+        } else if (arg == "--threads") {
+            config.threads = std::max(1, std::stoi(value));
+        } else if (arg == "--streams") {
+            config.streams = std::max(1ULL, std::stoull(value));
+        } else if (arg == "--mix") {
+            parseMix(value, config);
+        } else {
+            throw std::runtime_error("Unknown option " + arg);
+        }
+    }
+    return config;
+}
+
+double toMs(uint64_t ns) {
+    return ns / 1e6;
+}
+
+void printText(const Config& config, const Stats& stats, double seconds) {
+    std::printf("====== redis-bench ======\n");
+    std::printf("  %llu requests completed in %.2f seconds\n", static_cast<unsigned long long>(stats.all.count()), seconds);
+    std::printf("  %zu connections, pipeline %zu, %llu keys, %zu byte values, %zu thread(s)\n", config.connections,
+                config.pipeline, static_cast<unsigned long long>(config.keyspace), config.value_size, config.threads);
+    std::printf("  throughput: %.2f requests/s, %llu errors\n", stats.all.count() / seconds,
+                static_cast<unsigned long long>(stats.errors));
+    std::printf("\n  %-8s %12s %10s %10s %10s %10s %10s\n", "command", "requests", "p50 ms", "p99 ms", "p99.9 ms",
+                "max ms", "mean ms");
+    auto row = [](std::string_view name, const LatencyHistogram& histogram) {
+        std::printf("  %-8.*s %12llu %10.3f %10.3f %10.3f %10.3f %10.3f\n", static_cast<int>(name.size()), name.data(),
+                    static_cast<unsigned long long>(histogram.count()), toMs(histogram.percentile(50)),
+                    toMs(histogram.percentile(99)), toMs(histogram.percentile(99.9)), toMs(histogram.max()),
+                    histogram.mean() / 1e6);
+    };
+    for (size_t i = 0; i < kKinds; ++i) {
+        if (stats.commands[i].count() > 0) {
+            row(kKindNames[i], stats.commands[i]);
+        }
+    }
+    row("all", stats.all);
+}
+
+// Latencies in microseconds, one object per line so results of several builds can be diffed or appended
+void printJson(const Config& config, const Stats& stats, double seconds) {
+    auto latency = [](const LatencyHistogram& histogram) {
+        char out[256];
+        std::snprintf(out, sizeof(out), "{\"p50\":%.3f,\"p99\":%.3f,\"p999\":%.3f,\"max\":%.3f,\"mean\":%.3f}",
+                      histogram.percentile(50) / 1e3, histogram.percentile(99) / 1e3,
+                      histogram.percentile(99.9) / 1e3, histogram.max() / 1e3, histogram.mean() / 1e3);
+        return std::string(out);
+    };
+    std::ostringstream out;
+    out << "{\"requests\":" << stats.all.count() << ",\"errors\":" << stats.errors << ",\"seconds\":" << seconds
+        << ",\"throughput\":" << stats.all.count() / seconds << ",\"connections\":" << config.connections
+        << ",\"pipeline\":" << config.pipeline << ",\"keyspace\":" << config.keyspace
+        << ",\"value_size\":" << config.value_size << ",\"threads\":" << config.threads
+        << ",\"latency_us\":" << latency(stats.all) << ",\"commands\":{";
+    bool first = true;
+    for (size_t i = 0; i < kKinds; ++i) {
+        if (stats.commands[i].count() == 0) {
+            continue;
+        }
+        out << (first ? "" : ",") << "\"" << kKindNames[i] << "\":{\"requests\":" << stats.commands[i].count()
+            << ",\"latency_us\":" << latency(stats.commands[i]) << "}";
+        first = false;
+    }
+    out << "}}";
+    std::cout << out.str() << std::endl;
+}
+
+} // namespace
+
+int main(int argc, char* argv[]) {
+    try {
+        Config config = parseArgs(argc, argv);
+        asio::io_context io_context(static_cast<int>(config.threads));
+        tcp::resolver resolver(io_context);
+        auto endpoints = resolver.resolve(config.host, config.port);
+
+        Budget budget{config.requests, std::nullopt};
+        if (config.duration > 0) {
+            budget.deadline = Clock::now() + std::chrono::duration_cast<Clock::duration>(
+                                                 std::chrono::duration<double>(config.duration));
+        }
+        std::vector<std::shared_ptr<Connection>> connections;
+        for (size_t i = 0; i < config.connections; ++i) {
+            connections.push_back(std::make_shared<Connection>(io_context, config, budget, 0x9e3779b97f4a7c15ULL * (i + 1)));
+            connections.back()->start(endpoints);
+        }
+
+        auto start = Clock::now();
+        std::vector<std::thread> workers;
+        for (size_t i = 1; i < config.threads; ++i) {
+            workers.emplace_back([&io_context]() { io_context.run(); });
+        }
+        io_context.run();
+        for (auto& worker : workers) {
+            worker.join();
+        }
+        double seconds = std::max(std::chrono::duration<double>(Clock::now() - start).count(), 1e-9);
+
+        Stats total;
+        for (const auto& connection : connections) {
+            total.merge(connection->stats());
+        }
+        if (config.json) {
+            printJson(config, total, seconds);
+        } else {
+            printText(config, total, seconds);
+        }
+    } catch (std::exception& e) {
+        std::cerr << "Exception: " << e.what() << std::endl;
+        return 1;
+    }
+    return 0;
+}
@@ -0,0 +1,99 @@
+#ifndef AOF_HPP
+#define AOF_HPP
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <sys/types.h>
+#include <thread>
+#include <vector>
+#include <asio.hpp>
+#include "keyspace.hpp"
+
+namespace redis_server {
+
+class CoreGroup;
+
+enum class AppendFsync { Always, EverySec, No };
+
+// Append-only file: every write command, in RESP, so replaying the file rebuilds the dataset.
+// Commands appended during one event-loop iteration are written with one write() from a task posted behind
+// them. With appendfsync always that task also fsyncs, and the replies of all those commands are only
+// released afterwards (group commit). everysec fsyncs from a background thread, no leaves it to the kernel.
+class AppendOnlyFile {
+public:
+    // cores is set in shared-nothing mode, where pausing the cores replaces the shard locks
+    AppendOnlyFile(std::string path, AppendFsync policy, std::shared_ptr<Keyspace> keyspace, CoreGroup* cores = nullptr);
+    ~AppendOnlyFile();
+    AppendOnlyFile(const AppendOnlyFile&) = delete;
+    AppendOnlyFile& operator=(const AppendOnlyFile&) = delete;
+
+    static std::optional<AppendFsync> parsePolicy(std::string_view text);
+
+    // Opens (or creates) the file for appending
+    bool open(std::string& error);
+    AppendFsync policy() const { return policy_; }
+    // Appends one command and returns the log offset just past it. The write is scheduled on executor.
+    size_t append(std::string_view command, const asio::any_io_executor& executor);
+    // Returns true if everything up to offset is on disk, otherwise posts release to executor once it is
+    bool waitDurable(size_t offset, const asio::any_io_executor& executor, std::function<void()> release);
+
+    // BGREWRITEAOF: forks a child writing the smallest command list that rebuilds the keyspace, commands
+    // appended meanwhile are added once it is done. The caller must keep the keyspace still while it runs.
+    // restart kills a rewrite already running, whose file would miss a dataset replaced since (ie: full resync).
+    bool startRewrite(bool restart = false);
+    bool rewriteInProgress() const;
+    std::string info() const; // aof fields of INFO persistence
+    // Called every 100 ms: retries a failed write, finishes a rewrite and starts one once the file doubled
+    // since the last one
+    void cron();
+
+private:
+    struct Waiter {
+        size_t offset;
+        asio::any_io_executor executor;
+        std::function<void()> release;
+    };
+
+    void writePending();
+    bool installRewrite(std::vector<Waiter>& released);
+    void releaseDurable(std::vector<Waiter>& released);
+    void fsyncLoop();
+
+    std::string path_;
+    AppendFsync policy_;
+    std::shared_ptr<Keyspace> keyspace_;
+    CoreGroup* cores_;
+    std::mutex io_mutex_;       // serialises writing to and swapping the file, taken before mutex_
+    int fd_ = -1;
+    size_t file_size_ = 0;
+    size_t base_size_ = 0;      // size right after the last rewrite, for the automatic rewrite
+    mutable std::mutex mutex_;  // guards everything below
+    std::string buffer_;        // appended, not written yet
+    size_t appended_ = 0;       // log offsets: appended_ >= written_ >= durable_
+    size_t written_ = 0;
+    size_t durable_ = 0;
+    bool write_scheduled_ = false;
+    bool last_write_ok_ = true; // a failed write is kept in buffer_ and retried
+    std::vector<Waiter> waiters_;
+    pid_t child_ = -1;
+    std::string rewrite_path_;
+    std::string rewrite_buffer_; // commands appended since the rewrite child forked
+    bool last_rewrite_ok_ = true;
+    // everysec
+    std::thread fsync_thread_;
+    std::condition_variable stop_cv_;
+    bool stopping_ = false;
+    size_t synced_ = 0;
+};
+
+} // namespace redis_server
+
+#endif // AOF_HPP
@@ -0,0 +1,126 @@
+#ifndef COMMAND_STATS_HPP
+#define COMMAND_STATS_HPP
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <span>
+#include <string>
+#include <string_view>
+#include <vector>
+#include "command_table.hpp"
+#include "latency_histogram.hpp"
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+
+namespace redis_server {
+
+// Cheapest clock there is: the TSC where available, steady_clock ns elsewhere. Only differences mean anything.
+inline uint64_t readTicks() {
+#if defined(__x86_64__) || defined(__i386__)
+    return __rdtsc();
+#else
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(
+        std::chrono::steady_clock::now().time_since_epoch()).count();
+#endif
+}
+
+// Measured once, on first use
+double ticksPerMicrosecond();
+
+// Calls, time and latency histogram of every command (INFO commandstats and latencystats).
+// Every thread counts into its own block, which only it writes, so recording takes no lock and no locked
+// instruction; INFO adds the blocks up. With latency tracking off commands are not timed at all.
+class CommandStats {
+public:
+    CommandStats();
+    CommandStats(const CommandStats&) = delete;
+    CommandStats& operator=(const CommandStats&) = delete;
+
+    bool enabled() const { return enabled_.load(std::memory_order_relaxed); }
+    void setEnabled(bool enabled) { enabled_.store(enabled, std::memory_order_relaxed); }
+    void record(const CommandSpec& command, uint64_t ticks);
+
+    std::string commandStatsInfo() const; // # Commandstats section of INFO
+    std::string latencyStatsInfo() const; // # Latencystats section of INFO
+
+private:
+    // Written by its thread only, read by anyone: a plain load and store instead of a read-modify-write
+    class OwnedCounter {
+    public:
+        void add(uint64_t n) { value_.store(value_.load(std::memory_order_relaxed) + n, std::memory_order_relaxed); }
+        uint64_t load() const { return value_.load(std::memory_order_relaxed); }
+
+    private:
+        std::atomic<uint64_t> value_{0};
+    };
+
+    struct CommandCounters {
+        OwnedCounter calls;
+        OwnedCounter ticks;
+        std::atomic<OwnedCounter*> buckets{nullptr}; // LatencyHistogram buckets, allocated on the first call
+    };
+
+    struct ThreadBlock {
+        explicit ThreadBlock(size_t commands) : commands(commands) {}
+        std::vector<CommandCounters> commands;
+        std::vector<std::unique_ptr<OwnedCounter[]>> owned_buckets;
+    };
+
+    ThreadBlock& threadBlock();
+    // Totals over every thread: calls and ticks per command, and its histogram in ticks
+    void collect(std::vector<uint64_t>& calls, std::vector<uint64_t>& ticks,
+                 std::vector<LatencyHistogram>* histograms) const;
+
+    std::atomic<bool> enabled_{true};
+    mutable std::mutex blocks_mutex_; // only taken to add a thread's block and by INFO
+    std::vector<std::unique_ptr<ThreadBlock>> blocks_;
+};
+
+// SLOWLOG: the last commands that ran longer than a threshold, newest first
+class SlowLog {
+public:
+    static constexpr size_t kMaxArgs = 32;        // like Redis, the rest is summed up in one argument
+    static constexpr size_t kMaxArgLength = 128;
+    static constexpr long long kDefaultThreshold = 10000; // microseconds
+
+    SlowLog() { setThreshold(kDefaultThreshold); }
+
+    bool enabled() const { return threshold_ticks_.load(std::memory_order_relaxed) >= 0; }
+    bool isSlow(uint64_t ticks) const {
+        long long threshold = threshold_ticks_.load(std::memory_order_relaxed);
+        return threshold >= 0 && ticks >= static_cast<uint64_t>(threshold);
+    }
+    // Negative turns the log off, 0 logs every command
+    void setThreshold(long long microseconds);
+    void setMaxLength(size_t length);
+
+    void add(std::span<const std::string_view> args, uint64_t ticks, std::string client);
+    size_t length() const;
+    void reset();
+    // Reply to SLOWLOG GET [count], count < 0 returns every entry
+    std::string format(long long count) const;
+
+private:
+    struct Entry {
+        uint64_t id;
+        int64_t time; // unix seconds
+        uint64_t microseconds;
+        std::vector<std::string> args;
+        std::string client;
+    };
+
+    std::atomic<long long> threshold_ticks_{-1};
+    mutable std::mutex mutex_; // guards everything below, only taken for slow commands
+    std::deque<Entry> entries_; // newest first
+    size_t max_length_ = 128;
+    uint64_t next_id_ = 0;
+};
+
+} // namespace redis_server
+
+#endif // COMMAND_STATS_HPP
@@ -0,0 +1,52 @@
+#ifndef COMMAND_TABLE_HPP
+#define COMMAND_TABLE_HPP
+
+#include <cstddef>
+#include <cstdint>
+#include <span>
+#include <string_view>
+#include <vector>
+#include "resp_parser.hpp"
+
+namespace redis_server {
+
+class Session;
+
+// Command flags, combined as a bitmask in CommandSpec::flags
+enum CommandFlags : uint8_t {
+    CMD_WRITE = 1 << 0,         // modifies the dataset, propagated to replicas
+    CMD_READONLY = 1 << 1,      // only reads the dataset
+    CMD_BLOCKING = 1 << 2,      // may block the client (ie: XREAD BLOCK, WAIT)
+    CMD_NO_QUEUE = 1 << 3,      // runs immediately inside MULTI (ie: EXEC, DISCARD)
+    CMD_MOVABLE_KEYS = 1 << 4,  // key positions depend on the arguments (ie: XREAD ... STREAMS)
+    CMD_ALL_KEYS = 1 << 5,      // touches the whole keyspace (ie: KEYS, EXEC)
+    CMD_DENY_OOM = 1 << 6,      // may grow the dataset, evicts first and is refused over maxmemory
+    CMD_CURSOR = 1 << 7,        // walks the shards in turn, its cursor argument tells which one (ie: SCAN)
+};
+
+using CommandHandler = void (Session::*)(const RespFrame& frame, bool execute);
+
+// Redis style command description: https://redis.io/docs/latest/commands/command/
+struct CommandSpec {
+    std::string_view name;   // uppercase
+    CommandHandler handler;
+    int arity;               // counts the command name, negative means at least -arity arguments
+    uint8_t flags;
+    int first_key;           // 0 if the command has no keys
+    int last_key;            // negative counts from the end
+    int key_step;
+};
+
+// Finds a command by name, case insensitive, with one hash and one comparison. nullptr if unknown.
+const CommandSpec* lookupCommand(std::string_view name);
+// Every command in table order, a command's position is its index (ie: for per-command statistics)
+std::span<const CommandSpec> allCommands();
+inline size_t commandIndex(const CommandSpec& spec) { return static_cast<size_t>(&spec - allCommands().data()); }
+
+bool checkArity(const CommandSpec& spec, size_t argc);
+std::vector<std::string_view> commandKeys(const CommandSpec& spec, const std::vector<std::string_view>& args);
+bool equalsIgnoreCase(std::string_view a, std::string_view b);
+
+} // namespace redis_server
+
+#endif // COMMAND_TABLE_HPP
@@ -0,0 +1,62 @@
+#ifndef CORE_GROUP_HPP
+#define CORE_GROUP_HPP
+
+#include <atomic>
+#include <functional>
+#include <memory>
+#include <string>
+#include <string_view>
+#include <vector>
+#include <asio.hpp>
+#include "keyspace.hpp"
+#include "mpsc_queue.hpp"
+
+namespace redis_server {
+
+class Session;
+class CoreGroup;
+
+// Shared-nothing mode: one event loop per core that exclusively owns one shard of the keyspace.
+// Other cores only talk to it through its inbox.
+struct Core {
+    CoreGroup* group = nullptr;
+    size_t index = 0;
+    asio::io_context io_context{1};
+    std::shared_ptr<Session> executor; // runs commands forwarded by other cores
+
+    // Queues a task to run on this core's thread
+    void post(std::function<void()> task);
+
+private:
+    void drain();
+
+    MpscQueue<std::function<void()>> inbox_;
+    std::atomic<bool> drain_scheduled_{false};
+};
+
+class CoreGroup {
+public:
+    CoreGroup(size_t count, std::shared_ptr<Keyspace> keyspace, std::string dir, std::string dbfilename,
+              unsigned master_repl_offset);
+
+    size_t size() const { return cores_.size(); }
+    Core& core(size_t index) { return *cores_[index]; }
+    // Core owning key, which is also the index of the keyspace shard it owns
+    size_t ownerOf(std::string_view key) const { return keyspace_->shardIndex(key); }
+
+    // Runs every core's event loop on its own thread, blocks until all of them stop
+    void run();
+    // Parks every core and runs fn on the last one to park, so nothing touches the keyspace while it runs
+    // (ie: to fork a consistent snapshot). fn runs asynchronously and must post its result back.
+    // Returns false without running fn if another pause is still in progress.
+    bool runPaused(std::function<void()> fn);
+
+private:
+    std::vector<std::unique_ptr<Core>> cores_;
+    std::shared_ptr<Keyspace> keyspace_;
+    std::atomic<bool> pausing_{false};
+};
+
+} // namespace redis_server
+
+#endif // CORE_GROUP_HPP
@@ -0,0 +1,16 @@
+#ifndef GLOB_HPP
+#define GLOB_HPP
+
+#include <string_view>
+
+namespace redis_server {
+
+// Redis style glob patterns, as taken by KEYS and SCAN MATCH: * matches any run of characters, ? any one,
+// [abc] [a-z] [^abc] a set, and \ makes the next character literal.
+bool globMatch(std::string_view pattern, std::string_view text);
+// True if pattern has no special characters, so it only matches itself and a lookup can replace a scan
+bool globIsLiteral(std::string_view pattern);
+
+} // namespace redis_server
+
+#endif // GLOB_HPP
@@ -0,0 +1,482 @@
+#ifndef KEY_TABLE_HPP
+#define KEY_TABLE_HPP
+
+#include <algorithm>
+#include <bit>
+#include <cstddef>
+#include <cstdint>
+#include <cstdlib>
+#include <new>
+#include <functional>
+#include <memory>
+#include <string>
+#include <string_view>
+#include <type_traits>
+#include <utility>
+#include <sys/mman.h>
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+namespace redis_server {
+
+// Hash table from string keys to V, Swiss table style: open addressing over groups of 16 slots, each slot
+// described by one control byte (empty, deleted, or 7 bits of the key's hash). A lookup compares the 16
+// control bytes of a group at once and only looks at the keys whose bits match, entries are stored inline
+// in one array (short keys stay inside std::string, no allocation at all).
+//
+// Growing is incremental, like Redis' dict: a full table starts a new one twice the size and every insert
+// then moves a group of the old table over, lookups check both until the old one is drained. No single
+// insert pays for rehashing the whole table, rehashStep() lets an idle server finish the job.
+//
+// Lookups take a std::string_view. Inserts invalidate iterators, erase only invalidates the erased one.
+template <typename V>
+class KeyTable {
+public:
+    struct Entry {
+        std::string first;
+        V second;
+    };
+    using value_type = Entry;
+
+    template <bool Const>
+    class Iterator {
+    public:
+        using Owner = std::conditional_t<Const, const KeyTable, KeyTable>;
+        using Reference = std::conditional_t<Const, const Entry&, Entry&>;
+        using Pointer = std::conditional_t<Const, const Entry*, Entry*>;
+
+        Iterator() = default;
+        Iterator(Owner* owner, int table, size_t index) : owner_(owner), table_(table), index_(index) {}
+        // iterator converts to const_iterator
+        template <bool OtherConst, typename = std::enable_if_t<Const && !OtherConst>>
+        Iterator(const Iterator<OtherConst>& other) : owner_(other.owner_), table_(other.table_), index_(other.index_) {}
+
+        Reference operator*() const { return owner_->tables_[table_].slots[index_]; }
+        Pointer operator->() const { return &owner_->tables_[table_].slots[index_]; }
+        Iterator& operator++() {
+            ++index_;
+            skipEmpty();
+            return *this;
+        }
+        bool operator==(const Iterator& other) const { return table_ == other.table_ && index_ == other.index_; }
+
+    private:
+        friend class KeyTable;
+        template <bool>
+        friend class Iterator;
+
+        // Moves forward to the next entry, from the current table into the old one, then to end()
+        void skipEmpty() {
+            while (table_ < 2) {
+                const Table& table = owner_->tables_[table_];
+                while (index_ < table.capacity && !isFull(table.ctrl[index_])) {
+                    ++index_;
+                }
+                if (index_ < table.capacity) {
+                    return;
+                }
+                ++table_;
+                index_ = 0;
+            }
+        }
+
+        Owner* owner_ = nullptr;
+        int table_ = 2; // 0 current, 1 old, 2 end
+        size_t index_ = 0;
+    };
+    using iterator = Iterator<false>;
+    using const_iterator = Iterator<true>;
+
+    KeyTable() = default;
+    ~KeyTable() {
+        release(tables_[0]);
+        release(tables_[1]);
+    }
+    KeyTable(const KeyTable&) = delete;
+    KeyTable& operator=(const KeyTable&) = delete;
+    KeyTable(KeyTable&& other) noexcept { swap(other); }
+    KeyTable& operator=(KeyTable&& other) noexcept {
+        swap(other);
+        return *this;
+    }
+
+    size_t size() const { return tables_[0].size + tables_[1].size; }
+    bool empty() const { return size() == 0; }
+    bool rehashing() const { return tables_[1].capacity != 0; }
+
+    iterator begin() { return first<false>(this); }
+    iterator end() { return iterator(this, 2, 0); }
+    const_iterator begin() const { return first<true>(this); }
+    const_iterator end() const { return const_iterator(this, 2, 0); }
+
+    iterator find(std::string_view key) {
+        size_t hash = hashOf(key);
+        for (int t = 0; t < 2; ++t) {
+            size_t index = findIn(tables_[t], key, hash);
+            if (index != kNotFound) {
+                return iterator(this, t, index);
+            }
+        }
+        return end();
+    }
+    const_iterator find(std::string_view key) const { return const_cast<KeyTable*>(this)->find(key); }
+    size_t count(std::string_view key) const { return find(key) != end(); }
+
+    // Inserts V(args...) under key unless key is already there. Returns the entry and whether it is new.
+    template <typename K, typename... Args>
+    std::pair<iterator, bool> try_emplace(K&& key, Args&&... args) {
+        rehashStep(kGroupsPerInsert); // first, so the iterator returned stays valid
+        std::string_view view(key);
+        size_t hash = hashOf(view);
+        for (int t = 0; t < 2; ++t) {
+            size_t index = findIn(tables_[t], view, hash);
+            if (index != kNotFound) {
+                return {iterator(this, t, index), false};
+            }
+        }
+        if (tables_[0].growth_left == 0) {
+            grow();
+        }
+        size_t index = insertSlot(tables_[0], hash);
+        std::construct_at(&tables_[0].slots[index], Entry{std::string(std::forward<K>(key)), V(std::forward<Args>(args)...)});
+        return {iterator(this, 0, index), true};
+    }
+
+    template <typename K, typename M>
+    std::pair<iterator, bool> insert_or_assign(K&& key, M&& value) {
+        auto result = try_emplace(std::forward<K>(key), std::forward<M>(value));
+        if (!result.second) {
+            result.first->second = std::forward<M>(value);
+        }
+        return result;
+    }
+
+    void erase(iterator it) {
+        Table& table = tables_[it.table_];
+        std::destroy_at(&table.slots[it.index_]);
+        // A group that still has an empty slot ends every probe passing through it, so nothing can be
+        // stored behind this slot and it can become empty again. Otherwise probes must go on: tombstone.
+        size_t group = it.index_ & ~(kGroupSize - 1);
+        if (matchEmpty(table.ctrl + group) != 0) {
+            table.ctrl[it.index_] = kEmpty;
+            ++table.growth_left;
+        } else {
+            table.ctrl[it.index_] = kDeleted;
+        }
+        --table.size;
+        if (it.table_ == 1 && table.size == 0) {
+            release(table);
+        }
+    }
+
+    size_t erase(std::string_view key) {
+        iterator it = find(key);
+        if (it == end()) {
+            return 0;
+        }
+        erase(it);
+        return 1;
+    }
+
+    void clear() {
+        release(tables_[0]);
+        release(tables_[1]);
+    }
+
+    // Sizes the table for keys entries at once, the only place a whole table is rehashed in one go. Meant for
+    // bulk loads, before the server accepts clients.
+    void reserve(size_t keys) {
+        size_t capacity = capacityFor(keys);
+        if (capacity <= tables_[0].capacity) {
+            return;
+        }
+        rehashStep(SIZE_MAX);
+        Table old = std::exchange(tables_[0], allocate(capacity));
+        tables_[1] = old;
+        migrate_group_ = 0;
+        rehashStep(SIZE_MAX);
+    }
+
+    // Moves up to groups groups of the old table over while rehashing
+    void rehashStep(size_t groups) {
+        Table& old = tables_[1];
+        for (; groups > 0 && old.capacity != 0; --groups) {
+            size_t group = migrate_group_ * kGroupSize;
+            for (size_t index = group; index < group + kGroupSize; ++index) {
+                if (isFull(old.ctrl[index])) {
+                    Entry& entry = old.slots[index];
+                    size_t slot = insertSlot(tables_[0], hashOf(entry.first));
+                    std::construct_at(&tables_[0].slots[slot], std::move(entry));
+                    std::destroy_at(&entry);
+                    old.ctrl[index] = kDeleted; // empty would cut the probes of keys not moved yet
+                    --old.size;
+                }
+            }
+            if (++migrate_group_ * kGroupSize == old.capacity || old.size == 0) {
+                release(old);
+            } else if (migrate_group_ % kGroupsPerTrim == 0) {
+                trimMigrated(old);
+            }
+        }
+    }
+
+    // Returns an entry close to a random position, or end() if empty. Not uniform, entries behind a run of
+    // empty slots come up more often, but good enough for sampling (ie: eviction).
+    iterator randomEntry(size_t random) {
+        if (empty()) {
+            return end();
+        }
+        int t = random % size() < tables_[1].size ? 1 : 0;
+        const Table& table = tables_[t];
+        size_t start = (random / 2) & (table.capacity - 1);
+        for (size_t i = 0; i < table.capacity; ++i) {
+            size_t index = (start + i) & (table.capacity - 1);
+            if (isFull(table.ctrl[index])) {
+                return iterator(this, t, index);
+            }
+        }
+        return end();
+    }
+
+    // SCAN: calls fn with the entries of the next home group(s) and returns the cursor to continue from, 0 once
+    // every group was visited. As in Redis the cursor counts groups in reverse binary, so when the table grows
+    // or shrinks in between the groups already visited stay covered: every entry present for the whole scan is
+    // returned at least once, some may come twice. fn must not change the table.
+    template <typename Fn>
+    size_t scan(size_t cursor, Fn fn) const {
+        const Table* small = &tables_[0];
+        const Table* large = &tables_[1];
+        if (small->capacity == 0) {
+            std::swap(small, large);
+        }
+        if (small->capacity == 0) {
+            return 0;
+        }
+        if (large->capacity != 0 && large->capacity < small->capacity) {
+            std::swap(small, large);
+        }
+        size_t m0 = small->capacity / kGroupSize - 1;
+        scanGroup(*small, cursor & m0, fn);
+        if (large->capacity == 0) {
+            cursor |= ~m0;
+            return reverseBits(reverseBits(cursor) + 1);
+        }
+        // While rehashing the home groups of the larger table that cursor's group in the smaller one expands to
+        size_t m1 = large->capacity / kGroupSize - 1;
+        do {
+            scanGroup(*large, cursor & m1, fn);
+            cursor |= ~m1;
+            cursor = reverseBits(reverseBits(cursor) + 1);
+        } while (cursor & (m0 ^ m1));
+        return cursor;
+    }
+
+private:
+    static constexpr size_t kGroupSize = 16;
+    static constexpr size_t kMaxLoadNumerator = 7; // a table is grown once 7/8 of its slots are used
+    static constexpr size_t kMaxLoadDenominator = 8;
+
+public:
+    // Bytes of slot array and control bytes per entry when the table is at its maximum load
+    static constexpr size_t kSlotBytes = (sizeof(Entry) + 1) * kMaxLoadDenominator / kMaxLoadNumerator;
+
+private:
+    static constexpr size_t kGroupsPerInsert = 1;  // drains the old table long before the new one fills up
+    static constexpr size_t kGroupsPerTrim = 256;
+    static constexpr size_t kNotFound = SIZE_MAX;
+    // Full slots have the high bit set next to 7 bits of the hash. Empty is 0 so a new table comes from
+    // calloc, zeroed lazily by the kernel instead of a memset of the whole control array at once.
+    static constexpr int8_t kEmpty = 0;
+    static constexpr int8_t kDeleted = 1;
+
+    struct Table {
+        int8_t* ctrl = nullptr;
+        Entry* slots = nullptr;
+        size_t capacity = 0;    // 0 or a power of two, at least one group
+        size_t size = 0;
+        size_t growth_left = 0; // empty slots that may still be used before growing, tombstones are reused freely
+    };
+
+    static bool isFull(int8_t ctrl) { return ctrl < 0; }
+
+    // std::hash is not mixed enough in its low bits for the keyspace, which already picked the shard with them
+    static size_t hashOf(std::string_view key) {
+        return std::hash<std::string_view>{}(key) * 0x9E3779B97F4A7C15ull;
+    }
+    static int8_t h2(size_t hash) { return static_cast<int8_t>(0x80 | (hash >> (sizeof(size_t) * 8 - 7))); }
+
+    // Bitmasks over the 16 control bytes of a group
+#if defined(__SSE2__)
+    static uint32_t match(const int8_t* group, int8_t value) {
+        __m128i ctrl = _mm_loadu_si128(reinterpret_cast<const __m128i*>(group));
+        return _mm_movemask_epi8(_mm_cmpeq_epi8(ctrl, _mm_set1_epi8(value)));
+    }
+    static uint32_t matchEmptyOrDeleted(const int8_t* group) {
+        return ~_mm_movemask_epi8(_mm_loadu_si128(reinterpret_cast<const __m128i*>(group))) & 0xFFFF;
+    }
+#else
+    static uint32_t match(const int8_t* group, int8_t value) {
+        uint32_t mask = 0;
+        for (size_t i = 0; i < kGroupSize; ++i) {
+            mask |= static_cast<uint32_t>(group[i] == value) << i;
+        }
+        return mask;
+    }
+    static uint32_t matchEmptyOrDeleted(const int8_t* group) {
+        uint32_t mask = 0;
+        for (size_t i = 0; i < kGroupSize; ++i) {
+            mask |= static_cast<uint32_t>(group[i] >= 0) << i;
+        }
+        return mask;
+    }
+#endif
+    static uint32_t matchEmpty(const int8_t* group) { return match(group, kEmpty); }
+
+    // Probes groups in triangular steps, which visits every group of a power of two table
+    static size_t findIn(const Table& table, std::string_view key, size_t hash) {
+        if (table.capacity == 0) {
+            return kNotFound;
+        }
+        size_t mask = table.capacity / kGroupSize - 1;
+        size_t group = (hash >> 7) & mask;
+        for (size_t step = 1;; ++step) {
+            const int8_t* ctrl = table.ctrl + group * kGroupSize;
+            for (uint32_t bits = match(ctrl, h2(hash)); bits != 0; bits &= bits - 1) {
+                size_t index = group * kGroupSize + std::countr_zero(bits);
+                if (table.slots[index].first == key) {
+                    return index;
+                }
+            }
+            if (matchEmpty(ctrl) != 0) {
+                return kNotFound;
+            }
+            group = (group + step) & mask;
+        }
+    }
+
+    static size_t reverseBits(size_t v) {
+        size_t bits = sizeof(v) * 8;
+        size_t mask = ~size_t(0);
+        while ((bits >>= 1) > 0) {
+            mask ^= mask << bits;
+            v = ((v >> bits) & mask) | ((v << bits) & ~mask);
+        }
+        return v;
+    }
+
+    // Entries whose probe sequence starts at home, they sit in the groups up to the first one with an empty slot
+    template <typename Fn>
+    static void scanGroup(const Table& table, size_t home, Fn& fn) {
+        size_t mask = table.capacity / kGroupSize - 1;
+        size_t group = home;
+        for (size_t step = 1;; ++step) {
+            const int8_t* ctrl = table.ctrl + group * kGroupSize;
+            for (uint32_t bits = ~matchEmptyOrDeleted(ctrl) & 0xFFFF; bits != 0; bits &= bits - 1) {
+                const Entry& entry = table.slots[group * kGroupSize + std::countr_zero(bits)];
+                if (((hashOf(entry.first) >> 7) & mask) == home) {
+                    fn(entry);
+                }
+            }
+            if (matchEmpty(ctrl) != 0) {
+                return;
+            }
+            group = (group + step) & mask;
+        }
+    }
+
+    // Claims the first empty or deleted slot on hash's probe sequence, the key must not be in the table
+    static size_t insertSlot(Table& table, size_t hash) {
+        size_t mask = table.capacity / kGroupSize - 1;
+        size_t group = (hash >> 7) & mask;
+        for (size_t step = 1;; ++step) {
+            uint32_t bits = matchEmptyOrDeleted(table.ctrl + group * kGroupSize);
+            if (bits != 0) {
+                size_t index = group * kGroupSize + std::countr_zero(bits);
+                table.growth_left -= table.ctrl[index] == kEmpty;
+                table.ctrl[index] = h2(hash);
+                ++table.size;
+                return index;
+            }
+            group = (group + step) & mask;
+        }
+    }
+
+    // Starts moving everything to a new table: twice as large, or as large if tombstones filled this one
+    void grow() {
+        rehashStep(SIZE_MAX); // only left over if the table filled up within a few inserts, ie: after reserve
+        size_t capacity = tables_[0].capacity;
+        if (capacity == 0 || tables_[0].size * 16 > capacity * 7) {
+            capacity = capacity == 0 ? kGroupSize : capacity * 2;
+        }
+        tables_[1] = std::exchange(tables_[0], allocate(capacity));
+        migrate_group_ = 0;
+    }
+
+    // Hands the pages of slots already moved out of the old table back to the kernel. Freeing a large table
+    // in one go costs milliseconds of page unmapping, this spreads it over the inserts that drain it.
+    void trimMigrated(Table& old) {
+        const uintptr_t page = 4096;
+        uintptr_t base = reinterpret_cast<uintptr_t>(old.slots);
+        uintptr_t begin = reinterpret_cast<uintptr_t>(old.slots + (migrate_group_ - kGroupsPerTrim) * kGroupSize);
+        uintptr_t end = reinterpret_cast<uintptr_t>(old.slots + migrate_group_ * kGroupSize);
+        // Never the page holding the start of the allocation, the allocator keeps its header there
+        begin = std::max((base + page - 1) & ~(page - 1), begin & ~(page - 1));
+        end &= ~(page - 1);
+        if (begin < end) {
+            ::madvise(reinterpret_cast<void*>(begin), end - begin, MADV_DONTNEED);
+        }
+    }
+
+    static size_t capacityFor(size_t keys) {
+        size_t capacity = kGroupSize;
+        while (capacity * kMaxLoadNumerator / kMaxLoadDenominator < keys) {
+            capacity *= 2;
+        }
+        return capacity;
+    }
+
+    static Table allocate(size_t capacity) {
+        Table table;
+        table.ctrl = static_cast<int8_t*>(std::calloc(capacity, 1));
+        if (table.ctrl == nullptr) {
+            throw std::bad_alloc();
+        }
+        table.slots = std::allocator<Entry>().allocate(capacity);
+        table.capacity = capacity;
+        table.growth_left = capacity * kMaxLoadNumerator / kMaxLoadDenominator;
+        return table;
+    }
+
+    static void release(Table& table) {
+        for (size_t i = 0; i < table.capacity && table.size != 0; ++i) { // a drained old table has nothing left
+            if (isFull(table.ctrl[i])) {
+                std::destroy_at(&table.slots[i]);
+            }
+        }
+        if (table.capacity != 0) {
+            std::free(table.ctrl);
+            std::allocator<Entry>().deallocate(table.slots, table.capacity);
+        }
+        table = Table{};
+    }
+
+    template <bool Const, typename Owner>
+    static Iterator<Const> first(Owner* owner) {
+        Iterator<Const> it(owner, 0, 0);
+        it.skipEmpty();
+        return it;
+    }
+
+    void swap(KeyTable& other) {
+        std::swap(tables_, other.tables_);
+        std::swap(migrate_group_, other.migrate_group_);
+    }
+
+    Table tables_[2];          // the current table, and the one being drained into it while rehashing
+    size_t migrate_group_ = 0; // next group of the old table to move
+};
+
+} // namespace redis_server
+
+#endif // KEY_TABLE_HPP
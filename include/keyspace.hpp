@@ -0,0 +1,154 @@
+#ifndef KEYSPACE_HPP
+#define KEYSPACE_HPP
+
+#include <atomic>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <random>
+#include <unordered_map>
+#include <string_view>
+#include <vector>
+#include "storage.hpp"
+
+namespace redis_server {
+
+// Wakes one client blocked on a stream key (XREAD BLOCK). Called with the shard lock held, so it must only post.
+using StreamWaiter = std::function<void()>;
+
+// Set once a key watched by a client (WATCH) changes, its EXEC then aborts. Shared by every key the client
+// watches, possibly in several shards.
+using WatchFlag = std::atomic<bool>;
+
+// What to evict once a shard is over its share of maxmemory
+enum class EvictionPolicy { NoEviction, AllKeysLru, AllKeysLfu, VolatileTtl };
+
+std::optional<EvictionPolicy> parseEvictionPolicy(std::string_view name);
+std::string_view evictionPolicyName(EvictionPolicy policy);
+
+// One slice of the keyspace. Every key lives in exactly one shard, chosen by key hash.
+struct Shard {
+    StringStorageType strings;
+    StreamStorageType streams;
+    DeadlineStorageType deadlines; // deadline of every string key that has an expiry
+    ExpiryIndex expires;           // the same deadlines, ordered for active expiry
+    std::unordered_map<std::string, std::vector<std::shared_ptr<StreamWaiter>>> stream_waiters;
+    std::unordered_map<std::string, std::vector<std::shared_ptr<WatchFlag>>> watched_keys;
+    std::mutex mutex;
+    // Estimated bytes held by the keys of this shard: keys, values and the table entries around them.
+    // Only changed under the shard lock, atomic so INFO can read it from any thread.
+    std::atomic<size_t> used_memory = 0;
+    std::atomic<size_t> evicted_keys = 0;
+    size_t max_memory = 0; // this shard's share of maxmemory, 0 means no limit
+    EvictionPolicy policy = EvictionPolicy::NoEviction;
+
+    // Returns the entry for key, or end() if missing. Expired keys are removed on access, others are touched.
+    StringStorageType::iterator findString(const std::string& key);
+    void setString(const std::string& key, StringValue value, TimePoint expiry = TimePoint::max());
+    // Stores an integer in place, the key keeps its expiry
+    void setInteger(StringStorageType::iterator it, int64_t value);
+    TimePoint expiryOf(StringStorageType::iterator it) const;
+    void setExpiry(StringStorageType::iterator it, TimePoint expiry);
+    void eraseString(StringStorageType::iterator it);
+    void setStream(std::string key, Stream stream);
+    // Appends an entry, creating the stream if needed. id must be greater than the stream's last one.
+    void appendToStream(const std::string& key, const StreamId& id, const std::vector<std::string_view>& fields);
+    // Removes key whatever its type, returns false if it did not exist
+    bool eraseKey(const std::string& key);
+
+    bool overMemoryLimit() const { return max_memory != 0 && used_memory.load(std::memory_order_relaxed) > max_memory; }
+    // Removes the best key to evict according to policy and stores its name in key. Candidates come from a
+    // few randomly sampled keys per call, kept in a small pool of the best ones seen so far (like Redis).
+    // Returns false if nothing can be evicted (noeviction, or no key with an expiry for volatile-ttl).
+    bool evictOne(std::string& key);
+    // Removes expired keys, earliest deadline first, until none are left or the time budget is used up.
+    // Their names are added to removed_keys, to be deleted on replicas and in the AOF as well.
+    size_t expireCycle(std::chrono::steady_clock::duration budget, std::vector<std::string>& removed_keys);
+    // Moves part of a table that is growing, inserts alone would leave an idle shard probing two tables
+    void rehashStep();
+    // Drops every key and flags every watcher, blocked clients and watchers stay registered
+    void clear();
+    // Sizes the tables up front so adding that many keys never rehashes (ie: while loading an RDB)
+    void reserve(size_t keys, size_t expires);
+
+    void addStreamWaiter(const std::string& key, std::shared_ptr<StreamWaiter> waiter);
+    void removeStreamWaiter(const std::string& key, const std::shared_ptr<StreamWaiter>& waiter);
+    // Wakes every client blocked on key, they stay registered until they remove themselves
+    void wakeStreamWaiters(const std::string& key);
+
+    void addWatcher(const std::string& key, std::shared_ptr<WatchFlag> flag);
+    void removeWatcher(const std::string& key, const std::shared_ptr<WatchFlag>& flag);
+    // Called by everything that changes or removes a key. While no client watches anything in this shard
+    // writers only pay for the empty() check.
+    void touchWatched(const std::string& key) {
+        if (!watched_keys.empty()) {
+            flagWatchers(key);
+        }
+    }
+
+private:
+    struct EvictionCandidate {
+        uint64_t score; // higher is evicted first
+        std::string key;
+    };
+
+    // Updates the access metadata of value: the LRU clock, or the LFU counter
+    void touch(StringValue& value);
+    uint64_t evictionScore(StringStorageType::iterator it) const;
+    void sampleEvictionCandidates();
+    void flagWatchers(const std::string& key);
+
+    std::vector<EvictionCandidate> eviction_pool_; // sorted by score, best candidate last
+    std::minstd_rand eviction_random_;
+};
+
+// Holds the shard locks taken for one command, released on destruction
+class ShardLock {
+public:
+    ShardLock() = default;
+    ShardLock(ShardLock&&) = default;
+    ShardLock& operator=(ShardLock&&) = default;
+
+    void add(std::mutex& mutex);
+
+private:
+    std::vector<std::unique_lock<std::mutex>> locks_;
+};
+
+class Keyspace {
+public:
+    // With a single shard nothing is shared between threads and locking is skipped. In shared-nothing
+    // mode every shard is only ever touched by the core owning it, so locking is turned off as well.
+    explicit Keyspace(size_t num_shards = 1, bool locking = true);
+
+    size_t shardCount() const { return shards_.size(); }
+    bool lockingEnabled() const { return locking_ && shards_.size() > 1; }
+    size_t shardIndex(std::string_view key) const;
+    Shard& shard(size_t index) { return *shards_[index]; }
+    Shard& shardFor(std::string_view key) { return *shards_[shardIndex(key)]; }
+    StringStorageType& strings(std::string_view key) { return shardFor(key).strings; }
+    StreamStorageType& streams(std::string_view key) { return shardFor(key).streams; }
+
+    // Locks the shards owning keys, always in shard order so multi key commands can not deadlock
+    ShardLock lockKeys(const std::vector<std::string_view>& keys);
+    ShardLock lockShard(size_t index);
+    ShardLock lockAll();
+
+    // Splits maxmemory evenly over the shards, keys are spread evenly by their hash
+    void setMaxMemory(size_t bytes, EvictionPolicy policy);
+    size_t maxMemory() const { return max_memory_; }
+    EvictionPolicy evictionPolicy() const { return policy_; }
+    size_t usedMemory() const;
+    size_t evictedKeys() const;
+
+private:
+    std::vector<std::unique_ptr<Shard>> shards_;
+    bool locking_;
+    size_t max_memory_ = 0;
+    EvictionPolicy policy_ = EvictionPolicy::NoEviction;
+};
+
+} // namespace redis_server
+
+#endif // KEYSPACE_HPP
@@ -0,0 +1,131 @@
+#ifndef LOGGER_HPP
+#define LOGGER_HPP
+
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <optional>
+#include <ostream>
+#include <streambuf>
+#include <string_view>
+#include <thread>
+#include <utility>
+
+// Levels below this are compiled out entirely, their arguments are not even evaluated.
+// 0 keeps everything (debug), 1 verbose, 2 notice, 3 only warnings. Set by CMake with LOG_COMPILE_LEVEL.
+#ifndef REDIS_LOG_COMPILE_LEVEL
+#define REDIS_LOG_COMPILE_LEVEL 0
+#endif
+
+namespace redis_server {
+
+enum class LogLevel : int { Debug = 0, Verbose = 1, Notice = 2, Warning = 3 };
+
+// Asynchronous logger: a line is formatted on the calling thread into a thread-local buffer, copied into a
+// slot of a fixed-size lock-free ring and written out by a background thread, many lines per write().
+// Callers never block and never allocate, when the ring is full the line is dropped and counted instead.
+class Logger {
+public:
+    static constexpr size_t kSlots = 1024;   // power of two
+    static constexpr size_t kMaxLine = 512;  // longer lines are truncated
+
+    static Logger& instance();
+    static std::optional<LogLevel> parseLevel(std::string_view name);
+
+    // Drains everything still queued before the process exits
+    ~Logger();
+    Logger(const Logger&) = delete;
+    Logger& operator=(const Logger&) = delete;
+
+    void setLevel(LogLevel level) { level_.store(static_cast<int>(level), std::memory_order_relaxed); }
+    bool enabled(LogLevel level) const {
+        return static_cast<int>(level) >= level_.load(std::memory_order_relaxed);
+    }
+    // The calling thread's line buffer, emptied; commit() queues what was written to it
+    std::ostream& begin();
+    void commit(LogLevel level);
+
+private:
+    // Fixed buffer behind the thread-local stream, output past kMaxLine is cut off
+    class LineBuffer : public std::streambuf {
+    public:
+        void reset() { setp(data_.data(), data_.data() + data_.size()); }
+        std::string_view view() const { return {pbase(), static_cast<size_t>(pptr() - pbase())}; }
+
+    private:
+        std::array<char, kMaxLine> data_;
+    };
+    struct ThreadLine;
+    static ThreadLine& threadLine();
+
+    struct Slot {
+        std::atomic<size_t> sequence; // == position when free to write, position + 1 once written
+        LogLevel level;
+        std::chrono::system_clock::time_point time;
+        uint16_t length;
+        char text[kMaxLine];
+    };
+
+    Logger();
+    bool push(LogLevel level, std::string_view text);
+    bool pending() const;
+    void run();
+    void wake();
+
+    std::atomic<int> level_{static_cast<int>(LogLevel::Notice)};
+    Slot slots_[kSlots];
+    std::atomic<size_t> enqueue_position_{0}; // claimed by producers
+    size_t dequeue_position_ = 0;             // only touched by the background thread
+    std::atomic<size_t> dropped_{0};
+    std::atomic<bool> sleeping_{false};       // the background thread waits on this when the ring is empty
+    std::atomic<bool> stopping_{false};
+    std::thread thread_;
+};
+
+// Streams a payload such as a raw command for a log line: control characters escaped, at most limit bytes
+struct LogPayload {
+    std::string_view data;
+    size_t limit = 64;
+};
+std::ostream& operator<<(std::ostream& out, const LogPayload& payload);
+
+} // namespace redis_server
+
+#define REDIS_LOG(level, message)                                                  \
+    do {                                                                           \
+        ::redis_server::Logger& redis_logger_ = ::redis_server::Logger::instance(); \
+        if (redis_logger_.enabled(level)) {                                        \
+            redis_logger_.begin() << message;                                      \
+            redis_logger_.commit(level);                                           \
+        }                                                                          \
+    } while (0)
+
+// Unevaluated, only keeps the variables a line would print from being reported as unused
+#define REDIS_LOG_DISABLED(message)                             \
+    do {                                                        \
+        (void)sizeof(std::declval<std::ostream&>() << message); \
+    } while (0)
+
+#if REDIS_LOG_COMPILE_LEVEL <= 0
+#define LOG_DEBUG(message) REDIS_LOG(::redis_server::LogLevel::Debug, message)
+#else
+#define LOG_DEBUG(message) REDIS_LOG_DISABLED(message)
+#endif
+
+#if REDIS_LOG_COMPILE_LEVEL <= 1
+#define LOG_VERBOSE(message) REDIS_LOG(::redis_server::LogLevel::Verbose, message)
+#else
+#define LOG_VERBOSE(message) REDIS_LOG_DISABLED(message)
+#endif
+
+#if REDIS_LOG_COMPILE_LEVEL <= 2
+#define LOG_NOTICE(message) REDIS_LOG(::redis_server::LogLevel::Notice, message)
+#else
+#define LOG_NOTICE(message) REDIS_LOG_DISABLED(message)
+#endif
+
+#define LOG_WARNING(message) REDIS_LOG(::redis_server::LogLevel::Warning, message)
+
+#endif // LOGGER_HPP
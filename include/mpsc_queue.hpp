@@ -0,0 +1,81 @@
+#ifndef MPSC_QUEUE_HPP
+#define MPSC_QUEUE_HPP
+
+#include <atomic>
+#include <optional>
+#include <utility>
+
+namespace redis_server {
+
+// Lock-free multi producer, single consumer queue (Vyukov's intrusive design).
+// push never blocks and never takes a lock; pop must only be called from the owning thread.
+template <typename T>
+class MpscQueue {
+public:
+    MpscQueue() : head_(&stub_), tail_(&stub_) {}
+
+    ~MpscQueue() {
+        while (pop()) {
+        }
+    }
+
+    MpscQueue(const MpscQueue&) = delete;
+    MpscQueue& operator=(const MpscQueue&) = delete;
+
+    void push(T value) {
+        Node* node = new Node{std::move(value), nullptr};
+        Node* prev = head_.exchange(node, std::memory_order_acq_rel);
+        prev->next.store(node, std::memory_order_release);
+    }
+
+    // Returns nothing when empty, or when a producer is half way through a push
+    std::optional<T> pop() {
+        Node* tail = tail_;
+        Node* next = tail->next.load(std::memory_order_acquire);
+        if (tail == &stub_) {
+            if (next == nullptr) {
+                return std::nullopt;
+            }
+            tail_ = next;
+            tail = next;
+            next = next->next.load(std::memory_order_acquire);
+        }
+        if (next != nullptr) {
+            tail_ = next;
+            return take(tail);
+        }
+        if (tail != head_.load(std::memory_order_acquire)) {
+            return std::nullopt; // producer has not linked its node yet
+        }
+        // tail is the last node, put the stub behind it so tail can be handed out
+        stub_.next.store(nullptr, std::memory_order_relaxed);
+        Node* prev = head_.exchange(&stub_, std::memory_order_acq_rel);
+        prev->next.store(&stub_, std::memory_order_release);
+        next = tail->next.load(std::memory_order_acquire);
+        if (next != nullptr) {
+            tail_ = next;
+            return take(tail);
+        }
+        return std::nullopt;
+    }
+
+private:
+    struct Node {
+        T value;
+        std::atomic<Node*> next;
+    };
+
+    std::optional<T> take(Node* node) {
+        std::optional<T> value(std::move(node->value));
+        delete node;
+        return value;
+    }
+
+    std::atomic<Node*> head_; // producers push here
+    Node* tail_;              // consumer pops here
+    Node stub_{T(), nullptr};
+};
+
+} // namespace redis_server
+
+#endif // MPSC_QUEUE_HPP
@@ -0,0 +1,121 @@
+#ifndef RDB_HPP
+#define RDB_HPP
+
+#include <cstdint>
+#include <functional>
+#include <string>
+#include <string_view>
+#include <tuple>
+#include <vector>
+#include <sys/types.h>
+#include "storage.hpp"
+
+namespace redis_server {
+
+class Keyspace;
+struct Shard;
+
+// Writes an RDB file (version 11) through a large buffer, so the file sees few big writes.
+// Strings are saved as type 0 (integers in their compact encoding), streams as type 15 listpacks.
+class RdbWriter {
+public:
+    explicit RdbWriter(int fd);
+
+    void writeHeader();
+    void writeAux(std::string_view key, std::string_view value);
+    void writeSelectDb(uint64_t db);
+    void writeResizeDb(uint64_t keys, uint64_t expires);
+    void writeString(std::string_view key, const StringValue& value, TimePoint expiry);
+    void writeStream(std::string_view key, const Stream& stream);
+    // Writes the EOF marker and flushes, returns false if any write failed
+    bool finish();
+
+    size_t bytesWritten() const { return written_ + buffer_.size(); }
+
+private:
+    static constexpr size_t kBufferSize = 1 << 20;
+
+    void putByte(uint8_t byte);
+    void putLength(uint64_t length);
+    void putRawString(std::string_view value);
+    void flushBuffer();
+
+    int fd_;
+    std::string buffer_;
+    size_t written_ = 0;
+    bool failed_ = false;
+};
+
+// Read-only memory map of a whole file, so loaders parse it in place instead of copying it through a stream
+class MappedFile {
+public:
+    MappedFile() = default;
+    ~MappedFile();
+    MappedFile(const MappedFile&) = delete;
+    MappedFile& operator=(const MappedFile&) = delete;
+
+    bool open(const std::string& path, std::string& error);
+    std::string_view view() const { return {static_cast<const char*>(data_), size_}; }
+
+private:
+    void* data_ = nullptr;
+    size_t size_ = 0;
+};
+
+// Receives what loadRdb decodes. Every callback is optional.
+struct RdbHandler {
+    std::function<void(uint64_t db)> on_select_db;
+    // Resize hint of the current database, sent before its keys
+    std::function<void(uint64_t keys, uint64_t expires)> on_resize;
+    std::function<void(std::string key, StringValue value, TimePoint expiry)> on_string;
+    std::function<void(std::string key, Stream stream)> on_stream;
+    // Keys of types this server does not store (lists, sets, hashes, sorted sets), their values are skipped
+    std::function<void(std::string_view key, uint8_t type)> on_unsupported;
+};
+
+// Decodes an RDB image held in memory, every length and string encoding (integers, LZF) included.
+// Returns false and sets error if it is malformed.
+bool loadRdb(std::string_view data, const RdbHandler& handler, std::string& error);
+
+// Part of an RDB image that starts and ends on a record boundary, so it can be decoded on its own
+struct RdbSegment {
+    size_t begin = 0;
+    size_t end = 0;
+    uint64_t db = 0; // database selected where the segment starts
+};
+
+// Walks the records without decoding any value and cuts the image into about count segments of similar size.
+// Returns false and sets error if it is malformed.
+bool splitRdb(std::string_view data, size_t count, std::vector<RdbSegment>& segments, std::string& error);
+// Decodes the records of one segment of data, segments can be decoded in parallel
+bool loadRdbSegment(std::string_view data, const RdbSegment& segment, const RdbHandler& handler, std::string& error);
+
+// Keys decoded for one shard, kept aside until they can be handed to the shard in one go (by its owning
+// core, or after a parallel load). Values are moved into the shard, never copied.
+struct LoadedKeys {
+    std::vector<std::tuple<std::string, StringValue, TimePoint>> strings;
+    std::vector<std::pair<std::string, Stream>> streams;
+    size_t expires = 0;
+
+    void insertInto(Shard& shard);
+};
+
+// Writes every shard of keyspace as one RDB, returns false if a write failed
+bool writeRdb(Keyspace& keyspace, int fd, size_t* bytes_written = nullptr);
+// Writes keyspace to a temporary file next to path and renames it over path once it is complete and synced,
+// so path always holds a whole snapshot. Returns false if anything failed, path is then left untouched.
+bool saveRdb(Keyspace& keyspace, const std::string& path, size_t* bytes_written = nullptr);
+
+// What a snapshot child measured, written to report_fd when it succeeded
+struct RdbSaveReport {
+    size_t bytes = 0;
+    uint64_t nanoseconds = 0;
+};
+
+// Forks a child that saves a point-in-time RDB of keyspace to path, copy-on-write keeps the parent going.
+// The caller must make sure no thread changes the keyspace during the call. Returns -1 if fork failed.
+pid_t forkRdbSnapshot(Keyspace& keyspace, const std::string& path, int report_fd = -1);
+
+} // namespace redis_server
+
+#endif // RDB_HPP
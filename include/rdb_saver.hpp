@@ -0,0 +1,75 @@
+#ifndef RDB_SAVER_HPP
+#define RDB_SAVER_HPP
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <sys/types.h>
+#include <vector>
+#include "keyspace.hpp"
+
+namespace redis_server {
+
+class CoreGroup;
+
+// Writes the dataset to dir/dbfilename: SAVE in the foreground, BGSAVE in a forked child (copy-on-write
+// keeps clients running), and automatically once one of the "save <seconds> <changes>" rules is met.
+class RdbSaver {
+public:
+    struct Rule {
+        int64_t seconds;
+        size_t changes;
+    };
+
+    // cores is set in shared-nothing mode, where pausing the cores replaces the shard locks
+    RdbSaver(std::shared_ptr<Keyspace> keyspace, std::string path, CoreGroup* cores = nullptr);
+
+    // Parses "<seconds> <changes> [<seconds> <changes> ...]" as given to --save, "" means no automatic saves
+    static std::optional<std::vector<Rule>> parseRules(std::string_view text);
+    void setRules(std::vector<Rule> rules);
+
+    void addChanges(size_t changes) { changes_ += changes; }
+    // SAVE. The caller must keep the keyspace still while it runs.
+    bool save();
+    // BGSAVE. The caller must keep the keyspace still while it runs, which is only as long as the fork takes.
+    // Returns false if a background save is already running or fork failed.
+    bool startBackgroundSave();
+    bool backgroundSaveInProgress() const;
+    int64_t lastSave() const; // unix time of the last successful save
+    std::string info() const; // persistence section of INFO
+    // Called every 100 ms: reaps a finished child and starts a background save once a rule is met
+    void cron();
+
+private:
+    // Runs fn while no thread can change the keyspace: under every shard lock, or in shared-nothing mode once
+    // every core is parked (fn then runs later, on one of their threads). Returns false if fn did not run.
+    bool runWithKeyspaceStill(std::function<void()> fn);
+    void closeReport();
+    void finishSave(bool ok, size_t bytes, std::chrono::steady_clock::duration duration);
+
+    std::shared_ptr<Keyspace> keyspace_;
+    std::string path_;
+    CoreGroup* cores_;
+    std::atomic<size_t> changes_ = 0; // changes since the last successful save
+    mutable std::mutex mutex_;        // guards everything below, SAVE/BGSAVE come from any thread
+    std::vector<Rule> rules_;
+    pid_t child_ = -1;
+    int report_fd_ = -1; // read end of the pipe the child reports its bytes and duration on
+    size_t changes_at_fork_ = 0;
+    std::chrono::steady_clock::time_point child_started_;
+    int64_t last_save_;
+    int64_t last_failure_ = 0;
+    bool last_ok_ = true;
+    std::chrono::steady_clock::duration last_duration_{};
+    size_t last_bytes_ = 0;
+};
+
+} // namespace redis_server
+
+#endif // RDB_SAVER_HPP
@@ -0,0 +1,54 @@
+#ifndef REPL_BACKLOG_HPP
+#define REPL_BACKLOG_HPP
+
+#include <atomic>
+#include <cstddef>
+#include <optional>
+#include <string>
+#include <string_view>
+
+namespace redis_server {
+
+// Fixed-size circular buffer holding the tail of the replication stream, so a replica that reconnects
+// can be sent only the bytes it missed (PSYNC +CONTINUE) instead of a full resync.
+// Offsets count every byte ever propagated, the backlog covers [startOffset(), endOffset()).
+// The history is named by a random replication ID, a replica only continues from the backlog if it asks
+// for the same one. Like in Redis the buffer only exists once the first replica attached, until then nothing
+// is recorded and created() lets writers skip the lock guarding the backlog.
+class ReplicationBacklog {
+public:
+    static constexpr size_t kDefaultSize = 1024 * 1024;
+
+    ReplicationBacklog() : ReplicationBacklog(kDefaultSize) {}
+    explicit ReplicationBacklog(size_t size);
+
+    // Allocates the buffer, the history starts at endOffset()
+    void create();
+    // Readable without the lock, set under it by create()
+    bool created() const { return created_.load(std::memory_order_acquire); }
+    // Drops the buffered history, endOffset() carries on from where it was
+    void resize(size_t size);
+    // The dataset was replaced: drops the buffered history and names the one starting now with a new ID, so
+    // no replica continues from bytes that described the old dataset
+    void newHistory();
+    void append(std::string_view data);
+
+    const std::string& replid() const { return replid_; }
+    size_t startOffset() const { return end_offset_ - length_; }
+    size_t endOffset() const { return end_offset_; }
+    // Bytes from offset up to endOffset(), or nothing if offset is no longer (or not yet) in the backlog
+    std::optional<std::string> copyFrom(size_t offset) const;
+
+private:
+    std::string replid_;    // 40 hex characters, like Redis
+    size_t size_;
+    std::atomic<bool> created_ = false;
+    std::string buffer_;    // empty until created
+    size_t head_ = 0;       // where the next byte is written
+    size_t length_ = 0;     // bytes of history held, at most buffer_.size()
+    size_t end_offset_ = 0; // replication offset just past the last byte appended
+};
+
+} // namespace redis_server
+
+#endif // REPL_BACKLOG_HPP
@@ -0,0 +1,59 @@
+#ifndef RESP_PARSER_HPP
+#define RESP_PARSER_HPP
+
+#include <cstddef>
+#include <string_view>
+#include <utility>
+#include <vector>
+
+namespace redis_server {
+
+// A complete RESP frame. Views point into the buffer that was handed to the parser
+// and stay valid until that buffer is modified.
+struct RespFrame {
+    char type = 0;                       // '*', '$', '+', '-', ':' or 'R' for an rdb payload
+    std::string_view raw;                // all bytes of the frame, including headers and CRLFs
+    std::vector<std::string_view> args;  // bulk strings of an array, or the payload of a single value
+};
+
+// Resumable RESP state machine: https://redis.io/docs/latest/develop/reference/protocol-spec/
+// Feed it the unconsumed part of a buffer; if the frame is not complete yet it remembers how far
+// it got and continues from there once more bytes have been appended to the same buffer.
+class RespParser {
+public:
+    enum class Status { Complete, Incomplete, Error };
+
+    // Same limits as Redis' defaults, a client can not make us allocate for a frame it never sends
+    static constexpr long long kMaxMultibulkLength = 1024 * 1024;
+    static constexpr long long kMaxBulkLength = 512LL * 1024 * 1024;
+
+    Status parse(std::string_view input, RespFrame& frame);
+    void reset();
+    // Set on the link to our master, the only peer whose lone bulk string may be an rdb payload. That payload is
+    // exempt from kMaxBulkLength, from anyone else a lone bulk string is capped like any argument.
+    void setAcceptRdb(bool accept) { accept_rdb_ = accept; }
+    // Why the last parse returned Error, for the "-ERR Protocol error: ..." reply
+    std::string_view error() const { return error_; }
+
+private:
+    enum class State { Start, Line, ArrayHeader, BulkHeader, BulkData };
+
+    bool findLineEnd(std::string_view input, size_t& end);
+    Status finish(std::string_view input, RespFrame& frame);
+    Status fail(std::string_view error);
+
+    State state_ = State::Start;
+    char type_ = 0;
+    size_t pos_ = 0;        // offset in the frame where parsing resumes
+    size_t scan_pos_ = 0;   // offset where the CRLF search resumes for a partial header
+    long long remaining_ = 0;
+    long long bulk_length_ = 0;
+    bool is_rdb_ = false;
+    bool accept_rdb_ = false; // kept by reset()
+    std::string_view error_;
+    std::vector<std::pair<size_t, size_t>> arg_offsets_; // offsets, as the buffer may move between calls
+};
+
+} // namespace redis_server
+
+#endif // RESP_PARSER_HPP
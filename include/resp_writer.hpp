@@ -0,0 +1,24 @@
+#ifndef RESP_WRITER_HPP
+#define RESP_WRITER_HPP
+
+#include <cstddef>
+#include <string>
+#include <string_view>
+#include <vector>
+#include "stream.hpp"
+
+namespace redis_server {
+
+// Reply builders, free of any session or socket so they can be benchmarked on their own
+
+void appendBulkString(std::string& out, std::string_view value);
+// No messages is a null bulk string, one a bulk string, several (or any with always_array) an array of them
+std::string formatBulkStrings(const std::vector<std::string>& messages, bool always_array = false);
+// Array header for messages.size() elements, followed by the messages as bulk strings if with_content
+std::string formatRespArray(const std::vector<std::string>& messages, bool with_content = false);
+// Appends the entries with start <= id <= end as XRANGE replies them, returns how many there were
+size_t appendStreamEntries(std::string& out, const Stream& stream, const StreamId& start, const StreamId& end);
+
+} // namespace redis_server
+
+#endif // RESP_WRITER_HPP
@@ -1,9 +1,23 @@
 #ifndef SESSION_HPP
 #define SESSION_HPP
 
+#include <atomic>
+#include <fstream>
+#include <functional>
 #include <memory>
+#include <mutex>
+#include <optional>
+#include <string_view>
 #include <vector>
 #include <asio.hpp>
+#include "aof.hpp"
+#include "command_stats.hpp"
+#include "command_table.hpp"
+#include "core_group.hpp"
+#include "keyspace.hpp"
+#include "rdb_saver.hpp"
+#include "repl_backlog.hpp"
+#include "resp_parser.hpp"
 #include "storage.hpp"
 
 using asio::ip::tcp; 
@@ -13,63 +27,197 @@ class Session : public std::enable_shared_from_this<Session> {
 public:
     Session(
         asio::ip::tcp::socket socket, 
-        std::shared_ptr<StringStorageType> storage,
+        std::shared_ptr<Keyspace> keyspace,
         std::string dir,
         std::string dbfilename,
         std::string masterdetails,
-        std::string master_repl_id,
-        unsigned master_repl_offset,
-        std::shared_ptr<StreamStorageType> stream_storage
+        unsigned master_repl_offset
     );
     
-    void start();
-    void setReplica(bool replica);
+    void start(std::string initial_data = "");
+    // Marks the connection to our master, offset is where its replication stream continues from
+    void setReplica(bool replica, size_t offset = 0);
+    // Called with the replication offset reached when the connection to our master drops
+    void setOnMasterLost(std::function<void(size_t offset)> on_master_lost);
+    void setCore(Core* core);
+    // Runs one command and returns its reply instead of writing it, used for commands forwarded by other cores.
+    // from_master marks a command our master sent, which is neither evicted for nor propagated again.
+    std::string executeCaptured(std::string_view command, bool from_master = false);
+    // Deletes keys active expiry removed on replicas and in the AOF, under the lock of the shard they were in
+    static void propagateExpired(const std::vector<std::string>& keys, const asio::any_io_executor& executor);
+    // Runs the commands of an append-only file, returns how many bytes held complete commands and transactions
+    size_t replayAppendOnly(std::string_view data);
 
     inline static std::vector<std::shared_ptr<Session>> g_replica_sessions;
+    inline static std::mutex g_replica_sessions_mutex; // sessions run on different threads with --io-threads
+    inline static ReplicationBacklog g_repl_backlog;   // tail of the replication stream and our replid, same mutex
+    inline static std::vector<std::weak_ptr<Session>> g_waiting_sessions; // clients blocked in WAIT, same mutex
+    inline static std::shared_ptr<RdbSaver> g_saver; // SAVE, BGSAVE and the save rules
+    inline static std::shared_ptr<AppendOnlyFile> g_aof; // set with --appendonly yes
+    inline static CommandStats g_command_stats; // INFO commandstats and latencystats, off with --latency-tracking no
+    inline static SlowLog g_slowlog;
 
 private:
+    friend struct CommandTable;
+
     // Private methods (declarations only)
     void read();
-    void propagate(const std::string& command);
-    void processCommands(std::string data);
-    void processCommand(const std::string data, bool execute = false);
-    std::vector<std::string> splitString(const std::string& input, char delimiter);
-    std::vector<std::string> splitMultipleArrayCommands(const std::string& input);
-    void getValidDataTypeChunks(std::string data, std::vector<std::string>& validCommands);
-    void processDataByType(std::string command);
-    bool isDataValidRedisCommand(const std::string& data);
+    void propagate(std::string_view command);
+    size_t processFrames(std::string_view data);
+    void closeOnProtocolError();
+    void processReadBuffer();
+    void processDataByType(const RespFrame& frame);
+    void processCommand(const RespFrame& frame, bool execute = false);
+    void executeCommand(const CommandSpec& command, const RespFrame& frame, bool execute);
+    void queueCommand(const CommandSpec& command, const RespFrame& frame);
+    void clearTransaction();
+    static void propagateToReplicas(std::string_view command);
+    void feedAppendOnly(const RespFrame& frame);
+    void appendToAof(std::string_view command);
+    bool evictForWrite(const CommandSpec& command, const RespFrame& frame);
+    void propagateEviction(const std::string& key);
+    bool routeToOwner(const CommandSpec& command, const RespFrame& frame);
+    void forwardToCore(size_t owner, std::string command);
+    void fanOutToCores(std::string command);
+    void onRemoteReply(const std::string& reply);
+    std::string clientAddress() const;
+
+    // Command handlers, dispatched through the command table
+    void pingCommand(const RespFrame& frame, bool execute);
+    void echoCommand(const RespFrame& frame, bool execute);
+    void setCommand(const RespFrame& frame, bool execute);
+    void delCommand(const RespFrame& frame, bool execute);
+    void getCommand(const RespFrame& frame, bool execute);
+    void incrCommand(const RespFrame& frame, bool execute);
+    void configCommand(const RespFrame& frame, bool execute);
+    void keysCommand(const RespFrame& frame, bool execute);
+    void scanCommand(const RespFrame& frame, bool execute);
+    void infoCommand(const RespFrame& frame, bool execute);
+    void replconfCommand(const RespFrame& frame, bool execute);
+    void psyncCommand(const RespFrame& frame, bool execute);
+    void waitCommand(const RespFrame& frame, bool execute);
+    void typeCommand(const RespFrame& frame, bool execute);
+    void expireCommand(const RespFrame& frame, bool execute);
+    void ttlCommand(const RespFrame& frame, bool execute);
+    void persistCommand(const RespFrame& frame, bool execute);
+    void xaddCommand(const RespFrame& frame, bool execute);
+    void xrangeCommand(const RespFrame& frame, bool execute);
+    void xreadCommand(const RespFrame& frame, bool execute);
+    void multiCommand(const RespFrame& frame, bool execute);
+    void execCommand(const RespFrame& frame, bool execute);
+    void discardCommand(const RespFrame& frame, bool execute);
+    void watchCommand(const RespFrame& frame, bool execute);
+    void unwatchCommand(const RespFrame& frame, bool execute);
+    void saveCommand(const RespFrame& frame, bool execute);
+    void bgsaveCommand(const RespFrame& frame, bool execute);
+    void lastsaveCommand(const RespFrame& frame, bool execute);
+    void bgrewriteaofCommand(const RespFrame& frame, bool execute);
+    void slowlogCommand(const RespFrame& frame, bool execute);
     bool hasAcknowledged(size_t expectedOffset);
-    bool xaadIdIsGreaterThan(const std::string& newId, const std::string& oldId);
-    bool xaadIdIsLessThan(const std::string& newId, const std::string& oldId);
-    std::pair<int, std::string> getStreamEntries(const std::string& key, const std::string& start_id, const std::string& end_id);
-    void checkEntries(const asio::error_code& ec, std::shared_ptr<asio::steady_timer> timer,
-                     const std::vector<std::string>& keys, const std::vector<std::string>& last_seen_ids,
-                     int block_duration_ms, bool execute);
-    std::string format_resp_array(std::vector<std::string> messages, bool formatContent = false);
+    int countAcknowledged(size_t offset);
+    void notifyWaiters();
+    void checkWait(bool timed_out);
+    void dropReplica();
+    void beginFullSync();
+    void startFullSync(pid_t child, const std::string& replid, size_t offset);
+    void waitForSnapshot(pid_t child);
+    void sendSnapshotChunk(std::shared_ptr<std::ifstream> file);
+    void abortFullSync();
+    void loadSnapshot(std::string_view payload);
+    std::pair<int, std::string> getStreamEntries(const std::string& key, StreamId start, StreamId end);
+    bool readStreams(const std::vector<std::string>& keys, const std::vector<StreamId>& after, std::string& result);
+    void blockOnStreams(std::vector<std::string> keys, std::vector<StreamId> after, int block_duration_ms);
+    void serveBlockedRead(bool timed_out);
+    void cancelBlockedRead();
+    ShardLock lockWatchedKeys();
+    void unwatchAll();
+    std::string format_resp_array(const std::vector<std::string>& messages, bool formatContent = false);
+    void queue_write(std::string_view message);
+    void captureReply(std::string_view reply);
+    void flush();
     void manual_write(std::string message, bool execute = false);
     void write_simple_string(std::string message, bool execute = false);
     void write_integer(std::string message, bool execute = false);
     void write_bulk_string(std::string message, bool execute = false);
-    void write(std::vector<std::string> messages, bool size = false, bool execute = false);
+    void write(const std::vector<std::string>& messages, bool size = false, bool execute = false);
 
     // Attributes
     asio::ip::tcp::socket socket_;
-    std::array<char, 1024> buffer_;
-    std::shared_ptr<StringStorageType> string_storage_;
-    std::shared_ptr<StreamStorageType> stream_storage_;
-    std::vector<std::string> past_transactions;
-    std::vector<std::string> exec_responses;
+    std::array<char, 16384> buffer_;
+    std::string read_buffer_; // bytes of a partial frame carried over to the next read
+    RespParser parser_;
+    bool reading_ = false;
+    std::string output_buffer_;  // replies waiting for the next flush
+    std::string writing_buffer_; // replies of the write currently in flight
+    bool writing_ = false;
+    bool in_batch_ = false;
+    bool suppress_replies_ = false; // commands from our master are not answered
+    size_t dirty_ = 0;              // incremented by every change to the dataset
+    Core* core_ = nullptr;          // set in shared-nothing mode
+    bool paused_ = false;           // pipeline paused until another core answers or a blocked read is served
+    bool loading_ = false;          // replaying the AOF, nothing is propagated or logged again
+    // appendfsync always: replies are held until the AOF is on disk up to the last write they answer. Byte
+    // counts since the session started: queued into output_buffer_, allowed out, handed to the socket.
+    size_t aof_wait_offset_ = 0;
+    bool aof_waiting_ = false;
+    size_t queued_bytes_ = 0;
+    size_t released_bytes_ = 0;
+    size_t sent_bytes_ = 0;
+    std::shared_ptr<Keyspace> keyspace_;
+    // Set by a handler whose command must be logged and propagated in another form, ie: XADD with the ID it assigned
+    std::string rewritten_command_;
+    // Replies collected while execute is set (EXEC, commands run for another core) instead of being sent
+    std::string captured_replies_;
+    size_t captured_count_ = 0;
+    // MULTI .. EXEC: commands are checked and parsed once when queued, EXEC runs them without parsing again.
+    // The buffers keep their capacity between transactions, sessions that never run MULTI never touch them.
+    struct QueuedCommand {
+        const CommandSpec* spec;
+        size_t raw_offset;  // the command in transaction_data_
+        size_t raw_length;
+        size_t first_arg;   // its arguments in transaction_args_
+        size_t arg_count;
+    };
+    static constexpr size_t kTransactionBufferKeep = 64 * 1024;
+    bool in_multi_ = false;
+    bool multi_error_ = false; // a command could not be queued, EXEC aborts
+    std::vector<QueuedCommand> transaction_queue_;
+    std::string transaction_data_;
+    std::vector<std::pair<size_t, size_t>> transaction_args_; // offset and length in transaction_data_
+    RespFrame transaction_frame_;
+    bool exec_running_ = false; // writes go to exec_aof_, logged with MULTI and EXEC around them
+    std::string exec_aof_;
+    // WATCH: the keys are registered in their shards with watch_flag_, which any change to one of them sets
+    std::vector<std::string> watched_keys_;
+    std::shared_ptr<WatchFlag> watch_flag_;
     std::string dir_;
     std::string dbfilename_;
     std::string masterdetails_;
-    std::string master_repl_id_;
     unsigned master_repl_offset_;
     bool is_replica_ = false;
+    bool from_master_ = false; // running a command our master sent to the connection of another core
     size_t commandFromMasterSizes = 0;
-    size_t propagatedCommandSizes =  0;
-    size_t lastAcknowledgedBytes = 0;
-    std::shared_ptr<TimePoint> blocking_time;
-    std::shared_ptr<bool> isBlocked = std::make_shared<bool>(false);
+    std::atomic<size_t> lastAcknowledgedBytes = 0; // read by WAIT from other sessions
+    std::function<void(size_t offset)> on_master_lost_;
+    // Full resync of a replica of ours: while the snapshot is sent, propagated writes wait in pending_replication_
+    bool sync_pending_ = false;
+    std::string snapshot_path_; // temporary file the forked child writes the snapshot to
+    std::string pending_replication_;
+    std::function<void()> on_flushed_; // runs once everything queued so far has been written
+
+    // XREAD BLOCK waiting for entries, registered as a waiter on every key it reads
+    struct BlockedRead {
+        std::vector<std::string> keys;
+        std::vector<StreamId> after;
+        std::shared_ptr<StreamWaiter> waiter;
+    };
+    std::optional<BlockedRead> blocked_read_;
+    std::unique_ptr<asio::steady_timer> block_timer_; // timeout of a blocked XREAD or WAIT, reused across them
+    size_t block_generation_ = 0;
+    // WAIT blocked until wait_replicas_ replicas acknowledged wait_offset_
+    bool waiting_for_acks_ = false;
+    size_t wait_offset_ = 0;
+    int wait_replicas_ = 0;
 };
 
 } // namespace redis_server
@@ -2,17 +2,23 @@
 #define STORAGE_HPP
 
 #include <chrono>
+#include <set>
 #include <unordered_map>
 #include <string>
 #include <tuple>
 #include <vector>
+#include "key_table.hpp"
+#include "stream.hpp"
+#include "string_value.hpp"
 
 namespace redis_server {
 
 // Type aliases
 using TimePoint = std::chrono::system_clock::time_point;
-using StringStorageType = std::unordered_map<std::string, std::tuple<std::string, TimePoint>>;
-using StreamStorageType = std::unordered_map<std::string, std::vector<std::tuple<std::string, std::vector<std::string>>>>;
+using StringStorageType = KeyTable<StringValue>;
+using DeadlineStorageType = KeyTable<TimePoint>; // only keys that have an expiry
+using ExpiryIndex = std::set<std::pair<TimePoint, std::string>>; // ordered by deadline
+using StreamStorageType = std::unordered_map<std::string, Stream>;
 
 } // namespace redis_server
 
@@ -0,0 +1,70 @@
+#ifndef STREAM_HPP
+#define STREAM_HPP
+
+#include <compare>
+#include <cstdint>
+#include <functional>
+#include <limits>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <vector>
+
+namespace redis_server {
+
+// Stream entry ID, <milliseconds>-<sequence>, kept as two integers instead of text
+struct StreamId {
+    uint64_t ms = 0;
+    uint64_t seq = 0;
+
+    auto operator<=>(const StreamId&) const = default;
+
+    static constexpr StreamId min() { return {0, 0}; }
+    static constexpr StreamId max() {
+        return {std::numeric_limits<uint64_t>::max(), std::numeric_limits<uint64_t>::max()};
+    }
+    // Smallest ID greater than this one, max() stays max()
+    StreamId next() const;
+    std::string toString() const;
+    // Parses "<ms>-<seq>", or "<ms>" alone which takes default_seq as its sequence
+    static std::optional<StreamId> parse(std::string_view text, uint64_t default_seq = 0);
+};
+
+// Append-only stream. Entries are packed into chunks of up to kChunkMaxEntries, and inside a chunk every ID
+// is stored as a varint delta against the chunk's first ID. Chunks are kept sorted by their first ID, so a
+// range lookup is a binary search for the first chunk followed by a scan of only the entries it returns.
+class Stream {
+public:
+    using Visitor = std::function<void(const StreamId& id, const std::vector<std::string_view>& fields)>;
+
+    bool empty() const { return length_ == 0; }
+    size_t length() const { return length_; }
+    // 0-0 while the stream is empty
+    StreamId lastId() const { return last_id_; }
+    // Approximate bytes used by the entries, for maxmemory
+    size_t memoryUsage() const { return chunks_.size() * sizeof(Chunk) + data_bytes_; }
+
+    // id must be greater than lastId()
+    void append(const StreamId& id, const std::vector<std::string_view>& fields);
+    // Calls visit for every entry with start <= id <= end, in ID order. Returns the number of entries visited.
+    size_t range(const StreamId& start, const StreamId& end, const Visitor& visit) const;
+
+private:
+    static constexpr size_t kChunkMaxEntries = 128;
+    static constexpr size_t kChunkMaxBytes = 4096;
+
+    struct Chunk {
+        StreamId first;
+        size_t count = 0;
+        std::string data; // per entry: ms delta, seq (delta when ms is equal), field count, then length + bytes
+    };
+
+    std::vector<Chunk> chunks_;
+    size_t length_ = 0;
+    size_t data_bytes_ = 0; // sum of the chunks' data sizes
+    StreamId last_id_;
+};
+
+} // namespace redis_server
+
+#endif // STREAM_HPP
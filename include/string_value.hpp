@@ -0,0 +1,78 @@
+#ifndef STRING_VALUE_HPP
+#define STRING_VALUE_HPP
+
+#include <cstddef>
+#include <cstdint>
+#include <optional>
+#include <string>
+#include <string_view>
+
+namespace redis_server {
+
+// Value of a string key, stored in one of three encodings:
+// - Int:      the value is the canonical text of an int64, kept as the number itself
+// - Embedded: short strings are kept inline, no heap allocation
+// - Raw:      longer strings live in a heap buffer
+// The object is 24 bytes, against 40 for a std::string plus a TimePoint. The expiry is not stored here, only a flag telling the shard to look it up.
+// The padding left over holds 24 bits of access metadata for maxmemory eviction (see Shard::touch).
+class StringValue {
+public:
+    static constexpr size_t kEmbeddedCapacity = 15;
+
+    StringValue() : StringValue(std::string_view()) {}
+    explicit StringValue(std::string_view value);
+    explicit StringValue(int64_t value);
+    StringValue(const StringValue& other);
+    StringValue(StringValue&& other) noexcept;
+    StringValue& operator=(const StringValue& other);
+    StringValue& operator=(StringValue&& other) noexcept;
+    ~StringValue();
+
+    bool isInteger() const { return encoding_ == Encoding::Int; }
+    // The value as an int64, or nothing if it is not a number
+    std::optional<int64_t> toInteger() const;
+    void setInteger(int64_t value);
+
+    size_t size() const;
+    std::string str() const;
+    void appendTo(std::string& out) const;
+
+    bool hasExpiry() const { return has_expiry_; }
+    void setHasExpiry(bool has_expiry) { has_expiry_ = has_expiry; }
+
+    // Bytes allocated outside the object, 0 unless the value is Raw encoded
+    size_t heapSize() const { return encoding_ == Encoding::Raw ? heap_.size : 0; }
+    // LRU clock of the last access, or LFU access time and counter, depending on the eviction policy
+    uint32_t access() const { return access_; }
+    void setAccess(uint32_t access) { access_ = access; }
+
+private:
+    enum class Encoding : uint8_t { Int, Embedded, Raw };
+
+    struct Heap {
+        char* data;
+        size_t size;
+    };
+
+    void assign(std::string_view value);
+    void release();
+
+    union {
+        int64_t integer_;
+        char embedded_[kEmbeddedCapacity];
+        Heap heap_;
+    };
+    Encoding encoding_ = Encoding::Embedded;
+    uint8_t embedded_size_ : 7 = 0;
+    bool has_expiry_ : 1 = false;
+    uint32_t access_ : 24 = 0;
+};
+
+static_assert(sizeof(StringValue) == 24, "StringValue should stay as small as a std::string");
+
+// Parses value as an int64 only if it is in canonical form, so converting back gives the same bytes
+std::optional<int64_t> parseCanonicalInteger(std::string_view value);
+
+} // namespace redis_server
+
+#endif // STRING_VALUE_HPP
@@ -1,4 +1,8 @@
-#include <iostream>
+#include <algorithm>
+#include <atomic>
+#include <cctype>
+#include <charconv>
+#include <numeric>
 #include <memory>       
 #include <asio.hpp>
 #include <vector>
@@ -6,8 +10,16 @@
 #include <unordered_map>
 #include <chrono>
 #include <fstream>  
+#include <functional>
+#include <optional>
 #include <filesystem>
-#include "../include/storage.hpp"
+#include <thread>
+#include "../include/aof.hpp"
+#include "../include/core_group.hpp"
+#include "../include/keyspace.hpp"
+#include "../include/logger.hpp"
+#include "../include/rdb.hpp"
+#include "../include/rdb_saver.hpp"
 #include "../include/session.hpp"
 
 using namespace redis_server;
@@ -16,25 +28,41 @@ using asio::ip::tcp;  // Keep this where tcp is used
 
 void accept_connections(
         tcp::acceptor& acceptor, 
-        std::shared_ptr<StringStorageType> storage,
+        std::shared_ptr<Keyspace> keyspace,
         std::string dir,
         std::string dbfilename,
         std::string masterdetails,
-        std::string master_repl_id,
         unsigned master_repl_offset,
-        std::shared_ptr<StreamStorageType> stream_storage
+        Core* core = nullptr
     ) {
+    // Each session gets its own strand, so its handlers never run concurrently with --io-threads
     acceptor.async_accept(
-        [&acceptor, storage, dir, dbfilename, masterdetails, master_repl_id, master_repl_offset, stream_storage](asio::error_code ec, tcp::socket socket) {
+        asio::make_strand(acceptor.get_executor()),
+        [&acceptor, keyspace, dir, dbfilename, masterdetails, master_repl_offset, core](asio::error_code ec, tcp::socket socket) {
             if (!ec) {
-                std::make_shared<Session>(std::move(socket), storage, dir, dbfilename, masterdetails, master_repl_id, master_repl_offset, stream_storage)->start();
-                std::cout << "Client connected" << std::endl;
+                auto session = std::make_shared<Session>(std::move(socket), keyspace, dir, dbfilename, masterdetails, master_repl_offset);
+                session->setCore(core);
+                session->start();
+                LOG_VERBOSE("Client connected");
                 
             }
-            accept_connections(acceptor, storage, dir, dbfilename, masterdetails, master_repl_id, master_repl_offset, stream_storage); // Recursively continues to listen for new connections 
+            accept_connections(acceptor, keyspace, dir, dbfilename, masterdetails, master_repl_offset, core); // Recursively continues to listen for new connections 
         });
 }
 
+// Acceptor for one core in shared-nothing mode, the kernel spreads connections over all cores' listeners
+tcp::acceptor make_reuseport_acceptor(asio::io_context& io_context, unsigned portnumber) {
+    using reuse_port = asio::detail::socket_option::boolean<SOL_SOCKET, SO_REUSEPORT>;
+    tcp::endpoint endpoint(tcp::v4(), portnumber);
+    tcp::acceptor acceptor(io_context);
+    acceptor.open(endpoint.protocol());
+    acceptor.set_option(tcp::acceptor::reuse_address(true));
+    acceptor.set_option(reuse_port(true));
+    acceptor.bind(endpoint);
+    acceptor.listen();
+    return acceptor;
+}
+
 // Helper function to parse master details
 std::pair<std::string, std::string> parseHostPort(const std::string& masterdetails) {
     std::istringstream iss(masterdetails);
@@ -43,21 +71,72 @@ std::pair<std::string, std::string> parseHostPort(const std::string& masterdetai
     return {host, port};
 }
 
-// Helper to read until "\r\n" and then call a callback
-void readResponse(std::shared_ptr<tcp::socket> socket, const std::string& context, std::function<void()> callback) {
+// What a replica remembers about its master between connections, so a reconnect can ask for a partial resync
+struct MasterLink {
+    std::string replid = "?";
+    long long offset = -1;
+};
+
+// Helper to read one reply and then call a callback with it and any bytes read past it.
+// Simple replies are passed as their line ("+FULLRESYNC <replid> <offset>"), bulk replies as their payload.
+void readResponse(std::shared_ptr<tcp::socket> socket, const std::string& context,
+                  std::function<void(const std::string& response, std::string leftover)> callback,
+                  std::function<void()> on_error) {
     auto response_buffer = std::make_shared<std::string>();
     asio::async_read_until(
         *socket,
         asio::dynamic_buffer(*response_buffer),
         "\r\n",
-        [socket, response_buffer, context, callback](asio::error_code ec, std::size_t length) {
-            if (!ec) {
-                std::string response = response_buffer->substr(0, length);
-                std::cout << "Received from master " << context << ": " << response << std::endl;
-                callback();
-            } else {
-                std::cerr << "Error reading response " << context << ": " << ec.message() << std::endl;
+        [socket, response_buffer, context, callback, on_error](asio::error_code ec, std::size_t length) {
+            if (ec) {
+                LOG_WARNING("Error reading response " << context << ": " << ec.message());
+                on_error();
+                return;
+            }
+            std::string line = response_buffer->substr(0, length - 2);
+            LOG_NOTICE("Received from master " << context << ": " << line);
+            if (line.size() < 2 || line[0] != '$' || line[1] == '-') {
+                callback(line, response_buffer->substr(length));
+                return;
+            }
+            // Bulk reply, its payload may not have arrived yet
+            size_t needed = length + std::stoull(line.substr(1)) + 2;
+            auto finish = [response_buffer, length, needed, callback]() {
+                callback(response_buffer->substr(length, needed - length - 2), response_buffer->substr(needed));
+            };
+            if (response_buffer->size() >= needed) {
+                finish();
+                return;
+            }
+            asio::async_read(*socket, asio::dynamic_buffer(*response_buffer),
+                             asio::transfer_exactly(needed - response_buffer->size()),
+                             [context, finish, on_error](asio::error_code ec, std::size_t /*length*/) {
+                                 if (ec) {
+                                     LOG_WARNING("Error reading response " << context << ": " << ec.message());
+                                     on_error();
+                                     return;
+                                 }
+                                 finish();
+                             });
+        }
+    );
+}
+
+// Helper to send one handshake command to the master and read its reply
+void sendToMaster(std::shared_ptr<tcp::socket> socket, std::string command, const std::string& context,
+                  std::function<void(const std::string& response, std::string leftover)> callback,
+                  std::function<void()> on_error) {
+    auto buffer = std::make_shared<std::string>(std::move(command)); // must outlive the write
+    asio::async_write(
+        *socket,
+        asio::buffer(*buffer),
+        [socket, buffer, context, callback, on_error](asio::error_code ec, std::size_t /*length*/) {
+            if (ec) {
+                LOG_WARNING("Error sending " << context << " to master: " << ec.message());
+                on_error();
+                return;
             }
+            readResponse(socket, "after " + context, callback, on_error);
         }
     );
 }
@@ -65,227 +144,389 @@ void readResponse(std::shared_ptr<tcp::socket> socket, const std::string& contex
 // Helper to perform handshake and establish connection with master by a replica
 void connectToMaster(asio::io_context& io_context, 
                      const std::string& masterdetails,
-                     std::shared_ptr<StringStorageType> storage,
+                     std::shared_ptr<Keyspace> keyspace,
                      const std::string& dir,
                      const std::string& dbfilename,
-                     const std::string& master_repl_id,
                      unsigned master_repl_offset,
                      unsigned portnumber,
-                     std::shared_ptr<StreamStorageType> stream_storage) {
+                     Core* core = nullptr,
+                     std::shared_ptr<MasterLink> link = std::make_shared<MasterLink>()) {
     auto [masterHost, masterPort] = parseHostPort(masterdetails);
 
-    auto master_socket = std::make_shared<tcp::socket>(io_context);
+    // Tries again later when the master is unreachable or the link drops, a master that comes back
+    // with the same history only sends what was missed
+    std::function<void()> reconnect = [&io_context, masterdetails, keyspace, dir, dbfilename, master_repl_offset, portnumber, core, link]() {
+        auto timer = std::make_shared<asio::steady_timer>(io_context, std::chrono::seconds(1));
+        timer->async_wait([timer, &io_context, masterdetails, keyspace, dir, dbfilename, master_repl_offset, portnumber, core, link](asio::error_code ec) {
+            if (!ec) {
+                connectToMaster(io_context, masterdetails, keyspace, dir, dbfilename, master_repl_offset, portnumber, core, link);
+            }
+        });
+    };
+
+    auto master_socket = std::make_shared<tcp::socket>(asio::make_strand(io_context));
     tcp::resolver resolver(io_context);
-    auto endpoints = resolver.resolve(masterHost, masterPort);
+    asio::error_code resolve_ec;
+    auto endpoints = resolver.resolve(masterHost, masterPort, resolve_ec);
+    if (resolve_ec) {
+        LOG_WARNING("Error resolving master: " << resolve_ec.message());
+        reconnect();
+        return;
+    }
+
+    // Once the handshake is done the socket becomes a replica session, fed by the master's replication stream
+    auto start_replica = [master_socket, keyspace, core, dir, dbfilename, masterdetails, master_repl_offset, link, reconnect](std::string leftover) {
+        LOG_NOTICE("Replication handshake complete. Switching to replica session.");
+        auto replica_session = std::make_shared<Session>(
+            std::move(*master_socket),
+            keyspace,
+            dir,
+            dbfilename,
+            masterdetails,
+            master_repl_offset
+        );
+        replica_session->setReplica(true, std::max(link->offset, 0LL));
+        replica_session->setCore(core);
+        replica_session->setOnMasterLost([link, reconnect](size_t offset) {
+            LOG_WARNING("Lost connection to master at offset " << offset << ", reconnecting...");
+            link->offset = offset;
+            reconnect();
+        });
+        replica_session->start(std::move(leftover)); // rdb and commands may already be buffered
+    };
 
     asio::async_connect(
         *master_socket,
         endpoints,
-        [master_socket, &io_context, masterdetails, storage, dir, dbfilename, master_repl_id, master_repl_offset, portnumber, stream_storage](asio::error_code ec, tcp::endpoint /*ep*/) {
-            if (!ec) {
-                std::cout << "Connected to master. Now sending PING..." << std::endl;
-                // FIRST STEP SEND PING
-                std::string ping_cmd = "*1\r\n$4\r\nPING\r\n";
-                asio::async_write(
-                    *master_socket,
-                    asio::buffer(ping_cmd),
-                    [master_socket, storage, dir, dbfilename, masterdetails, master_repl_id, master_repl_offset, portnumber, stream_storage](asio::error_code ec, std::size_t /*length*/) {
-                        if (!ec) {
-                            readResponse(master_socket, "after PING", [master_socket, storage, dir, dbfilename, masterdetails, master_repl_id, master_repl_offset, portnumber, stream_storage]() {
-                                // SECOND STEP SEND REPLCONF commands
-                                std::string port_str = std::to_string(portnumber);
-                                std::string first_replconf = "*3\r\n"
-                                                            "$8\r\nREPLCONF\r\n"
-                                                            "$14\r\nlistening-port\r\n"
-                                                            "$" + std::to_string(port_str.size()) + "\r\n" +
-                                                            port_str + "\r\n";
-                                asio::async_write(
-                                    *master_socket,
-                                    asio::buffer(first_replconf),
-                                    [master_socket, storage, dir, dbfilename, masterdetails, master_repl_id, master_repl_offset, stream_storage](asio::error_code ec, std::size_t /*length*/) {
-                                        if (!ec) {
-                                            std::string second_replconf = "*3\r\n$8\r\nREPLCONF\r\n$4\r\ncapa\r\n$6\r\npsync2\r\n";
-                                            asio::async_write(
-                                                *master_socket,
-                                                asio::buffer(second_replconf),
-                                                [master_socket, storage, dir, dbfilename, masterdetails, master_repl_id, master_repl_offset, stream_storage](asio::error_code ec, std::size_t /*length*/) {
-                                                    if (!ec) {
-                                                        readResponse(master_socket, "after REPLCONF", [master_socket, storage, dir, dbfilename, masterdetails, master_repl_id, master_repl_offset, stream_storage]() {
-                                                            // THIRD STEP SEND PSYNC
-                                                            std::string psync = "*3\r\n$5\r\nPSYNC\r\n$1\r\n?\r\n$2\r\n-1\r\n";
-                                                            asio::async_write(
-                                                                *master_socket,
-                                                                asio::buffer(psync),
-                                                                [master_socket, storage, dir, dbfilename, masterdetails, master_repl_id, master_repl_offset, stream_storage](asio::error_code ec, std::size_t /*length*/) {
-                                                                    if (!ec) {
-                                                                        readResponse(master_socket, "after PSYNC", [master_socket, storage, dir, dbfilename, masterdetails, master_repl_id, master_repl_offset, stream_storage]() {
-                                                                            std::cout << "Replication handshake complete. Switching to replica session." << std::endl;
-                                                                            // Now, wrap the master_socket in a Session with replica mode enabled.
-                                                                            auto replica_session = std::make_shared<Session>(
-                                                                                std::move(*master_socket),
-                                                                                storage,
-                                                                                dir,
-                                                                                dbfilename,
-                                                                                masterdetails,
-                                                                                master_repl_id,
-                                                                                master_repl_offset,
-                                                                                stream_storage                        
-                                                                            );
-                                                                            replica_session->setReplica(true);
-                                                                            replica_session->start();
-                                                                        });
-                                                                    } else {
-                                                                        std::cerr << "Error sending PSYNC to master: " << ec.message() << std::endl;
-                                                                    }
-                                                                }
-                                                            );
-                                                        });
-                                                    } else {
-                                                        std::cerr << "Error sending second REPLCONF to master: " << ec.message() << std::endl;
-                                                    }
-                                                }
-                                            );
-                                        } else {
-                                            std::cerr << "Error sending first REPLCONF to master: " << ec.message() << std::endl;
-                                        }
-                                    }
-                                );
-                            });
-                        } else {
-                            std::cerr << "Error sending PING to master: " << ec.message() << std::endl;
-                        }
-                    }
-                );
-            } else {
-                std::cerr << "Error connecting to master: " << ec.message() << std::endl;
+        [master_socket, portnumber, link, reconnect, start_replica](asio::error_code ec, tcp::endpoint /*ep*/) {
+            if (ec) {
+                LOG_WARNING("Error connecting to master: " << ec.message());
+                reconnect();
+                return;
             }
+            LOG_NOTICE("Connected to master. Now sending PING...");
+            // FIRST STEP SEND PING
+            sendToMaster(master_socket, "*1\r\n$4\r\nPING\r\n", "PING", [master_socket, portnumber, link, reconnect, start_replica](const std::string& /*response*/, std::string /*leftover*/) {
+                // SECOND STEP SEND REPLCONF commands, one reply each
+                std::string port_str = std::to_string(portnumber);
+                std::string first_replconf = "*3\r\n$8\r\nREPLCONF\r\n$14\r\nlistening-port\r\n$" +
+                                             std::to_string(port_str.size()) + "\r\n" + port_str + "\r\n";
+                sendToMaster(master_socket, first_replconf, "REPLCONF listening-port", [master_socket, link, reconnect, start_replica](const std::string& /*response*/, std::string /*leftover*/) {
+                    std::string second_replconf = "*3\r\n$8\r\nREPLCONF\r\n$4\r\ncapa\r\n$6\r\npsync2\r\n";
+                    sendToMaster(master_socket, second_replconf, "REPLCONF capa", [master_socket, link, reconnect, start_replica](const std::string& /*response*/, std::string /*leftover*/) {
+                        // THIRD STEP SEND PSYNC, with the history we already have if this is a reconnect
+                        std::string offset_str = std::to_string(link->offset);
+                        std::string psync = "*3\r\n$5\r\nPSYNC\r\n$" + std::to_string(link->replid.size()) + "\r\n" + link->replid +
+                                            "\r\n$" + std::to_string(offset_str.size()) + "\r\n" + offset_str + "\r\n";
+                        sendToMaster(master_socket, psync, "PSYNC", [link, start_replica](const std::string& response, std::string leftover) {
+                            // +FULLRESYNC <replid> <offset> is followed by a snapshot, +CONTINUE [<replid>] by the missed commands only
+                            std::istringstream reply(response);
+                            std::string kind, replid;
+                            reply >> kind >> replid;
+                            if (kind == "+FULLRESYNC") {
+                                reply >> link->offset;
+                            }
+                            if (!replid.empty()) {
+                                link->replid = replid;
+                            }
+                            start_replica(std::move(leftover));
+                        }, reconnect);
+                    }, reconnect);
+                }, reconnect);
+            }, reconnect);
         }
     );
 }
 
-// Helper to read size based on RDB format
-uint64_t readDecodedSize(std::ifstream &file) {
-    char first_byte;
-    file.get(first_byte);
-    unsigned char unsigned_first_byte = static_cast<unsigned char>(first_byte);
-    int type = (first_byte & 0xC0) >> 6;
-    uint64_t length = 0;
-
-    if (type == 0) {
-        length = unsigned_first_byte & 0x3F; // 00111111
-    } else if (type == 1) {
-        char second_byte;
-        file.get(second_byte);
-        length = unsigned_first_byte & 0x3F + static_cast<unsigned char>(second_byte);
-    } else if (type == 2) {
-        unsigned char buf[4];
-        file.read(reinterpret_cast<char*>(buf), 4);
-        length = (uint64_t)buf[0]
-            | ((uint64_t)buf[1] << 24)
-            | ((uint64_t)buf[2] << 16)
-            | ((uint64_t)buf[3] << 8);
-    } else {
-        length = 0; // string encoding, ignored for now
+// Runs fn(0) .. fn(threads - 1) on their own threads, the first one on the calling thread
+void runOnThreads(size_t threads, const std::function<void(size_t)>& fn) {
+    std::vector<std::thread> workers;
+    for (size_t i = 1; i < threads; ++i) {
+        workers.emplace_back(fn, i);
+    }
+    fn(0);
+    for (auto& worker : workers) {
+        worker.join();
     }
-    return length;
 }
 
-// Helper to read expiry based on RDB format
-TimePoint readExpiry(std::ifstream &file, unsigned char umarker) {
-    TimePoint expiry = TimePoint::max();
-    if (umarker == 0xFC) {
-        // Read 8-byte expiry (milliseconds)
-        unsigned char buff[8];
-        file.read(reinterpret_cast<char*>(buff), 8);
-        auto expiry_ms = (uint64_t)buff[0]
-                        | ((uint64_t)buff[1] << 8)
-                        | ((uint64_t)buff[2] << 16)
-                        | ((uint64_t)buff[3] << 24)
-                        | ((uint64_t)buff[4] << 32)
-                        | ((uint64_t)buff[5] << 40)
-                        | ((uint64_t)buff[6] << 48)
-                        | ((uint64_t)buff[7] << 56);
-        expiry = std::chrono::system_clock::time_point(std::chrono::milliseconds(expiry_ms));
-    } else if (umarker == 0xFD) {
-        // Read 4-byte expiry (seconds)
-        unsigned char buff[4];
-        file.read(reinterpret_cast<char*>(buff), 4);
-        auto expiry_s = (uint64_t)buff[0]
-                        | ((uint64_t)buff[1] << 8)
-                        | ((uint64_t)buff[2] << 16)
-                        | ((uint64_t)buff[3] << 24);
-        expiry = std::chrono::system_clock::time_point(std::chrono::seconds(expiry_s));
-    } else {
-        // If no valid expiry marker is found, you might decide to push the marker back,
-        // or simply assume no expiry. Here, we simply treat it as "no expiry".
-        file.unget();
+// Decodes the segments of an RDB image on load_threads threads. Each thread sorts its keys per shard, then every
+// shard adopts the keys all threads decoded for it, shards in parallel as well, so no table is ever shared.
+void loadSegmentsInParallel(std::string_view data, std::shared_ptr<Keyspace> keyspace, unsigned load_threads,
+                            size_t& loaded, size_t& skipped) {
+    std::vector<RdbSegment> segments;
+    std::string error;
+    // A few segments per thread, so threads that got cheap segments pick up more work
+    if (!splitRdb(data, load_threads * 4, segments, error)) {
+        throw std::runtime_error("Could not load RDB: " + error);
+    }
+
+    struct Worker {
+        std::vector<LoadedKeys> shards;
+        size_t loaded = 0;
+        size_t skipped = 0;
+        std::string error;
+    };
+    std::vector<Worker> workers(load_threads);
+    std::atomic<size_t> next_segment = 0;
+    TimePoint now = std::chrono::system_clock::now();
+    runOnThreads(load_threads, [&](size_t index) {
+        Worker& worker = workers[index];
+        worker.shards.resize(keyspace->shardCount());
+        uint64_t db = 0;
+        RdbHandler handler;
+        handler.on_select_db = [&db](uint64_t selected) { db = selected; };
+        handler.on_string = [&](std::string key, StringValue value, TimePoint expiry) {
+            if (db != 0 || expiry < now) {
+                ++worker.skipped;
+                return;
+            }
+            LoadedKeys& keys = worker.shards[keyspace->shardIndex(key)];
+            keys.expires += expiry != TimePoint::max();
+            keys.strings.emplace_back(std::move(key), std::move(value), expiry);
+            ++worker.loaded;
+        };
+        handler.on_stream = [&](std::string key, Stream stream) {
+            if (db != 0) {
+                ++worker.skipped;
+                return;
+            }
+            worker.shards[keyspace->shardIndex(key)].streams.emplace_back(std::move(key), std::move(stream));
+            ++worker.loaded;
+        };
+        handler.on_unsupported = [&worker](std::string_view, uint8_t) { ++worker.skipped; };
+        for (size_t i; (i = next_segment++) < segments.size();) {
+            if (!loadRdbSegment(data, segments[i], handler, worker.error)) {
+                return;
+            }
+        }
+    });
+    for (const auto& worker : workers) {
+        if (!worker.error.empty()) {
+            throw std::runtime_error("Could not load RDB: " + worker.error);
+        }
+        loaded += worker.loaded;
+        skipped += worker.skipped;
     }
-    return expiry;
-}
 
-// Helper to read string based on RDB format
-std::string readString(std::ifstream &file) {
-    int size = readDecodedSize(file);
-    std::vector<char> buffer(size);
-    file.read(buffer.data(), size);
-    return std::string(buffer.data(), size);
+    std::atomic<size_t> next_shard = 0;
+    runOnThreads(std::min<size_t>(load_threads, keyspace->shardCount()), [&](size_t) {
+        for (size_t i; (i = next_shard++) < keyspace->shardCount();) {
+            Shard& shard = keyspace->shard(i);
+            size_t keys = 0;
+            size_t expires = 0;
+            for (const auto& worker : workers) {
+                keys += worker.shards[i].strings.size();
+                expires += worker.shards[i].expires;
+            }
+            shard.reserve(keys, expires);
+            for (auto& worker : workers) {
+                worker.shards[i].insertInto(shard);
+            }
+        }
+    });
 }
 
-void loadDatabase(const std::string &dir, const std::string &dbfilename, std::shared_ptr<StringStorageType> storage) {
+// Loads the RDB file parsing straight from a memory map. This server has no SELECT, so only database 0 is
+// loaded, the resize hint of that database sizes every shard up front. With load_threads > 1 the file is
+// decoded in parallel segments instead.
+void loadDatabase(const std::string &dir, const std::string &dbfilename, std::shared_ptr<Keyspace> keyspace,
+                  unsigned load_threads) {
+    if (dbfilename.empty()) {
+        return; // no snapshot configured
+    }
     std::string filepath = dir + "/" + dbfilename;
-    if (!std::filesystem::exists(filepath)) {
-        std::cerr << "File does not exist: " << filepath << std::endl;
+    if (!std::filesystem::is_regular_file(filepath)) {
+        LOG_WARNING("File does not exist: " << filepath);
         return;
     }
-    std::ifstream file(filepath, std::ios::binary);
-    if (!file.is_open()) {
-        throw std::runtime_error("Could not open file: " + filepath);
+    MappedFile file;
+    std::string error;
+    if (!file.open(filepath, error)) {
+        throw std::runtime_error("Could not open file: " + filepath + ": " + error);
     }
 
-    char ch;
-    uint64_t size;
-    uint64_t size_with_expiry;
-    bool is_database = false;
-    while (file.get(ch)) {
-        unsigned char byte = static_cast<unsigned char>(ch);
-        if (byte == 0xFB && !is_database) {
-            size = readDecodedSize(file);
-            size_with_expiry = readDecodedSize(file);
-            is_database = true;
-            continue;
+    auto start = std::chrono::steady_clock::now();
+    size_t loaded = 0;
+    size_t skipped = 0;
+    if (load_threads > 1) {
+        loadSegmentsInParallel(file.view(), keyspace, load_threads, loaded, skipped);
+    } else {
+        TimePoint now = std::chrono::system_clock::now();
+        uint64_t db = 0;
+        RdbHandler handler;
+        handler.on_select_db = [&db](uint64_t index) { db = index; };
+        handler.on_resize = [&db, &keyspace](uint64_t keys, uint64_t expires) {
+            if (db != 0) {
+                return;
+            }
+            // Keys spread evenly over the shards, leave a little headroom for an unlucky hash
+            size_t shards = keyspace->shardCount();
+            for (size_t i = 0; i < shards; ++i) {
+                keyspace->shard(i).reserve(keys / shards + keys / shards / 8 + 1, expires / shards + expires / shards / 8 + 1);
+            }
+        };
+        handler.on_string = [&](std::string key, StringValue value, TimePoint expiry) {
+            if (db != 0 || expiry < now) {
+                ++skipped;
+                return;
+            }
+            keyspace->shardFor(key).setString(key, std::move(value), expiry);
+            ++loaded;
+        };
+        handler.on_stream = [&](std::string key, Stream stream) {
+            if (db != 0) {
+                ++skipped;
+                return;
+            }
+            keyspace->shardFor(key).setStream(std::move(key), std::move(stream));
+            ++loaded;
+        };
+        handler.on_unsupported = [&skipped](std::string_view, uint8_t) { ++skipped; };
+        if (!loadRdb(file.view(), handler, error)) {
+            throw std::runtime_error("Could not load " + filepath + ": " + error);
         }
+    }
 
-        if (is_database) { // Process the database section
-            TimePoint expiry_time = TimePoint::max();
-            if (static_cast<unsigned char>(ch) == 0xFC) {
-                expiry_time = readExpiry(file, 0xFC);
-                file.get(ch);
-            } else if (static_cast<unsigned char>(ch) == 0xFD) {
-                expiry_time = readExpiry(file, 0xFD);
-                file.get(ch);
-            }
+    double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    double safe_seconds = std::max(seconds, 1e-9);
+    LOG_NOTICE("Loaded " << loaded << " keys from " << filepath << " in " << static_cast<long>(seconds * 1000)
+               << " ms with " << std::max(load_threads, 1u) << " thread(s): " << static_cast<long>(loaded / safe_seconds)
+               << " keys/s, " << static_cast<long>(file.view().size() / safe_seconds / (1024 * 1024)) << " MB/s"
+               << (skipped > 0 ? ", skipped " + std::to_string(skipped) + " (expired, in another database or of an unsupported type)" : ""));
+}
 
-            if (static_cast<unsigned char>(ch) == 0x00) {
-                std::string key = readString(file);
-                if (key.empty()) {
-                    break;
-                }
-                std::string value = readString(file);
-                (*storage)[key] = std::make_tuple(value, expiry_time);
+// Active expiry: 10 times a second, drop expired keys from the given shards so keys that are never read
+// again do not stay in memory. Each cycle gets a small time budget so a burst of expiring keys can not stall
+// the event loop, whatever is left over is picked up on the next tick. Tables still growing are moved along too.
+// Removed keys are deleted on replicas and in the AOF. A replica never expires keys itself, it waits for the DELs
+// of its master so both datasets stay the same.
+void scheduleActiveExpire(std::shared_ptr<asio::steady_timer> timer, std::shared_ptr<Keyspace> keyspace,
+                          std::vector<size_t> shards, bool replica) {
+    timer->expires_after(std::chrono::milliseconds(100));
+    timer->async_wait([timer, keyspace, shards = std::move(shards), replica](std::error_code ec) mutable {
+        if (ec) {
+            return;
+        }
+        std::vector<std::string> expired;
+        for (size_t index : shards) {
+            ShardLock lock = keyspace->lockShard(index);
+            if (!replica) {
+                expired.clear();
+                keyspace->shard(index).expireCycle(std::chrono::milliseconds(1), expired);
+                Session::propagateExpired(expired, timer->get_executor()); // still under the lock, in order with writes
             }
+            keyspace->shard(index).rehashStep();
+        }
+        scheduleActiveExpire(timer, keyspace, std::move(shards), replica);
+    });
+}
+
+// Reaps finished background saves and starts new ones when a save rule is met
+void scheduleSaveCron(std::shared_ptr<asio::steady_timer> timer, std::shared_ptr<RdbSaver> saver) {
+    timer->expires_after(std::chrono::milliseconds(100));
+    timer->async_wait([timer, saver](std::error_code ec) {
+        if (ec) {
+            return;
         }
+        saver->cron();
+        scheduleSaveCron(timer, saver);
+    });
+}
+
+// Rebuilds the dataset by running every command of the AOF through the command table. A command cut short
+// by a crash is dropped from the end of the file, so is a transaction without its EXEC. Returns false if there
+// is no AOF yet.
+bool loadAppendOnly(const std::string &path, std::shared_ptr<Keyspace> keyspace) {
+    if (!std::filesystem::is_regular_file(path)) {
+        return false;
+    }
+    MappedFile file;
+    std::string error;
+    if (!file.open(path, error)) {
+        throw std::runtime_error("Could not open file: " + path + ": " + error);
+    }
+    auto start = std::chrono::steady_clock::now();
+    asio::io_context replay_context;
+    auto session = std::make_shared<Session>(tcp::socket(replay_context), keyspace, "", "", "", 0);
+    size_t consumed = session->replayAppendOnly(file.view());
+    size_t size = file.view().size();
+    double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    LOG_NOTICE("DB loaded from append only file " << path << ": " << consumed << " bytes in "
+               << static_cast<long>(seconds * 1000) << " ms");
+    if (consumed < size) {
+        LOG_WARNING("AOF " << path << " ends with an incomplete command or transaction, truncating "
+                    << size - consumed << " bytes");
+        std::filesystem::resize_file(path, consumed);
     }
+    return true;
+}
+
+// Opens the AOF for appending. Without an AOF to load from the dataset came from the RDB file, a first
+// rewrite puts it into the AOF.
+std::shared_ptr<AppendOnlyFile> startAppendOnly(const std::string &path, AppendFsync policy,
+                                                std::shared_ptr<Keyspace> keyspace, bool loaded, CoreGroup* cores) {
+    auto aof = std::make_shared<AppendOnlyFile>(path, policy, keyspace, cores);
+    std::string error;
+    if (!aof->open(error)) {
+        throw std::runtime_error("Could not open the append only file " + path + ": " + error);
+    }
+    if (!loaded) {
+        aof->startRewrite(); // no thread runs yet, nothing can change the keyspace
+    }
+    return aof;
+}
+
+// Parses a memory size as given to --maxmemory: bytes, or a number followed by k, kb, m, mb, g or gb
+// (powers of 1000 without b, 1024 with it, like Redis)
+std::optional<size_t> parseMemorySize(std::string_view text) {
+    size_t value = 0;
+    auto [end, ec] = std::from_chars(text.data(), text.data() + text.size(), value);
+    if (ec != std::errc() || end == text.data()) {
+        return std::nullopt;
+    }
+    std::string unit(end, text.data() + text.size());
+    std::transform(unit.begin(), unit.end(), unit.begin(), [](unsigned char c) { return std::tolower(c); });
+    static const std::pair<std::string_view, size_t> kUnits[] = {
+        {"", 1}, {"k", 1000}, {"kb", 1024}, {"m", 1000 * 1000}, {"mb", 1024 * 1024},
+        {"g", 1000 * 1000 * 1000}, {"gb", 1024 * 1024 * 1024},
+    };
+    for (const auto& [name, multiplier] : kUnits) {
+        if (unit == name) {
+            return value * multiplier;
+        }
+    }
+    return std::nullopt;
+}
+
+// Finishes AOF rewrites and starts one once the file grew enough
+void scheduleAofCron(std::shared_ptr<asio::steady_timer> timer, std::shared_ptr<AppendOnlyFile> aof) {
+    timer->expires_after(std::chrono::milliseconds(100));
+    timer->async_wait([timer, aof](std::error_code ec) {
+        if (ec) {
+            return;
+        }
+        aof->cron();
+        scheduleAofCron(timer, aof);
+    });
 }
 
 int main(int argc, char* argv[]) {
     try {
-        asio::io_context io_context;
         std::string dir;
         std::string dbfilename;
         unsigned portnumber = 6379;
         std::string masterdetails = "";
-        std::string master_repl_id = "8371b4fb1155b71f4a04d3e1bc3e18c4a990aeeb";
         unsigned master_repl_offset = 0;
+        unsigned io_threads = 1;
+        bool shared_nothing = false;
+        unsigned load_threads = 1;
+        std::vector<RdbSaver::Rule> save_rules;
+        bool appendonly = false;
+        AppendFsync appendfsync = AppendFsync::EverySec;
+        std::string appendfilename = "appendonly.aof";
+        size_t maxmemory = 0;
+        EvictionPolicy maxmemory_policy = EvictionPolicy::NoEviction;
 
         for (int i = 1; i < argc; ++i) {
             std::string arg = argv[i];
@@ -305,27 +546,165 @@ int main(int argc, char* argv[]) {
             if (arg == "--replicaof") {
                 masterdetails = argv[i + 1];
             }
+
+            if (arg == "--io-threads") {
+                io_threads = std::max(1, std::stoi(argv[i + 1]));
+            }
+
+            if (arg == "--repl-backlog-size") {
+                Session::g_repl_backlog.resize(std::stoull(argv[i + 1]));
+            }
+
+            if (arg == "--save") {
+                auto rules = RdbSaver::parseRules(argv[i + 1]);
+                if (!rules) {
+                    throw std::runtime_error("Invalid --save, expected \"<seconds> <changes> [<seconds> <changes> ...]\"");
+                }
+                save_rules = std::move(*rules);
+            }
+
+            if (arg == "--load-threads") {
+                load_threads = std::max(1, std::stoi(argv[i + 1]));
+            }
+
+            if (arg == "--appendonly") {
+                appendonly = std::string(argv[i + 1]) == "yes";
+            }
+
+            if (arg == "--appendfsync") {
+                auto policy = AppendOnlyFile::parsePolicy(argv[i + 1]);
+                if (!policy) {
+                    throw std::runtime_error("Invalid --appendfsync, expected always, everysec or no");
+                }
+                appendfsync = *policy;
+            }
+
+            if (arg == "--appendfilename") {
+                appendfilename = argv[i + 1];
+            }
+
+            if (arg == "--maxmemory") {
+                auto bytes = parseMemorySize(argv[i + 1]);
+                if (!bytes) {
+                    throw std::runtime_error("Invalid --maxmemory, expected a size such as 100mb");
+                }
+                maxmemory = *bytes;
+            }
+
+            if (arg == "--maxmemory-policy") {
+                auto policy = parseEvictionPolicy(argv[i + 1]);
+                if (!policy) {
+                    throw std::runtime_error("Invalid --maxmemory-policy, expected noeviction, allkeys-lru, allkeys-lfu or volatile-ttl");
+                }
+                maxmemory_policy = *policy;
+            }
+
+            if (arg == "--loglevel") {
+                auto level = Logger::parseLevel(argv[i + 1]);
+                if (!level) {
+                    throw std::runtime_error("Invalid --loglevel, expected debug, verbose, notice or warning");
+                }
+                Logger::instance().setLevel(*level);
+            }
+
+            if (arg == "--latency-tracking") {
+                Session::g_command_stats.setEnabled(std::string(argv[i + 1]) != "no");
+            }
+
+            if (arg == "--slowlog-log-slower-than") {
+                Session::g_slowlog.setThreshold(std::stoll(argv[i + 1]));
+            }
+
+            if (arg == "--slowlog-max-len") {
+                Session::g_slowlog.setMaxLength(std::stoull(argv[i + 1]));
+            }
+
+            if (arg == "--shared-nothing") {
+                shared_nothing = true;
+            }
         }
+
+        // Same defaults as Redis, so the snapshot SAVE writes is found again on the next start
+        std::string rdb_dir = dir.empty() ? "." : dir;
+        std::string rdb_filename = dbfilename.empty() ? "dump.rdb" : dbfilename;
+        // With appendonly the AOF holds the whole dataset, the RDB file is only read if there is no AOF yet
+        std::string aof_path = rdb_dir + "/" + appendfilename;
+
+        if (shared_nothing) {
+            // One event loop, acceptor and keyspace shard per core, cores only talk through their inboxes
+            auto keyspace = std::make_shared<Keyspace>(io_threads, false);
+            keyspace->setMaxMemory(maxmemory, maxmemory_policy);
+            bool aof_loaded = appendonly && loadAppendOnly(aof_path, keyspace);
+            if (!aof_loaded) {
+                loadDatabase(rdb_dir, rdb_filename, keyspace, load_threads);
+            }
+            CoreGroup cores(io_threads, keyspace, dir, dbfilename, master_repl_offset);
+            Session::g_saver = std::make_shared<RdbSaver>(keyspace, rdb_dir + "/" + rdb_filename, &cores);
+            Session::g_saver->setRules(save_rules);
+            scheduleSaveCron(std::make_shared<asio::steady_timer>(cores.core(0).io_context), Session::g_saver);
+            if (appendonly) {
+                Session::g_aof = startAppendOnly(aof_path, appendfsync, keyspace, aof_loaded, &cores);
+                scheduleAofCron(std::make_shared<asio::steady_timer>(cores.core(0).io_context), Session::g_aof);
+            }
+            std::vector<tcp::acceptor> acceptors;
+            acceptors.reserve(io_threads);
+            for (size_t i = 0; i < cores.size(); ++i) {
+                acceptors.push_back(make_reuseport_acceptor(cores.core(i).io_context, portnumber));
+                accept_connections(acceptors.back(), keyspace, dir, dbfilename, masterdetails, master_repl_offset, &cores.core(i));
+                scheduleActiveExpire(std::make_shared<asio::steady_timer>(cores.core(i).io_context), keyspace, {i},
+                                     !masterdetails.empty());
+            }
+            LOG_NOTICE("Server listening on port " << portnumber << " with " << io_threads << " shared-nothing cores...");
+
+            if (!masterdetails.empty()) {
+                connectToMaster(cores.core(0).io_context, masterdetails, keyspace, dir, dbfilename, master_repl_offset, portnumber, &cores.core(0));
+            }
+            cores.run();
+            return 0;
+        }
+
+        asio::io_context io_context(io_threads);
         
         // Create acceptor listening on port 6379 if not specified
         tcp::acceptor acceptor(io_context, tcp::endpoint(tcp::v4(), portnumber));
         
-        auto storage = std::make_shared<StringStorageType>();  // Use tuple storage
-        auto stream_storage = std::make_shared<StreamStorageType>();
-        loadDatabase(dir, dbfilename, storage);
+        auto keyspace = std::make_shared<Keyspace>(io_threads); // one shard per thread
+        keyspace->setMaxMemory(maxmemory, maxmemory_policy);
+        bool aof_loaded = appendonly && loadAppendOnly(aof_path, keyspace);
+        if (!aof_loaded) {
+            loadDatabase(rdb_dir, rdb_filename, keyspace, load_threads);
+        }
 
         // Start accepting connections
-        accept_connections(acceptor, storage, dir, dbfilename, masterdetails, master_repl_id, master_repl_offset, stream_storage);
-        std::cout << "Server listening on port " << portnumber << "..." << std::endl;
+        accept_connections(acceptor, keyspace, dir, dbfilename, masterdetails, master_repl_offset);
+        std::vector<size_t> all_shards(keyspace->shardCount());
+        std::iota(all_shards.begin(), all_shards.end(), 0);
+        scheduleActiveExpire(std::make_shared<asio::steady_timer>(io_context), keyspace, std::move(all_shards),
+                             !masterdetails.empty());
+        Session::g_saver = std::make_shared<RdbSaver>(keyspace, rdb_dir + "/" + rdb_filename);
+        Session::g_saver->setRules(save_rules);
+        scheduleSaveCron(std::make_shared<asio::steady_timer>(io_context), Session::g_saver);
+        if (appendonly) {
+            Session::g_aof = startAppendOnly(aof_path, appendfsync, keyspace, aof_loaded, nullptr);
+            scheduleAofCron(std::make_shared<asio::steady_timer>(io_context), Session::g_aof);
+        }
+        LOG_NOTICE("Server listening on port " << portnumber << "...");
 
         if (!masterdetails.empty()) {
-            connectToMaster(io_context, masterdetails, storage, dir, dbfilename, master_repl_id, master_repl_offset, portnumber, stream_storage);
+            connectToMaster(io_context, masterdetails, keyspace, dir, dbfilename, master_repl_offset, portnumber);
         }
         
-        // Run the I/O service - blocks until all work is done
+        // Run the I/O service on every thread - blocks until all work is done
+        std::vector<std::thread> workers;
+        for (unsigned i = 1; i < io_threads; ++i) {
+            workers.emplace_back([&io_context]() { io_context.run(); });
+        }
         io_context.run();
+        for (auto& worker : workers) {
+            worker.join();
+        }
     } catch (std::exception& e) {
-        std::cerr << "Exception: " << e.what() << std::endl;
+        LOG_WARNING("Exception: " << e.what());
         return 1;
     }
     return 0;
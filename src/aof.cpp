@@ -0,0 +1,397 @@
+#include "../include/aof.hpp"
+#include "../include/core_group.hpp"
+#include "../include/logger.hpp"
+#include <algorithm>
+#include <cerrno>
+#include <cstdlib>
+#include <csignal>
+#include <cstring>
+#include <fcntl.h>
+#include <iterator>
+#include <sstream>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+namespace redis_server {
+
+namespace {
+
+constexpr size_t kRewriteMinSize = 64 * 1024 * 1024; // no automatic rewrite below this size
+constexpr size_t kRewriteGrowthPercent = 100;        // ... nor before the file grew this much since the last one
+constexpr size_t kRewriteBufferSize = 1 << 20;
+
+bool writeAll(int fd, std::string_view data) {
+    while (!data.empty()) {
+        ssize_t written = ::write(fd, data.data(), data.size());
+        if (written < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return false;
+        }
+        data.remove_prefix(written);
+    }
+    return true;
+}
+
+void appendBulk(std::string& out, std::string_view value) {
+    out += '$';
+    out += std::to_string(value.size());
+    out += "\r\n";
+    out.append(value);
+    out += "\r\n";
+}
+
+// Writes the commands rebuilding keyspace: SET per string (and PEXPIREAT if it expires), XADD per stream entry
+bool writeRewrite(Keyspace& keyspace, int fd) {
+    std::string out;
+    out.reserve(kRewriteBufferSize + 4096);
+    bool ok = true;
+    auto flushIfFull = [&]() {
+        if (out.size() >= kRewriteBufferSize) {
+            ok = ok && writeAll(fd, out);
+            out.clear();
+        }
+    };
+    auto now = std::chrono::system_clock::now();
+    std::string value;
+    for (size_t i = 0; i < keyspace.shardCount(); ++i) {
+        Shard& shard = keyspace.shard(i);
+        for (auto it = shard.strings.begin(); it != shard.strings.end(); ++it) {
+            TimePoint expiry = shard.expiryOf(it);
+            if (expiry < now) {
+                continue;
+            }
+            value.clear();
+            it->second.appendTo(value);
+            out += "*3\r\n$3\r\nSET\r\n";
+            appendBulk(out, it->first);
+            appendBulk(out, value);
+            if (expiry != TimePoint::max()) {
+                out += "*3\r\n$9\r\nPEXPIREAT\r\n";
+                appendBulk(out, it->first);
+                appendBulk(out, std::to_string(std::chrono::duration_cast<std::chrono::milliseconds>(
+                                                   expiry.time_since_epoch()).count()));
+            }
+            flushIfFull();
+        }
+        for (const auto& [key, stream] : shard.streams) {
+            stream.range(StreamId::min(), StreamId::max(),
+                [&](const StreamId& id, const std::vector<std::string_view>& fields) {
+                    out += '*';
+                    out += std::to_string(3 + fields.size());
+                    out += "\r\n$4\r\nXADD\r\n";
+                    appendBulk(out, key);
+                    appendBulk(out, id.toString());
+                    for (const auto& field : fields) {
+                        appendBulk(out, field);
+                    }
+                    flushIfFull();
+                });
+        }
+    }
+    return writeAll(fd, out) && ok;
+}
+
+} // namespace
+
+AppendOnlyFile::AppendOnlyFile(std::string path, AppendFsync policy, std::shared_ptr<Keyspace> keyspace, CoreGroup* cores)
+    : path_(std::move(path)), policy_(policy), keyspace_(std::move(keyspace)), cores_(cores) {}
+
+AppendOnlyFile::~AppendOnlyFile() {
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        stopping_ = true;
+    }
+    stop_cv_.notify_all();
+    if (fsync_thread_.joinable()) {
+        fsync_thread_.join();
+    }
+    if (fd_ >= 0) {
+        writeAll(fd_, buffer_);
+        ::fsync(fd_);
+        ::close(fd_);
+    }
+}
+
+std::optional<AppendFsync> AppendOnlyFile::parsePolicy(std::string_view text) {
+    if (text == "always") {
+        return AppendFsync::Always;
+    }
+    if (text == "everysec") {
+        return AppendFsync::EverySec;
+    }
+    if (text == "no") {
+        return AppendFsync::No;
+    }
+    return std::nullopt;
+}
+
+bool AppendOnlyFile::open(std::string& error) {
+    fd_ = ::open(path_.c_str(), O_WRONLY | O_CREAT | O_APPEND, 0644);
+    if (fd_ < 0) {
+        error = std::strerror(errno);
+        return false;
+    }
+    struct stat status;
+    if (::fstat(fd_, &status) == 0) {
+        file_size_ = base_size_ = status.st_size;
+    }
+    if (policy_ == AppendFsync::EverySec) {
+        fsync_thread_ = std::thread([this]() { fsyncLoop(); });
+    }
+    return true;
+}
+
+size_t AppendOnlyFile::append(std::string_view command, const asio::any_io_executor& executor) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    buffer_.append(command);
+    if (child_ > 0) {
+        rewrite_buffer_.append(command); // not in the rewritten file, added to it once the child is done
+    }
+    appended_ += command.size();
+    if (!write_scheduled_) {
+        // Runs after the handlers already queued, so every command of this iteration shares the write
+        write_scheduled_ = true;
+        asio::post(executor, [this]() { writePending(); });
+    }
+    return appended_;
+}
+
+bool AppendOnlyFile::waitDurable(size_t offset, const asio::any_io_executor& executor, std::function<void()> release) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (policy_ != AppendFsync::Always || durable_ >= offset) {
+        return true;
+    }
+    waiters_.push_back({offset, executor, std::move(release)});
+    return false;
+}
+
+void AppendOnlyFile::writePending() {
+    std::lock_guard<std::mutex> io_lock(io_mutex_);
+    std::string data;
+    size_t end;
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        data.swap(buffer_);
+        end = appended_;
+        write_scheduled_ = false; // commands appended from now on are the next group
+    }
+    if (!data.empty() && !writeAll(fd_, data)) {
+        if (policy_ == AppendFsync::Always) {
+            // Same as a failed fsync below, the replies waiting for this write must never go out
+            LOG_WARNING("Can't write to the AOF when the AOF fsync policy is 'always': " << std::strerror(errno)
+                        << ". Exiting...");
+            std::exit(1);
+        }
+        // Drop what part of the data made it to the file, and retry all of it from cron() or the next append.
+        // Nothing counts as written meanwhile.
+        LOG_WARNING("Error writing to the AOF, will retry: " << std::strerror(errno));
+        if (::ftruncate(fd_, file_size_) != 0) {
+            LOG_WARNING("Could not remove a partial write from the AOF: " << std::strerror(errno));
+        }
+        std::lock_guard<std::mutex> lock(mutex_);
+        buffer_.insert(0, data);
+        last_write_ok_ = false;
+        return;
+    }
+    file_size_ += data.size();
+    if (policy_ == AppendFsync::Always && ::fdatasync(fd_) != 0) {
+        // Replies were promised to wait for the disk, going on without it would lie to clients
+        LOG_WARNING("Can't persist AOF for fsync error when the AOF fsync policy is 'always': "
+                    << std::strerror(errno) << ". Exiting...");
+        std::exit(1);
+    }
+    std::vector<Waiter> released;
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        last_write_ok_ = true;
+        written_ = end;
+        if (policy_ == AppendFsync::Always) {
+            durable_ = end;
+        }
+        releaseDurable(released);
+    }
+    for (auto& waiter : released) {
+        asio::post(waiter.executor, std::move(waiter.release));
+    }
+}
+
+// Moves the waiters whose commands are all on disk to released, mutex_ must be held
+void AppendOnlyFile::releaseDurable(std::vector<Waiter>& released) {
+    auto done = std::partition(waiters_.begin(), waiters_.end(),
+                               [this](const Waiter& waiter) { return waiter.offset > durable_; });
+    std::move(done, waiters_.end(), std::back_inserter(released));
+    waiters_.erase(done, waiters_.end());
+}
+
+// everysec: fsyncs once a second off the event loop, only when something was written since the last one
+void AppendOnlyFile::fsyncLoop() {
+    std::unique_lock<std::mutex> lock(mutex_);
+    while (!stop_cv_.wait_for(lock, std::chrono::seconds(1), [this]() { return stopping_; })) {
+        if (written_ == synced_) {
+            continue;
+        }
+        lock.unlock();
+        // A duplicate keeps the descriptor valid should a rewrite swap the file meanwhile
+        int fd;
+        size_t target;
+        {
+            std::lock_guard<std::mutex> io_lock(io_mutex_);
+            fd = ::dup(fd_);
+            std::lock_guard<std::mutex> written_lock(mutex_);
+            target = written_;
+        }
+        bool ok = fd >= 0 && ::fdatasync(fd) == 0;
+        if (fd >= 0) {
+            ::close(fd);
+        }
+        if (!ok) {
+            LOG_WARNING("Error syncing the AOF: " << std::strerror(errno));
+        }
+        lock.lock();
+        if (ok) {
+            synced_ = std::max(synced_, target);
+            durable_ = std::max(durable_, target);
+        }
+    }
+}
+
+bool AppendOnlyFile::startRewrite(bool restart) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (child_ > 0 && !restart) {
+        return false;
+    }
+    if (child_ > 0) {
+        ::kill(child_, SIGKILL);
+        waitpid(child_, nullptr, 0);
+        ::unlink(rewrite_path_.c_str());
+        child_ = -1;
+    }
+    rewrite_path_ = path_ + ".rewrite-" + std::to_string(getpid());
+    rewrite_buffer_.clear();
+    pid_t pid = fork();
+    if (pid == 0) {
+        // Child: only reads its copy-on-write view of the keyspace
+        int fd = ::open(rewrite_path_.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        bool ok = fd >= 0 && writeRewrite(*keyspace_, fd) && ::fsync(fd) == 0;
+        ok = fd >= 0 && ::close(fd) == 0 && ok;
+        _exit(ok ? 0 : 1);
+    }
+    if (pid < 0) {
+        LOG_WARNING("Can't rewrite append only file in background: fork failed");
+        last_rewrite_ok_ = false;
+        return false;
+    }
+    child_ = pid;
+    LOG_NOTICE("Background append only file rewriting started by pid " << child_);
+    return true;
+}
+
+bool AppendOnlyFile::rewriteInProgress() const {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return child_ > 0;
+}
+
+std::string AppendOnlyFile::info() const {
+    std::lock_guard<std::mutex> lock(mutex_);
+    std::ostringstream out;
+    out << "aof_enabled:1\r\n"
+        << "aof_rewrite_in_progress:" << (child_ > 0 ? 1 : 0) << "\r\n"
+        << "aof_last_bgrewrite_status:" << (last_rewrite_ok_ ? "ok" : "err") << "\r\n"
+        << "aof_last_write_status:" << (last_write_ok_ ? "ok" : "err") << "\r\n"
+        << "aof_current_size:" << (appended_ - written_) + file_size_ << "\r\n"
+        << "aof_base_size:" << base_size_ << "\r\n"
+        << "aof_buffer_length:" << buffer_.size() << "\r\n"
+        << "aof_pending_fsync:" << (written_ - durable_) << "\r\n";
+    return out.str();
+}
+
+void AppendOnlyFile::cron() {
+    bool start_rewrite = false;
+    bool retry_write = false;
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        retry_write = !last_write_ok_ && !write_scheduled_;
+    }
+    if (retry_write) {
+        writePending();
+    }
+    std::vector<Waiter> released;
+    {
+        // Reaping the child and installing its file is one critical section: until the swap every append
+        // still goes to rewrite_buffer_, and no write to the old file can run in between
+        std::lock_guard<std::mutex> io_lock(io_mutex_);
+        std::lock_guard<std::mutex> lock(mutex_);
+        if (child_ > 0) {
+            int status = 0;
+            if (waitpid(child_, &status, WNOHANG) != child_) {
+                return; // still writing
+            }
+            child_ = -1;
+            last_rewrite_ok_ = WIFEXITED(status) && WEXITSTATUS(status) == 0;
+            if (!last_rewrite_ok_) {
+                LOG_WARNING("Background AOF rewrite failed");
+                ::unlink(rewrite_path_.c_str());
+                rewrite_buffer_.clear();
+                return;
+            }
+            if (!installRewrite(released)) {
+                return;
+            }
+        } else {
+            start_rewrite = file_size_ >= kRewriteMinSize &&
+                            file_size_ >= base_size_ + base_size_ * kRewriteGrowthPercent / 100;
+        }
+    }
+    for (auto& waiter : released) {
+        asio::post(waiter.executor, std::move(waiter.release));
+    }
+    if (!start_rewrite) {
+        return;
+    }
+    LOG_NOTICE("Starting automatic rewriting of AOF on " << kRewriteGrowthPercent << "% growth");
+    if (cores_ != nullptr) {
+        cores_->runPaused([this]() { startRewrite(); });
+    } else {
+        ShardLock lock = keyspace_->lockAll();
+        startRewrite();
+    }
+}
+
+// Adds what was appended while the child wrote and swaps the rewritten file in, so the log never has a gap.
+// io_mutex_ and mutex_ are held. The new file is the child's snapshot plus rewrite_buffer_, which holds every
+// command appended since the fork: bytes still in buffer_ were either applied before the fork (so they are in
+// the snapshot) or appended after it (so they are in rewrite_buffer_), writing them again would apply them twice.
+bool AppendOnlyFile::installRewrite(std::vector<Waiter>& released) {
+    const std::string& path = rewrite_path_;
+    int fd = ::open(path.c_str(), O_WRONLY | O_APPEND);
+    bool ok = fd >= 0 && writeAll(fd, rewrite_buffer_) && ::fsync(fd) == 0;
+    if (ok && ::rename(path.c_str(), path_.c_str()) != 0) {
+        ok = false;
+    }
+    rewrite_buffer_.clear();
+    rewrite_buffer_.shrink_to_fit();
+    if (!ok) {
+        LOG_WARNING("Could not install the rewritten AOF: " << std::strerror(errno));
+        if (fd >= 0) {
+            ::close(fd);
+        }
+        ::unlink(path.c_str());
+        last_rewrite_ok_ = false;
+        return false;
+    }
+    ::close(fd_);
+    fd_ = fd;
+    buffer_.clear();
+    last_write_ok_ = true;
+    written_ = durable_ = synced_ = appended_;
+    struct stat status;
+    file_size_ = base_size_ = ::fstat(fd_, &status) == 0 ? status.st_size : 0;
+    releaseDurable(released);
+    LOG_NOTICE("Background AOF rewrite finished successfully");
+    return true;
+}
+
+} // namespace redis_server
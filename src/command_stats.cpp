@@ -0,0 +1,203 @@
+#include "../include/command_stats.hpp"
+#include "../include/resp_writer.hpp"
+#include <algorithm>
+#include <cctype>
+#include <cstdio>
+#include <thread>
+
+namespace redis_server {
+
+namespace {
+
+std::string lowercase(std::string_view name) {
+    std::string out(name);
+    std::transform(out.begin(), out.end(), out.begin(), [](unsigned char c) { return std::tolower(c); });
+    return out;
+}
+
+std::string formatDouble(double value) {
+    char out[32];
+    std::snprintf(out, sizeof(out), "%.3f", value);
+    return out;
+}
+
+} // namespace
+
+double ticksPerMicrosecond() {
+    static const double ticks_per_us = []() {
+#if defined(__x86_64__) || defined(__i386__)
+        // Counts TSC ticks over a couple of milliseconds of steady_clock
+        auto start = std::chrono::steady_clock::now();
+        uint64_t start_ticks = readTicks();
+        while (std::chrono::steady_clock::now() - start < std::chrono::milliseconds(2)) {
+        }
+        double us = std::chrono::duration<double, std::micro>(std::chrono::steady_clock::now() - start).count();
+        return std::max((readTicks() - start_ticks) / us, 1e-3);
+#else
+        return 1000.0; // ticks are nanoseconds
+#endif
+    }();
+    return ticks_per_us;
+}
+
+CommandStats::CommandStats() {
+    ticksPerMicrosecond(); // calibrate at startup, not in the middle of a command
+}
+
+CommandStats::ThreadBlock& CommandStats::threadBlock() {
+    // Threads run until the process exits, so a block never has to be given back
+    thread_local ThreadBlock* block = nullptr;
+    if (block == nullptr) {
+        auto owned = std::make_unique<ThreadBlock>(allCommands().size());
+        block = owned.get();
+        std::lock_guard<std::mutex> lock(blocks_mutex_);
+        blocks_.push_back(std::move(owned));
+    }
+    return *block;
+}
+
+void CommandStats::record(const CommandSpec& command, uint64_t ticks) {
+    ThreadBlock& block = threadBlock();
+    CommandCounters& counters = block.commands[commandIndex(command)];
+    counters.calls.add(1);
+    counters.ticks.add(ticks);
+    OwnedCounter* buckets = counters.buckets.load(std::memory_order_relaxed);
+    if (buckets == nullptr) {
+        block.owned_buckets.emplace_back(new OwnedCounter[LatencyHistogram::kBuckets]);
+        buckets = block.owned_buckets.back().get();
+        counters.buckets.store(buckets, std::memory_order_release);
+    }
+    buckets[LatencyHistogram::bucketFor(std::min(ticks, LatencyHistogram::kMaxValue))].add(1);
+}
+
+void CommandStats::collect(std::vector<uint64_t>& calls, std::vector<uint64_t>& ticks,
+                           std::vector<LatencyHistogram>* histograms) const {
+    size_t commands = allCommands().size();
+    calls.assign(commands, 0);
+    ticks.assign(commands, 0);
+    if (histograms != nullptr) {
+        histograms->assign(commands, LatencyHistogram());
+    }
+    std::lock_guard<std::mutex> lock(blocks_mutex_);
+    for (const auto& block : blocks_) {
+        for (size_t i = 0; i < commands; ++i) {
+            const CommandCounters& counters = block->commands[i];
+            calls[i] += counters.calls.load();
+            ticks[i] += counters.ticks.load();
+            const OwnedCounter* buckets = counters.buckets.load(std::memory_order_acquire);
+            if (histograms == nullptr || buckets == nullptr) {
+                continue;
+            }
+            for (size_t bucket = 0; bucket < LatencyHistogram::kBuckets; ++bucket) {
+                (*histograms)[i].record(LatencyHistogram::highestValueIn(bucket), buckets[bucket].load());
+            }
+        }
+    }
+}
+
+std::string CommandStats::commandStatsInfo() const {
+    std::vector<uint64_t> calls, ticks;
+    collect(calls, ticks, nullptr);
+    std::string out = "# Commandstats\r\n";
+    auto commands = allCommands();
+    for (size_t i = 0; i < commands.size(); ++i) {
+        if (calls[i] == 0) {
+            continue;
+        }
+        double usec = ticks[i] / ticksPerMicrosecond();
+        out += "cmdstat_" + lowercase(commands[i].name) + ":calls=" + std::to_string(calls[i]) +
+               ",usec=" + std::to_string(static_cast<uint64_t>(usec)) + ",usec_per_call=" + formatDouble(usec / calls[i]) +
+               "\r\n";
+    }
+    return out;
+}
+
+std::string CommandStats::latencyStatsInfo() const {
+    std::vector<uint64_t> calls, ticks;
+    std::vector<LatencyHistogram> histograms;
+    collect(calls, ticks, &histograms);
+    std::string out = "# Latencystats\r\n";
+    auto commands = allCommands();
+    double ticks_per_us = ticksPerMicrosecond();
+    for (size_t i = 0; i < commands.size(); ++i) {
+        if (histograms[i].count() == 0) {
+            continue;
+        }
+        out += "latency_percentiles_usec_" + lowercase(commands[i].name) +
+               ":p50=" + formatDouble(histograms[i].percentile(50) / ticks_per_us) +
+               ",p99=" + formatDouble(histograms[i].percentile(99) / ticks_per_us) +
+               ",p99.9=" + formatDouble(histograms[i].percentile(99.9) / ticks_per_us) + "\r\n";
+    }
+    return out;
+}
+
+void SlowLog::setThreshold(long long microseconds) {
+    threshold_ticks_.store(microseconds < 0 ? -1 : static_cast<long long>(microseconds * ticksPerMicrosecond()),
+                           std::memory_order_relaxed);
+}
+
+void SlowLog::setMaxLength(size_t length) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    max_length_ = length;
+    if (entries_.size() > max_length_) {
+        entries_.resize(max_length_);
+    }
+}
+
+void SlowLog::add(std::span<const std::string_view> args, uint64_t ticks, std::string client) {
+    Entry entry;
+    entry.time = std::chrono::duration_cast<std::chrono::seconds>(
+        std::chrono::system_clock::now().time_since_epoch()).count();
+    entry.microseconds = static_cast<uint64_t>(ticks / ticksPerMicrosecond());
+    entry.client = std::move(client);
+    size_t kept = args.size() > kMaxArgs ? kMaxArgs - 1 : args.size();
+    for (size_t i = 0; i < kept; ++i) {
+        std::string_view arg = args[i];
+        if (arg.size() > kMaxArgLength) {
+            entry.args.push_back(std::string(arg.substr(0, kMaxArgLength)) + "... (" +
+                                 std::to_string(arg.size() - kMaxArgLength) + " more bytes)");
+        } else {
+            entry.args.emplace_back(arg);
+        }
+    }
+    if (kept < args.size()) {
+        entry.args.push_back("... (" + std::to_string(args.size() - kept) + " more arguments)");
+    }
+
+    std::lock_guard<std::mutex> lock(mutex_);
+    entry.id = next_id_++;
+    entries_.push_front(std::move(entry));
+    if (entries_.size() > max_length_) {
+        entries_.pop_back();
+    }
+}
+
+size_t SlowLog::length() const {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return entries_.size();
+}
+
+void SlowLog::reset() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    entries_.clear();
+}
+
+// Each entry: id, unix time, duration in microseconds, arguments, client address, client name
+std::string SlowLog::format(long long count) const {
+    std::lock_guard<std::mutex> lock(mutex_);
+    size_t returned = count < 0 ? entries_.size() : std::min(entries_.size(), static_cast<size_t>(count));
+    std::string out = "*" + std::to_string(returned) + "\r\n";
+    for (size_t i = 0; i < returned; ++i) {
+        const Entry& entry = entries_[i];
+        out += "*6\r\n:" + std::to_string(entry.id) + "\r\n:" + std::to_string(entry.time) + "\r\n:" +
+               std::to_string(entry.microseconds) + "\r\n*" + std::to_string(entry.args.size()) + "\r\n";
+        for (const auto& arg : entry.args) {
+            appendBulkString(out, arg);
+        }
+        appendBulkString(out, entry.client);
+        appendBulkString(out, "");
+    }
+    return out;
+}
+
+} // namespace redis_server
@@ -0,0 +1,167 @@
+#include "../include/command_table.hpp"
+#include "../include/session.hpp"
+#include <array>
+#include <cstddef>
+
+namespace redis_server {
+
+namespace {
+
+constexpr char toUpper(char c) {
+    return (c >= 'a' && c <= 'z') ? static_cast<char>(c - 'a' + 'A') : c;
+}
+
+// FNV-1a over the uppercased name, so lookups never need to copy or uppercase the argument
+constexpr uint32_t hashName(std::string_view name, uint32_t seed) {
+    uint32_t hash = 2166136261u ^ seed;
+    for (char c : name) {
+        hash ^= static_cast<uint8_t>(toUpper(c));
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+constexpr size_t kSlotCount = 256; // power of two, kept several times the number of commands so a seed is found quickly
+
+template <size_t N>
+constexpr bool isPerfect(const std::array<CommandSpec, N>& commands, uint32_t seed) {
+    std::array<bool, kSlotCount> used{};
+    for (const auto& command : commands) {
+        size_t slot = hashName(command.name, seed) & (kSlotCount - 1);
+        if (used[slot]) {
+            return false;
+        }
+        used[slot] = true;
+    }
+    return true;
+}
+
+// Searches for a seed that maps every command name to its own slot
+template <size_t N>
+constexpr uint32_t findSeed(const std::array<CommandSpec, N>& commands) {
+    for (uint32_t seed = 0; seed < 100000; ++seed) {
+        if (isPerfect(commands, seed)) {
+            return seed;
+        }
+    }
+    return UINT32_MAX;
+}
+
+template <size_t N>
+constexpr std::array<int16_t, kSlotCount> buildSlots(const std::array<CommandSpec, N>& commands, uint32_t seed) {
+    std::array<int16_t, kSlotCount> slots{};
+    for (auto& slot : slots) {
+        slot = -1;
+    }
+    for (size_t i = 0; i < N; ++i) {
+        slots[hashName(commands[i].name, seed) & (kSlotCount - 1)] = static_cast<int16_t>(i);
+    }
+    return slots;
+}
+
+} // namespace
+
+bool equalsIgnoreCase(std::string_view a, std::string_view b) {
+    if (a.size() != b.size()) {
+        return false;
+    }
+    for (size_t i = 0; i < a.size(); ++i) {
+        if (toUpper(a[i]) != toUpper(b[i])) {
+            return false;
+        }
+    }
+    return true;
+}
+
+// Holds the table, a friend of Session so it can name the command handlers
+struct CommandTable {
+    static constexpr std::array<CommandSpec, 37> kCommands = {{
+        {"PING",     &Session::pingCommand,     -1, 0,                                  0, 0, 0},
+        {"ECHO",     &Session::echoCommand,      2, 0,                                  0, 0, 0},
+        {"SET",      &Session::setCommand,      -3, CMD_WRITE | CMD_DENY_OOM,           1, 1, 1},
+        {"DEL",      &Session::delCommand,      -2, CMD_WRITE,                          1, -1, 1},
+        {"GET",      &Session::getCommand,       2, CMD_READONLY,                       1, 1, 1},
+        {"INCR",     &Session::incrCommand,      2, CMD_WRITE | CMD_DENY_OOM,           1, 1, 1},
+        {"INCRBY",   &Session::incrCommand,      3, CMD_WRITE | CMD_DENY_OOM,           1, 1, 1},
+        {"DECR",     &Session::incrCommand,      2, CMD_WRITE | CMD_DENY_OOM,           1, 1, 1},
+        {"DECRBY",   &Session::incrCommand,      3, CMD_WRITE | CMD_DENY_OOM,           1, 1, 1},
+        {"CONFIG",   &Session::configCommand,   -2, 0,                                  0, 0, 0},
+        {"KEYS",     &Session::keysCommand,      2, CMD_READONLY | CMD_ALL_KEYS,        0, 0, 0},
+        {"SCAN",     &Session::scanCommand,     -2, CMD_READONLY | CMD_CURSOR,          0, 0, 0},
+        {"INFO",     &Session::infoCommand,     -1, 0,                                  0, 0, 0},
+        {"REPLCONF", &Session::replconfCommand, -1, CMD_NO_QUEUE,                       0, 0, 0},
+        {"PSYNC",    &Session::psyncCommand,     3, CMD_NO_QUEUE,                       0, 0, 0},
+        {"WAIT",     &Session::waitCommand,      3, CMD_BLOCKING,                       0, 0, 0},
+        {"TYPE",     &Session::typeCommand,      2, CMD_READONLY,                       1, 1, 1},
+        {"EXPIRE",   &Session::expireCommand,    3, CMD_WRITE,                          1, 1, 1},
+        {"PEXPIRE",  &Session::expireCommand,    3, CMD_WRITE,                          1, 1, 1},
+        {"EXPIREAT", &Session::expireCommand,    3, CMD_WRITE,                          1, 1, 1},
+        {"PEXPIREAT", &Session::expireCommand,   3, CMD_WRITE,                          1, 1, 1},
+        {"TTL",      &Session::ttlCommand,       2, CMD_READONLY,                       1, 1, 1},
+        {"PTTL",     &Session::ttlCommand,       2, CMD_READONLY,                       1, 1, 1},
+        {"PERSIST",  &Session::persistCommand,   2, CMD_WRITE,                          1, 1, 1},
+        {"XADD",     &Session::xaddCommand,     -5, CMD_WRITE | CMD_DENY_OOM,           1, 1, 1},
+        {"XRANGE",   &Session::xrangeCommand,   -4, CMD_READONLY,                       1, 1, 1},
+        {"XREAD",    &Session::xreadCommand,    -4, CMD_READONLY | CMD_BLOCKING | CMD_MOVABLE_KEYS, 0, 0, 0},
+        {"MULTI",    &Session::multiCommand,     1, CMD_NO_QUEUE,                       0, 0, 0},
+        {"EXEC",     &Session::execCommand,      1, CMD_NO_QUEUE | CMD_ALL_KEYS,        0, 0, 0},
+        {"DISCARD",  &Session::discardCommand,   1, CMD_NO_QUEUE,                       0, 0, 0},
+        {"WATCH",    &Session::watchCommand,    -2, CMD_NO_QUEUE,                       1, -1, 1},
+        {"UNWATCH",  &Session::unwatchCommand,   1, 0,                                  0, 0, 0},
+        {"SAVE",     &Session::saveCommand,      1, CMD_ALL_KEYS,                       0, 0, 0},
+        {"BGSAVE",   &Session::bgsaveCommand,   -1, CMD_ALL_KEYS,                       0, 0, 0},
+        {"LASTSAVE", &Session::lastsaveCommand,  1, 0,                                  0, 0, 0},
+        {"BGREWRITEAOF", &Session::bgrewriteaofCommand, 1, CMD_ALL_KEYS,                0, 0, 0},
+        {"SLOWLOG",  &Session::slowlogCommand,  -2, 0,                                  0, 0, 0},
+    }};
+    static constexpr uint32_t kSeed = findSeed(kCommands);
+    static_assert(kSeed != UINT32_MAX, "no perfect hash seed for the command table, increase kSlotCount");
+    static constexpr std::array<int16_t, kSlotCount> kSlots = buildSlots(kCommands, kSeed);
+};
+
+const CommandSpec* lookupCommand(std::string_view name) {
+    int16_t index = CommandTable::kSlots[hashName(name, CommandTable::kSeed) & (kSlotCount - 1)];
+    if (index < 0 || !equalsIgnoreCase(CommandTable::kCommands[index].name, name)) {
+        return nullptr;
+    }
+    return &CommandTable::kCommands[index];
+}
+
+std::span<const CommandSpec> allCommands() {
+    return CommandTable::kCommands;
+}
+
+bool checkArity(const CommandSpec& spec, size_t argc) {
+    if (spec.arity >= 0) {
+        return argc == static_cast<size_t>(spec.arity);
+    }
+    return argc >= static_cast<size_t>(-spec.arity);
+}
+
+// Returns the key arguments of a command, used for routing and watching keys
+std::vector<std::string_view> commandKeys(const CommandSpec& spec, const std::vector<std::string_view>& args) {
+    std::vector<std::string_view> keys;
+    if (spec.flags & CMD_MOVABLE_KEYS) {
+        // XREAD [COUNT n] [BLOCK ms] STREAMS key [key ...] id [id ...]
+        for (size_t i = 1; i < args.size(); ++i) {
+            if (equalsIgnoreCase(args[i], "STREAMS")) {
+                size_t num_keys = (args.size() - i - 1) / 2;
+                for (size_t k = 0; k < num_keys; ++k) {
+                    keys.push_back(args[i + 1 + k]);
+                }
+                break;
+            }
+        }
+        return keys;
+    }
+    if (spec.first_key == 0) {
+        return keys;
+    }
+    int last = spec.last_key < 0 ? static_cast<int>(args.size()) + spec.last_key : spec.last_key;
+    for (int i = spec.first_key; i <= last && i < static_cast<int>(args.size()); i += spec.key_step) {
+        keys.push_back(args[i]);
+    }
+    return keys;
+}
+
+} // namespace redis_server
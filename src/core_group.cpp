@@ -0,0 +1,82 @@
+#include "../include/core_group.hpp"
+#include "../include/session.hpp"
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+
+namespace redis_server {
+
+void Core::post(std::function<void()> task) {
+    inbox_.push(std::move(task));
+    // Only wake the event loop once per burst of tasks
+    if (!drain_scheduled_.exchange(true, std::memory_order_acq_rel)) {
+        asio::post(io_context, [this]() { drain(); });
+    }
+}
+
+void Core::drain() {
+    // Cleared before popping so a push racing with this drain schedules another one
+    drain_scheduled_.store(false, std::memory_order_release);
+    while (auto task = inbox_.pop()) {
+        (*task)();
+    }
+}
+
+CoreGroup::CoreGroup(size_t count, std::shared_ptr<Keyspace> keyspace, std::string dir, std::string dbfilename,
+                     unsigned master_repl_offset)
+    : keyspace_(keyspace) {
+    cores_.reserve(count);
+    for (size_t i = 0; i < count; ++i) {
+        auto core = std::make_unique<Core>();
+        core->group = this;
+        core->index = i;
+        // The executor never owns a connected socket, its replies are captured and sent back to the caller
+        core->executor = std::make_shared<Session>(
+            asio::ip::tcp::socket(core->io_context), keyspace, dir, dbfilename, "", master_repl_offset);
+        core->executor->setCore(core.get());
+        cores_.push_back(std::move(core));
+    }
+}
+
+void CoreGroup::run() {
+    std::vector<std::thread> threads;
+    for (size_t i = 1; i < cores_.size(); ++i) {
+        threads.emplace_back([this, i]() { cores_[i]->io_context.run(); });
+    }
+    cores_[0]->io_context.run();
+    for (auto& thread : threads) {
+        thread.join();
+    }
+}
+
+bool CoreGroup::runPaused(std::function<void()> fn) {
+    if (pausing_.exchange(true, std::memory_order_acq_rel)) {
+        return false;
+    }
+    struct Barrier {
+        std::mutex mutex;
+        std::condition_variable released_cv;
+        size_t parked = 0;
+        bool released = false;
+        std::function<void()> fn;
+    };
+    auto barrier = std::make_shared<Barrier>();
+    barrier->fn = std::move(fn);
+    size_t count = cores_.size();
+    for (auto& core : cores_) {
+        core->post([this, barrier, count]() {
+            std::unique_lock<std::mutex> lock(barrier->mutex);
+            if (++barrier->parked < count) {
+                barrier->released_cv.wait(lock, [&barrier]() { return barrier->released; });
+                return;
+            }
+            barrier->fn();
+            barrier->released = true;
+            pausing_.store(false, std::memory_order_release);
+            barrier->released_cv.notify_all();
+        });
+    }
+    return true;
+}
+
+} // namespace redis_server
@@ -0,0 +1,95 @@
+#include "../include/glob.hpp"
+#include <utility>
+
+namespace redis_server {
+
+namespace {
+
+// Matches c against the set starting after the '[' at pattern[pos], sets end just past its ']'. An
+// unterminated set runs to the end of the pattern.
+bool matchSet(std::string_view pattern, size_t pos, char c, size_t& end) {
+    bool negate = pos < pattern.size() && pattern[pos] == '^';
+    if (negate) {
+        ++pos;
+    }
+    bool matched = false;
+    while (pos < pattern.size() && pattern[pos] != ']') {
+        if (pattern[pos] == '\\' && pos + 1 < pattern.size()) {
+            matched = matched || pattern[pos + 1] == c;
+            pos += 2;
+        } else if (pos + 2 < pattern.size() && pattern[pos + 1] == '-' && pattern[pos + 2] != ']') {
+            char low = pattern[pos];
+            char high = pattern[pos + 2];
+            if (low > high) {
+                std::swap(low, high);
+            }
+            matched = matched || (c >= low && c <= high);
+            pos += 3;
+        } else {
+            matched = matched || pattern[pos] == c;
+            ++pos;
+        }
+    }
+    end = pos < pattern.size() ? pos + 1 : pos;
+    return matched != negate;
+}
+
+} // namespace
+
+// Iterative, remembering only the last '*': on a mismatch that star takes one more character and matching
+// resumes behind it. Earlier stars never need to be revisited, so this is O(pattern * text) at worst where
+// the recursive matcher in Redis goes exponential on patterns like a*a*a*a*b.
+bool globMatch(std::string_view pattern, std::string_view text) {
+    size_t p = 0;
+    size_t t = 0;
+    size_t star_p = std::string_view::npos; // pattern position just after the last '*'
+    size_t star_t = 0;                       // text position that star has consumed up to
+    while (t < text.size()) {
+        if (p < pattern.size()) {
+            char c = pattern[p];
+            if (c == '*') {
+                while (p < pattern.size() && pattern[p] == '*') {
+                    ++p;
+                }
+                if (p == pattern.size()) {
+                    return true; // a trailing star takes the rest
+                }
+                star_p = p;
+                star_t = t;
+                continue;
+            }
+            size_t next = p + 1;
+            bool matched;
+            if (c == '?') {
+                matched = true;
+            } else if (c == '[') {
+                matched = matchSet(pattern, p + 1, text[t], next);
+            } else if (c == '\\' && p + 1 < pattern.size()) {
+                matched = pattern[p + 1] == text[t];
+                next = p + 2;
+            } else {
+                matched = c == text[t];
+            }
+            if (matched) {
+                p = next;
+                ++t;
+                continue;
+            }
+        }
+        if (star_p == std::string_view::npos) {
+            return false;
+        }
+        p = star_p;
+        t = ++star_t;
+    }
+    while (p < pattern.size() && pattern[p] == '*') {
+        ++p;
+    }
+    return p == pattern.size();
+}
+
+bool globIsLiteral(std::string_view pattern) {
+    return pattern.find_first_of("*?[\\") == std::string_view::npos;
+}
+
+} // namespace redis_server
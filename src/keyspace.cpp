@@ -0,0 +1,478 @@
+#include "../include/keyspace.hpp"
+#include <algorithm>
+#include <functional>
+#include <limits>
+#include <time.h>
+
+namespace redis_server {
+
+namespace {
+
+// Memory estimates. String keys and deadlines take a slot in their KeyTable, a node based hash table entry
+// costs its node (next pointer, cached hash, key and value) plus a bucket pointer, an expiry also adds an
+// expires set node (three pointers and a color).
+constexpr size_t kStringEntryBytes = StringStorageType::kSlotBytes;
+constexpr size_t kStreamEntryBytes = 3 * sizeof(void*) + sizeof(std::string) + sizeof(Stream);
+constexpr size_t kExpiryBytes = DeadlineStorageType::kSlotBytes + 4 * sizeof(void*) + sizeof(std::pair<TimePoint, std::string>);
+
+// Keys up to 15 bytes are stored inline by std::string, longer ones are allocated
+size_t keyHeapBytes(const std::string& key) {
+    return key.size() > 15 ? key.size() + 1 : 0;
+}
+
+size_t stringBytes(const std::string& key, const StringValue& value) {
+    return kStringEntryBytes + keyHeapBytes(key) + value.heapSize();
+}
+
+size_t expiryBytes(const std::string& key) {
+    return kExpiryBytes + 2 * keyHeapBytes(key); // the key is copied into both indexes
+}
+
+size_t streamBytes(const std::string& key, const Stream& stream) {
+    return kStreamEntryBytes + keyHeapBytes(key) + stream.memoryUsage();
+}
+
+// Eviction, following Redis: a few keys are sampled per eviction and the best ones seen are kept in a pool
+constexpr size_t kEvictionSamples = 5;
+constexpr size_t kEvictionPoolSize = 16;
+constexpr uint32_t kAccessMask = (1u << 24) - 1; // access metadata is 24 bits
+constexpr uint64_t kLruResolutionMs = 100;       // the LRU clock wraps after about 19 days
+constexpr uint8_t kLfuInitValue = 5;             // new keys do not start at 0, or they would be evicted first
+constexpr double kLfuLogFactor = 10;
+constexpr uint32_t kLfuDecayMinutes = 1;
+
+// The coarse clock is read from the vDSO without a syscall, cheap enough for every key access
+uint64_t coarseMillis() {
+    timespec now;
+    clock_gettime(CLOCK_MONOTONIC_COARSE, &now);
+    return static_cast<uint64_t>(now.tv_sec) * 1000 + now.tv_nsec / 1000000;
+}
+
+uint32_t lruClock() {
+    return (coarseMillis() / kLruResolutionMs) & kAccessMask;
+}
+
+// LFU metadata: 16 bits of minutes when the counter was last decremented, then an 8 bit logarithmic counter
+uint32_t lfuMinutes() {
+    return (coarseMillis() / 60000) & 0xFFFF;
+}
+
+// Counter after decaying one step per kLfuDecayMinutes since it was last touched
+uint8_t lfuDecayed(uint32_t access) {
+    uint32_t elapsed = (lfuMinutes() - (access >> 8)) & 0xFFFF;
+    uint32_t periods = elapsed / kLfuDecayMinutes;
+    uint8_t counter = access & 0xFF;
+    return periods > counter ? 0 : counter - periods;
+}
+
+template <typename Table, typename Visit>
+void sampleEntries(Table& table, std::minstd_rand& random, Visit visit) {
+    for (size_t i = 0; i < kEvictionSamples && !table.empty(); ++i) {
+        visit(table.randomEntry(random())->first);
+    }
+}
+
+} // namespace
+
+std::optional<EvictionPolicy> parseEvictionPolicy(std::string_view name) {
+    for (auto policy : {EvictionPolicy::NoEviction, EvictionPolicy::AllKeysLru, EvictionPolicy::AllKeysLfu,
+                        EvictionPolicy::VolatileTtl}) {
+        if (evictionPolicyName(policy) == name) {
+            return policy;
+        }
+    }
+    return std::nullopt;
+}
+
+std::string_view evictionPolicyName(EvictionPolicy policy) {
+    switch (policy) {
+    case EvictionPolicy::NoEviction:
+        return "noeviction";
+    case EvictionPolicy::AllKeysLru:
+        return "allkeys-lru";
+    case EvictionPolicy::AllKeysLfu:
+        return "allkeys-lfu";
+    case EvictionPolicy::VolatileTtl:
+        return "volatile-ttl";
+    }
+    return "";
+}
+
+void ShardLock::add(std::mutex& mutex) {
+    locks_.emplace_back(mutex);
+}
+
+StringStorageType::iterator Shard::findString(const std::string& key) {
+    auto it = strings.find(key);
+    if (it == strings.end()) {
+        return it;
+    }
+    if (it->second.hasExpiry() && std::chrono::system_clock::now() > expiryOf(it)) {
+        eraseString(it);
+        return strings.end();
+    }
+    touch(it->second);
+    return it;
+}
+
+void Shard::setString(const std::string& key, StringValue value, TimePoint expiry) {
+    // One hash lookup whether the key is new or not, value is only moved from if it was inserted
+    auto [it, inserted] = strings.try_emplace(key, std::move(value));
+    if (inserted) {
+        used_memory += stringBytes(it->first, it->second);
+    } else {
+        bool has_expiry = it->second.hasExpiry();
+        used_memory -= it->second.heapSize();
+        it->second = std::move(value);
+        used_memory += it->second.heapSize();
+        it->second.setHasExpiry(has_expiry); // setExpiry below still has to drop the old deadline
+    }
+    // A new value starts with fresh access metadata, as if it had just been created
+    it->second.setAccess(policy == EvictionPolicy::AllKeysLfu ? (lfuMinutes() << 8) | kLfuInitValue : lruClock());
+    touchWatched(key);
+    setExpiry(it, expiry);
+}
+
+void Shard::setInteger(StringStorageType::iterator it, int64_t value) {
+    used_memory -= it->second.heapSize();
+    it->second.setInteger(value);
+    touchWatched(it->first);
+}
+
+TimePoint Shard::expiryOf(StringStorageType::iterator it) const {
+    if (!it->second.hasExpiry()) {
+        return TimePoint::max();
+    }
+    auto deadline = deadlines.find(it->first);
+    return deadline != deadlines.end() ? deadline->second : TimePoint::max();
+}
+
+void Shard::setExpiry(StringStorageType::iterator it, TimePoint expiry) {
+    TimePoint current = expiryOf(it);
+    if (current == expiry) {
+        return;
+    }
+    touchWatched(it->first);
+    if (current != TimePoint::max()) {
+        expires.erase({current, it->first});
+    } else {
+        used_memory += expiryBytes(it->first);
+    }
+    if (expiry != TimePoint::max()) {
+        expires.emplace(expiry, it->first);
+        deadlines.insert_or_assign(it->first, expiry);
+    } else {
+        deadlines.erase(it->first);
+        used_memory -= expiryBytes(it->first);
+    }
+    it->second.setHasExpiry(expiry != TimePoint::max());
+}
+
+void Shard::eraseString(StringStorageType::iterator it) {
+    touchWatched(it->first);
+    TimePoint expiry = expiryOf(it);
+    if (expiry != TimePoint::max()) {
+        expires.erase({expiry, it->first});
+        deadlines.erase(it->first);
+        used_memory -= expiryBytes(it->first);
+    }
+    used_memory -= stringBytes(it->first, it->second);
+    strings.erase(it);
+}
+
+void Shard::setStream(std::string key, Stream stream) {
+    touchWatched(key);
+    auto [it, inserted] = streams.try_emplace(std::move(key));
+    if (!inserted) {
+        used_memory -= streamBytes(it->first, it->second);
+    }
+    it->second = std::move(stream);
+    used_memory += streamBytes(it->first, it->second);
+}
+
+void Shard::appendToStream(const std::string& key, const StreamId& id, const std::vector<std::string_view>& fields) {
+    auto [it, inserted] = streams.try_emplace(key);
+    size_t before = inserted ? 0 : streamBytes(it->first, it->second);
+    it->second.append(id, fields);
+    used_memory += streamBytes(it->first, it->second) - before;
+    touchWatched(key);
+}
+
+bool Shard::eraseKey(const std::string& key) {
+    auto string_it = findString(key);
+    if (string_it != strings.end()) {
+        eraseString(string_it);
+        return true;
+    }
+    auto stream_it = streams.find(key);
+    if (stream_it == streams.end()) {
+        return false;
+    }
+    touchWatched(key);
+    used_memory -= streamBytes(stream_it->first, stream_it->second);
+    streams.erase(stream_it);
+    return true;
+}
+
+void Shard::touch(StringValue& value) {
+    if (policy != EvictionPolicy::AllKeysLfu) {
+        value.setAccess(lruClock());
+        return;
+    }
+    // Logarithmic counter: the higher it is, the less likely an access increments it
+    uint8_t counter = lfuDecayed(value.access());
+    if (counter < 255) {
+        double base = counter > kLfuInitValue ? counter - kLfuInitValue : 0;
+        if (std::uniform_real_distribution<double>(0, 1)(eviction_random_) < 1.0 / (base * kLfuLogFactor + 1)) {
+            ++counter;
+        }
+    }
+    value.setAccess((lfuMinutes() << 8) | counter);
+}
+
+uint64_t Shard::evictionScore(StringStorageType::iterator it) const {
+    switch (policy) {
+    case EvictionPolicy::AllKeysLru:
+        return (lruClock() - it->second.access()) & kAccessMask; // idle time
+    case EvictionPolicy::AllKeysLfu:
+        return 255 - lfuDecayed(it->second.access());
+    case EvictionPolicy::VolatileTtl:
+        // Soonest deadline first
+        return std::numeric_limits<uint64_t>::max() -
+               std::chrono::duration_cast<std::chrono::milliseconds>(expiryOf(it).time_since_epoch()).count();
+    case EvictionPolicy::NoEviction:
+        break;
+    }
+    return 0;
+}
+
+void Shard::sampleEvictionCandidates() {
+    auto consider = [this](const std::string& key) {
+        auto it = strings.find(key);
+        if (it == strings.end()) {
+            return;
+        }
+        uint64_t score = evictionScore(it);
+        if (eviction_pool_.size() >= kEvictionPoolSize && score <= eviction_pool_.front().score) {
+            return;
+        }
+        for (const auto& candidate : eviction_pool_) {
+            if (candidate.key == key) {
+                return;
+            }
+        }
+        auto position = std::upper_bound(eviction_pool_.begin(), eviction_pool_.end(), score,
+                                         [](uint64_t s, const EvictionCandidate& c) { return s < c.score; });
+        eviction_pool_.insert(position, EvictionCandidate{score, key});
+        if (eviction_pool_.size() > kEvictionPoolSize) {
+            eviction_pool_.erase(eviction_pool_.begin());
+        }
+    };
+    if (policy == EvictionPolicy::VolatileTtl) {
+        sampleEntries(deadlines, eviction_random_, consider);
+    } else {
+        sampleEntries(strings, eviction_random_, consider);
+    }
+}
+
+bool Shard::evictOne(std::string& key) {
+    if (policy == EvictionPolicy::NoEviction) {
+        return false;
+    }
+    while (!(policy == EvictionPolicy::VolatileTtl ? deadlines.empty() : strings.empty())) {
+        sampleEvictionCandidates();
+        // Candidates may have been deleted or changed since they were pooled, those are skipped
+        while (!eviction_pool_.empty()) {
+            EvictionCandidate candidate = std::move(eviction_pool_.back());
+            eviction_pool_.pop_back();
+            auto it = strings.find(candidate.key);
+            if (it == strings.end() || (policy == EvictionPolicy::VolatileTtl && !it->second.hasExpiry())) {
+                continue;
+            }
+            key = std::move(candidate.key);
+            eraseString(it);
+            ++evicted_keys;
+            return true;
+        }
+    }
+    return false;
+}
+
+size_t Shard::expireCycle(std::chrono::steady_clock::duration budget, std::vector<std::string>& removed_keys) {
+    auto start = std::chrono::steady_clock::now();
+    TimePoint now = std::chrono::system_clock::now();
+    size_t removed = 0;
+    while (!expires.empty() && expires.begin()->first < now) {
+        auto first = expires.begin();
+        auto it = strings.find(first->second);
+        touchWatched(it->first);
+        used_memory -= stringBytes(it->first, it->second) + expiryBytes(it->first);
+        removed_keys.push_back(it->first);
+        strings.erase(it);
+        deadlines.erase(first->second);
+        expires.erase(first);
+        ++removed;
+        // Reading the clock is not free, only check the budget every few keys
+        if (removed % 16 == 0 && std::chrono::steady_clock::now() - start > budget) {
+            break;
+        }
+    }
+    return removed;
+}
+
+void Shard::rehashStep() {
+    constexpr size_t kGroups = 1024; // 16k slots, well under a millisecond
+    strings.rehashStep(kGroups);
+    deadlines.rehashStep(kGroups);
+}
+
+void Shard::clear() {
+    for (const auto& [key, flags] : watched_keys) {
+        for (const auto& flag : flags) {
+            flag->store(true, std::memory_order_relaxed);
+        }
+    }
+    strings.clear();
+    streams.clear();
+    deadlines.clear();
+    expires.clear();
+    eviction_pool_.clear();
+    used_memory = 0;
+}
+
+void Shard::reserve(size_t keys, size_t expires) {
+    strings.reserve(keys);
+    deadlines.reserve(expires);
+}
+
+void Shard::addStreamWaiter(const std::string& key, std::shared_ptr<StreamWaiter> waiter) {
+    stream_waiters[key].push_back(std::move(waiter));
+}
+
+void Shard::removeStreamWaiter(const std::string& key, const std::shared_ptr<StreamWaiter>& waiter) {
+    auto it = stream_waiters.find(key);
+    if (it == stream_waiters.end()) {
+        return;
+    }
+    std::erase(it->second, waiter);
+    if (it->second.empty()) {
+        stream_waiters.erase(it);
+    }
+}
+
+void Shard::wakeStreamWaiters(const std::string& key) {
+    auto it = stream_waiters.find(key);
+    if (it == stream_waiters.end()) {
+        return;
+    }
+    for (const auto& waiter : it->second) {
+        (*waiter)();
+    }
+}
+
+void Shard::addWatcher(const std::string& key, std::shared_ptr<WatchFlag> flag) {
+    watched_keys[key].push_back(std::move(flag));
+}
+
+void Shard::removeWatcher(const std::string& key, const std::shared_ptr<WatchFlag>& flag) {
+    auto it = watched_keys.find(key);
+    if (it == watched_keys.end()) {
+        return;
+    }
+    std::erase(it->second, flag);
+    if (it->second.empty()) {
+        watched_keys.erase(it); // the map is empty again once nobody watches, writers are back to one check
+    }
+}
+
+// Watchers stay registered until EXEC, DISCARD or UNWATCH, a flag that is set already just stays set
+void Shard::flagWatchers(const std::string& key) {
+    auto it = watched_keys.find(key);
+    if (it == watched_keys.end()) {
+        return;
+    }
+    for (const auto& flag : it->second) {
+        flag->store(true, std::memory_order_relaxed);
+    }
+}
+
+Keyspace::Keyspace(size_t num_shards, bool locking) : locking_(locking) {
+    if (num_shards == 0) {
+        num_shards = 1;
+    }
+    shards_.reserve(num_shards);
+    for (size_t i = 0; i < num_shards; ++i) {
+        shards_.push_back(std::make_unique<Shard>());
+    }
+}
+
+size_t Keyspace::shardIndex(std::string_view key) const {
+    if (shards_.size() == 1) {
+        return 0;
+    }
+    return std::hash<std::string_view>{}(key) % shards_.size();
+}
+
+void Keyspace::setMaxMemory(size_t bytes, EvictionPolicy policy) {
+    max_memory_ = bytes;
+    policy_ = policy;
+    for (auto& shard : shards_) {
+        shard->max_memory = bytes == 0 ? 0 : std::max<size_t>(1, bytes / shards_.size());
+        shard->policy = policy;
+    }
+}
+
+size_t Keyspace::usedMemory() const {
+    size_t used = 0;
+    for (const auto& shard : shards_) {
+        used += shard->used_memory.load(std::memory_order_relaxed);
+    }
+    return used;
+}
+
+size_t Keyspace::evictedKeys() const {
+    size_t evicted = 0;
+    for (const auto& shard : shards_) {
+        evicted += shard->evicted_keys.load(std::memory_order_relaxed);
+    }
+    return evicted;
+}
+
+ShardLock Keyspace::lockKeys(const std::vector<std::string_view>& keys) {
+    ShardLock lock;
+    if (!lockingEnabled() || keys.empty()) {
+        return lock;
+    }
+    std::vector<size_t> indexes;
+    indexes.reserve(keys.size());
+    for (const auto& key : keys) {
+        indexes.push_back(shardIndex(key));
+    }
+    std::sort(indexes.begin(), indexes.end());
+    indexes.erase(std::unique(indexes.begin(), indexes.end()), indexes.end());
+    for (size_t index : indexes) {
+        lock.add(shards_[index]->mutex);
+    }
+    return lock;
+}
+
+ShardLock Keyspace::lockShard(size_t index) {
+    ShardLock lock;
+    if (lockingEnabled()) {
+        lock.add(shards_[index]->mutex);
+    }
+    return lock;
+}
+
+ShardLock Keyspace::lockAll() {
+    ShardLock lock;
+    if (!lockingEnabled()) {
+        return lock;
+    }
+    for (auto& shard : shards_) {
+        lock.add(shard->mutex);
+    }
+    return lock;
+}
+
+} // namespace redis_server
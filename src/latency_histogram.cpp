@@ -0,0 +1,69 @@
+#include "../include/latency_histogram.hpp"
+#include <algorithm>
+#include <bit>
+#include <cmath>
+
+namespace redis_server {
+
+size_t LatencyHistogram::bucketFor(uint64_t value) {
+    if (value < kLinearBuckets) {
+        return value;
+    }
+    // The top kSubBucketBits + 1 bits pick the bucket, the first of them is always set
+    int shift = std::bit_width(value) - kSubBucketBits - 1;
+    size_t sub = (value >> shift) - kSubBuckets;
+    return kLinearBuckets + (shift - 1) * kSubBuckets + sub;
+}
+
+uint64_t LatencyHistogram::highestValueIn(size_t bucket) {
+    if (bucket < kLinearBuckets) {
+        return bucket;
+    }
+    int shift = static_cast<int>((bucket - kLinearBuckets) / kSubBuckets) + 1;
+    uint64_t sub = (bucket - kLinearBuckets) % kSubBuckets + kSubBuckets;
+    return ((sub + 1) << shift) - 1;
+}
+
+void LatencyHistogram::record(uint64_t value, uint64_t count) {
+    if (count == 0) {
+        return;
+    }
+    value = std::min(value, kMaxValue);
+    counts_[bucketFor(value)] += count;
+    count_ += count;
+    sum_ += value * count;
+    min_ = std::min(min_, value);
+    max_ = std::max(max_, value);
+}
+
+void LatencyHistogram::merge(const LatencyHistogram& other) {
+    for (size_t i = 0; i < kBuckets; ++i) {
+        counts_[i] += other.counts_[i];
+    }
+    count_ += other.count_;
+    sum_ += other.sum_;
+    min_ = std::min(min_, other.min_);
+    max_ = std::max(max_, other.max_);
+}
+
+void LatencyHistogram::reset() {
+    *this = LatencyHistogram();
+}
+
+uint64_t LatencyHistogram::percentile(double percentile) const {
+    if (count_ == 0) {
+        return 0;
+    }
+    auto wanted = static_cast<uint64_t>(std::ceil(std::clamp(percentile, 0.0, 100.0) / 100 * count_));
+    wanted = std::max<uint64_t>(wanted, 1);
+    uint64_t seen = 0;
+    for (size_t i = 0; i < kBuckets; ++i) {
+        seen += counts_[i];
+        if (seen >= wanted) {
+            return std::min(highestValueIn(i), max_);
+        }
+    }
+    return max_;
+}
+
+} // namespace redis_server
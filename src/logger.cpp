@@ -0,0 +1,201 @@
+#include "../include/logger.hpp"
+#include <algorithm>
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+#include <ctime>
+#include <string>
+#include <unistd.h>
+
+namespace redis_server {
+
+namespace {
+
+constexpr char kLevelMarks[] = {'.', '-', '*', '#'}; // same marks as Redis: debug, verbose, notice, warning
+
+void writeAll(int fd, std::string_view data) {
+    while (!data.empty()) {
+        ssize_t written = ::write(fd, data.data(), data.size());
+        if (written < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return; // nowhere left to report it
+        }
+        data.remove_prefix(static_cast<size_t>(written));
+    }
+}
+
+// "<pid> 16 Oct 2026 20:03:12.123 * "
+void appendPrefix(std::string& out, std::chrono::system_clock::time_point time, LogLevel level) {
+    auto since_epoch = time.time_since_epoch();
+    std::time_t seconds = std::chrono::duration_cast<std::chrono::seconds>(since_epoch).count();
+    long millis = std::chrono::duration_cast<std::chrono::milliseconds>(since_epoch).count() % 1000;
+    std::tm local;
+    localtime_r(&seconds, &local);
+    char date[64];
+    size_t length = std::strftime(date, sizeof(date), "%d %b %Y %H:%M:%S", &local);
+    char prefix[128];
+    int written = std::snprintf(prefix, sizeof(prefix), "%d %.*s.%03ld %c ", static_cast<int>(getpid()),
+                                static_cast<int>(length), date, millis, kLevelMarks[static_cast<int>(level)]);
+    out.append(prefix, std::clamp(written, 0, static_cast<int>(sizeof(prefix)) - 1));
+}
+
+} // namespace
+
+struct Logger::ThreadLine {
+    LineBuffer buffer;
+    std::ostream stream{&buffer};
+};
+
+Logger& Logger::instance() {
+    static Logger logger;
+    return logger;
+}
+
+std::optional<LogLevel> Logger::parseLevel(std::string_view name) {
+    static const std::pair<std::string_view, LogLevel> kLevels[] = {
+        {"debug", LogLevel::Debug}, {"verbose", LogLevel::Verbose},
+        {"notice", LogLevel::Notice}, {"warning", LogLevel::Warning},
+    };
+    for (const auto& [level_name, level] : kLevels) {
+        if (name == level_name) {
+            return level;
+        }
+    }
+    return std::nullopt;
+}
+
+Logger::Logger() {
+    for (size_t i = 0; i < kSlots; ++i) {
+        slots_[i].sequence.store(i, std::memory_order_relaxed);
+    }
+    thread_ = std::thread([this]() { run(); });
+}
+
+Logger::~Logger() {
+    stopping_.store(true);
+    wake();
+    thread_.join();
+}
+
+Logger::ThreadLine& Logger::threadLine() {
+    thread_local ThreadLine line;
+    return line;
+}
+
+std::ostream& Logger::begin() {
+    ThreadLine& line = threadLine();
+    line.buffer.reset();
+    line.stream.clear(); // a truncated line left the stream bad
+    return line.stream;
+}
+
+void Logger::commit(LogLevel level) {
+    if (!push(level, threadLine().buffer.view())) {
+        dropped_.fetch_add(1, std::memory_order_relaxed);
+    }
+}
+
+// Bounded multi producer queue after Vyukov: a producer claims a position, fills the slot and publishes it
+// through the slot's sequence, so producers only contend on the one counter and never wait for each other
+bool Logger::push(LogLevel level, std::string_view text) {
+    size_t position = enqueue_position_.load(std::memory_order_relaxed);
+    Slot* slot;
+    while (true) {
+        slot = &slots_[position & (kSlots - 1)];
+        size_t sequence = slot->sequence.load(std::memory_order_acquire);
+        auto difference = static_cast<std::ptrdiff_t>(sequence - position);
+        if (difference == 0) {
+            if (enqueue_position_.compare_exchange_weak(position, position + 1, std::memory_order_relaxed)) {
+                break;
+            }
+        } else if (difference < 0) {
+            return false; // full, the background thread has not caught up
+        } else {
+            position = enqueue_position_.load(std::memory_order_relaxed);
+        }
+    }
+    slot->level = level;
+    slot->time = std::chrono::system_clock::now();
+    slot->length = static_cast<uint16_t>(std::min(text.size(), kMaxLine));
+    std::memcpy(slot->text, text.data(), slot->length);
+    slot->sequence.store(position + 1, std::memory_order_release);
+    // Pairs with the fence in run(): either the background thread sees this slot or we see it asleep
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    if (sleeping_.load(std::memory_order_relaxed)) {
+        wake();
+    }
+    return true;
+}
+
+bool Logger::pending() const {
+    const Slot& slot = slots_[dequeue_position_ & (kSlots - 1)];
+    return slot.sequence.load(std::memory_order_acquire) == dequeue_position_ + 1;
+}
+
+void Logger::wake() {
+    sleeping_.store(false);
+    sleeping_.notify_one();
+}
+
+// Drains the ring into one buffer per round and writes it to stdout with a single write()
+void Logger::run() {
+    std::string out;
+    size_t reported_drops = 0;
+    while (true) {
+        while (pending()) {
+            Slot& slot = slots_[dequeue_position_ & (kSlots - 1)];
+            appendPrefix(out, slot.time, slot.level);
+            out.append(slot.text, slot.length);
+            out.push_back('\n');
+            slot.sequence.store(dequeue_position_ + kSlots, std::memory_order_release);
+            ++dequeue_position_;
+        }
+        size_t dropped = dropped_.load(std::memory_order_relaxed);
+        if (dropped != reported_drops) {
+            appendPrefix(out, std::chrono::system_clock::now(), LogLevel::Warning);
+            out += std::to_string(dropped - reported_drops) + " log lines dropped, the log ring was full";
+            out.push_back('\n');
+            reported_drops = dropped;
+        }
+        if (!out.empty()) {
+            writeAll(STDOUT_FILENO, out);
+            out.clear();
+            continue;
+        }
+        if (stopping_.load()) {
+            return;
+        }
+        sleeping_.store(true);
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        if (pending() || stopping_.load()) {
+            sleeping_.store(false);
+            continue;
+        }
+        sleeping_.wait(true);
+    }
+}
+
+std::ostream& operator<<(std::ostream& out, const LogPayload& payload) {
+    size_t shown = std::min(payload.data.size(), payload.limit);
+    for (char c : payload.data.substr(0, shown)) {
+        if (c == '\r') {
+            out << "\\r";
+        } else if (c == '\n') {
+            out << "\\n";
+        } else if (static_cast<unsigned char>(c) < 0x20 || static_cast<unsigned char>(c) >= 0x7f) {
+            char escaped[5];
+            std::snprintf(escaped, sizeof(escaped), "\\x%02x", static_cast<unsigned char>(c));
+            out << escaped;
+        } else {
+            out << c;
+        }
+    }
+    if (shown < payload.data.size()) {
+        out << "... (" << payload.data.size() - shown << " more bytes)";
+    }
+    return out;
+}
+
+} // namespace redis_server
@@ -0,0 +1,1032 @@
+#include "../include/rdb.hpp"
+#include "../include/keyspace.hpp"
+#include <cerrno>
+#include <cstring>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <stdexcept>
+#include <algorithm>
+#include <unistd.h>
+#include <vector>
+
+namespace redis_server {
+
+namespace {
+
+constexpr uint8_t kOpFunction = 0xF5;
+constexpr uint8_t kOpIdle = 0xF8;
+constexpr uint8_t kOpFreq = 0xF9;
+constexpr uint8_t kOpAux = 0xFA;
+constexpr uint8_t kOpResizeDb = 0xFB;
+constexpr uint8_t kOpExpireMs = 0xFC;
+constexpr uint8_t kOpExpireSec = 0xFD;
+constexpr uint8_t kOpSelectDb = 0xFE;
+constexpr uint8_t kOpEof = 0xFF;
+constexpr uint8_t kTypeString = 0;
+constexpr uint8_t kTypeList = 1;
+constexpr uint8_t kTypeSet = 2;
+constexpr uint8_t kTypeZset = 3;
+constexpr uint8_t kTypeHash = 4;
+constexpr uint8_t kTypeZset2 = 5;
+constexpr uint8_t kTypeHashZipmap = 9;
+constexpr uint8_t kTypeListZiplist = 10;
+constexpr uint8_t kTypeSetIntset = 11;
+constexpr uint8_t kTypeZsetZiplist = 12;
+constexpr uint8_t kTypeHashZiplist = 13;
+constexpr uint8_t kTypeListQuicklist = 14;
+constexpr uint8_t kTypeStreamListpacks = 15;
+constexpr uint8_t kTypeHashListpack = 16;
+constexpr uint8_t kTypeZsetListpack = 17;
+constexpr uint8_t kTypeListQuicklist2 = 18;
+constexpr uint8_t kTypeStreamListpacks2 = 19;
+constexpr uint8_t kTypeSetListpack = 20;
+constexpr uint8_t kTypeStreamListpacks3 = 21;
+constexpr uint8_t kEncInt8 = 0;
+constexpr uint8_t kEncInt16 = 1;
+constexpr uint8_t kEncInt32 = 2;
+constexpr uint8_t kEncLzf = 3;
+constexpr size_t kStreamNodeEntries = 100;
+
+void putLittleEndian(std::string& out, uint64_t value, int bytes) {
+    for (int i = 0; i < bytes; ++i) {
+        out.push_back(static_cast<char>(value >> (8 * i)));
+    }
+}
+
+// Builds one listpack, the structure Redis uses for stream nodes
+class ListpackBuilder {
+public:
+    void appendInteger(int64_t value) {
+        size_t start = body_.size();
+        if (value >= 0 && value <= 127) {
+            body_.push_back(static_cast<char>(value));
+        } else if (value >= -4096 && value <= 4095) {
+            uint64_t v = value < 0 ? (uint64_t(1) << 13) + value : value;
+            body_.push_back(static_cast<char>((v >> 8) | 0xC0));
+            body_.push_back(static_cast<char>(v & 0xFF));
+        } else if (value >= INT16_MIN && value <= INT16_MAX) {
+            body_.push_back(static_cast<char>(0xF1));
+            putLittleEndian(body_, static_cast<uint64_t>(value), 2);
+        } else if (value >= -(1 << 23) && value < (1 << 23)) {
+            body_.push_back(static_cast<char>(0xF2));
+            putLittleEndian(body_, static_cast<uint64_t>(value), 3);
+        } else if (value >= INT32_MIN && value <= INT32_MAX) {
+            body_.push_back(static_cast<char>(0xF3));
+            putLittleEndian(body_, static_cast<uint64_t>(value), 4);
+        } else {
+            body_.push_back(static_cast<char>(0xF4));
+            putLittleEndian(body_, static_cast<uint64_t>(value), 8);
+        }
+        finishElement(start);
+    }
+
+    void appendString(std::string_view value) {
+        size_t start = body_.size();
+        if (value.size() < 64) {
+            body_.push_back(static_cast<char>(0x80 | value.size()));
+        } else if (value.size() < 4096) {
+            body_.push_back(static_cast<char>(0xE0 | (value.size() >> 8)));
+            body_.push_back(static_cast<char>(value.size() & 0xFF));
+        } else {
+            body_.push_back(static_cast<char>(0xF0));
+            putLittleEndian(body_, value.size(), 4);
+        }
+        body_.append(value);
+        finishElement(start);
+    }
+
+    void append(const ListpackBuilder& other) {
+        body_ += other.body_;
+        elements_ += other.elements_;
+    }
+
+    std::string finish() const {
+        std::string out;
+        size_t total = 4 + 2 + body_.size() + 1;
+        putLittleEndian(out, total, 4);
+        putLittleEndian(out, elements_ < 65535 ? elements_ : 65535, 2);
+        out += body_;
+        out.push_back(static_cast<char>(0xFF));
+        return out;
+    }
+
+private:
+    // Every element ends with its own length, encoded so the listpack can be walked backwards
+    void finishElement(size_t start) {
+        uint64_t length = body_.size() - start;
+        if (length <= 127) {
+            body_.push_back(static_cast<char>(length));
+        } else if (length < 16383) {
+            body_.push_back(static_cast<char>(length >> 7));
+            body_.push_back(static_cast<char>((length & 127) | 128));
+        } else if (length < 2097151) {
+            body_.push_back(static_cast<char>(length >> 14));
+            body_.push_back(static_cast<char>(((length >> 7) & 127) | 128));
+            body_.push_back(static_cast<char>((length & 127) | 128));
+        } else if (length < 268435455) {
+            body_.push_back(static_cast<char>(length >> 21));
+            body_.push_back(static_cast<char>(((length >> 14) & 127) | 128));
+            body_.push_back(static_cast<char>(((length >> 7) & 127) | 128));
+            body_.push_back(static_cast<char>((length & 127) | 128));
+        } else {
+            body_.push_back(static_cast<char>(length >> 28));
+            body_.push_back(static_cast<char>(((length >> 21) & 127) | 128));
+            body_.push_back(static_cast<char>(((length >> 14) & 127) | 128));
+            body_.push_back(static_cast<char>(((length >> 7) & 127) | 128));
+            body_.push_back(static_cast<char>((length & 127) | 128));
+        }
+        ++elements_;
+    }
+
+    std::string body_;
+    size_t elements_ = 0;
+};
+
+struct RdbError : std::runtime_error {
+    using std::runtime_error::runtime_error;
+};
+
+// Decompresses an LZF block (the format Redis uses with rdbcompression) into out, which ends up length bytes long
+void lzfDecompress(std::string_view in, size_t length, std::string& out) {
+    out.resize(length);
+    const auto* ip = reinterpret_cast<const uint8_t*>(in.data());
+    const auto* in_end = ip + in.size();
+    char* op = out.data();
+    char* out_end = op + length;
+    while (ip < in_end) {
+        unsigned ctrl = *ip++;
+        if (ctrl < 32) { // literal run of ctrl + 1 bytes
+            size_t run = ctrl + 1;
+            if (static_cast<size_t>(in_end - ip) < run || static_cast<size_t>(out_end - op) < run) {
+                throw RdbError("corrupt LZF string");
+            }
+            std::memcpy(op, ip, run);
+            op += run;
+            ip += run;
+            continue;
+        }
+        // Back reference, it may overlap what it is copying so go byte by byte
+        size_t run = ctrl >> 5;
+        if (run == 7) {
+            if (ip >= in_end) {
+                throw RdbError("corrupt LZF string");
+            }
+            run += *ip++;
+        }
+        if (ip >= in_end) {
+            throw RdbError("corrupt LZF string");
+        }
+        size_t distance = ((ctrl & 0x1F) << 8) + *ip++ + 1;
+        run += 2;
+        if (distance > static_cast<size_t>(op - out.data()) || static_cast<size_t>(out_end - op) < run) {
+            throw RdbError("corrupt LZF string");
+        }
+        const char* ref = op - distance;
+        for (size_t i = 0; i < run; ++i) {
+            *op++ = *ref++;
+        }
+    }
+    if (op != out_end) {
+        throw RdbError("corrupt LZF string");
+    }
+}
+
+// Cursor over an RDB image, every read is bounds checked
+class RdbReader {
+public:
+    explicit RdbReader(std::string_view data) : data_(data) {}
+
+    bool atEnd() const { return pos_ >= data_.size(); }
+    size_t position() const { return pos_; }
+    void seek(size_t pos) { pos_ = pos; }
+
+    uint8_t byte() {
+        need(1);
+        return static_cast<uint8_t>(data_[pos_++]);
+    }
+
+    std::string_view bytes(size_t count) {
+        need(count);
+        std::string_view out = data_.substr(pos_, count);
+        pos_ += count;
+        return out;
+    }
+
+    uint64_t littleEndian(int count) {
+        std::string_view raw = bytes(count);
+        uint64_t value = 0;
+        for (int i = count - 1; i >= 0; --i) {
+            value = (value << 8) | static_cast<uint8_t>(raw[i]);
+        }
+        return value;
+    }
+
+    uint64_t bigEndian(int count) {
+        std::string_view raw = bytes(count);
+        uint64_t value = 0;
+        for (int i = 0; i < count; ++i) {
+            value = (value << 8) | static_cast<uint8_t>(raw[i]);
+        }
+        return value;
+    }
+
+    // Length encoding. Returns true in encoded when the value is a special string encoding instead.
+    uint64_t length(bool* encoded = nullptr) {
+        uint8_t first = byte();
+        if (encoded != nullptr) {
+            *encoded = false;
+        }
+        switch (first >> 6) {
+        case 0:
+            return first & 0x3F;
+        case 1:
+            return (uint64_t(first & 0x3F) << 8) | byte();
+        case 2:
+            if (first == 0x80) {
+                return bigEndian(4);
+            }
+            if (first == 0x81) {
+                return bigEndian(8);
+            }
+            throw RdbError("unknown length encoding");
+        default:
+            if (encoded == nullptr) {
+                throw RdbError("unexpected string encoding");
+            }
+            *encoded = true;
+            return first & 0x3F;
+        }
+    }
+
+    // Reads a string in any of its encodings. Plain strings are returned as a view of the input,
+    // integer and LZF encoded ones are decoded into scratch.
+    std::string_view string(std::string& scratch) {
+        bool encoded;
+        uint64_t length_or_type = length(&encoded);
+        if (!encoded) {
+            return bytes(length_or_type);
+        }
+        switch (length_or_type) {
+        case kEncInt8:
+            scratch = std::to_string(static_cast<int8_t>(littleEndian(1)));
+            return scratch;
+        case kEncInt16:
+            scratch = std::to_string(static_cast<int16_t>(littleEndian(2)));
+            return scratch;
+        case kEncInt32:
+            scratch = std::to_string(static_cast<int32_t>(littleEndian(4)));
+            return scratch;
+        case kEncLzf: {
+            uint64_t compressed_length = length();
+            uint64_t length_out = length();
+            lzfDecompress(bytes(compressed_length), length_out, scratch);
+            return scratch;
+        }
+        default:
+            throw RdbError("unknown string encoding " + std::to_string(length_or_type));
+        }
+    }
+
+    std::string string() {
+        std::string scratch;
+        return std::string(string(scratch));
+    }
+
+    // Steps over a string without decoding it
+    void skipString() {
+        bool encoded;
+        uint64_t length_or_type = length(&encoded);
+        if (!encoded) {
+            bytes(length_or_type);
+            return;
+        }
+        switch (length_or_type) {
+        case kEncInt8:
+            bytes(1);
+            break;
+        case kEncInt16:
+            bytes(2);
+            break;
+        case kEncInt32:
+            bytes(4);
+            break;
+        case kEncLzf: {
+            uint64_t compressed_length = length();
+            length(); // uncompressed length
+            bytes(compressed_length);
+            break;
+        }
+        default:
+            throw RdbError("unknown string encoding " + std::to_string(length_or_type));
+        }
+    }
+
+private:
+    void need(size_t count) const {
+        if (data_.size() - pos_ < count) {
+            throw RdbError("unexpected end of file");
+        }
+    }
+
+    std::string_view data_;
+    size_t pos_ = 0;
+};
+
+// Walks the elements of one listpack
+class ListpackReader {
+public:
+    explicit ListpackReader(std::string_view listpack) : data_(listpack), pos_(6) {
+        if (listpack.size() < 7) {
+            throw RdbError("listpack too short");
+        }
+    }
+
+    bool atEnd() const { return pos_ >= data_.size() || static_cast<uint8_t>(data_[pos_]) == 0xFF; }
+
+    // Reads the next element, which is either an integer or a string
+    bool next(int64_t& integer, std::string_view& string) {
+        size_t start = pos_;
+        uint8_t first = at(pos_);
+        bool is_integer = true;
+        if ((first & 0x80) == 0) {
+            integer = first & 0x7F;
+            pos_ += 1;
+        } else if ((first & 0xC0) == 0x80) {
+            string = view(pos_ + 1, first & 0x3F);
+            is_integer = false;
+        } else if ((first & 0xE0) == 0xC0) {
+            uint64_t v = (uint64_t(first & 0x1F) << 8) | at(pos_ + 1);
+            integer = v >= (1 << 12) ? int64_t(v) - (1 << 13) : int64_t(v);
+            pos_ += 2;
+        } else if ((first & 0xF0) == 0xE0) {
+            string = view(pos_ + 2, (size_t(first & 0x0F) << 8) | at(pos_ + 1));
+            is_integer = false;
+        } else if (first == 0xF0) {
+            string = view(pos_ + 5, littleEndian(pos_ + 1, 4));
+            is_integer = false;
+        } else if (first >= 0xF1 && first <= 0xF4) {
+            static constexpr int widths[] = {2, 3, 4, 8};
+            int width = widths[first - 0xF1];
+            uint64_t raw = littleEndian(pos_ + 1, width);
+            // Sign extend from width bytes
+            int shift = 64 - 8 * width;
+            integer = static_cast<int64_t>(raw << shift) >> shift;
+            pos_ += 1 + width;
+        } else {
+            throw RdbError("unknown listpack encoding");
+        }
+        if (!is_integer) {
+            pos_ = string.data() + string.size() - data_.data();
+        }
+        // Skip the element's back length
+        uint64_t length = pos_ - start;
+        pos_ += length <= 127 ? 1 : length < 16383 ? 2 : length < 2097151 ? 3 : length < 268435455 ? 4 : 5;
+        return is_integer;
+    }
+
+    int64_t integer() {
+        int64_t value;
+        std::string_view text;
+        if (!next(value, text)) {
+            auto parsed = parseCanonicalInteger(text);
+            if (!parsed) {
+                throw RdbError("listpack integer expected");
+            }
+            value = *parsed;
+        }
+        return value;
+    }
+
+    std::string string() {
+        int64_t value;
+        std::string_view text;
+        if (next(value, text)) {
+            return std::to_string(value);
+        }
+        return std::string(text);
+    }
+
+private:
+    uint8_t at(size_t pos) const {
+        if (pos >= data_.size()) {
+            throw RdbError("listpack truncated");
+        }
+        return static_cast<uint8_t>(data_[pos]);
+    }
+
+    std::string_view view(size_t pos, size_t count) const {
+        if (pos > data_.size() || data_.size() - pos < count) {
+            throw RdbError("listpack truncated");
+        }
+        return data_.substr(pos, count);
+    }
+
+    uint64_t littleEndian(size_t pos, int count) const {
+        uint64_t value = 0;
+        for (int i = count - 1; i >= 0; --i) {
+            value = (value << 8) | at(pos + i);
+        }
+        return value;
+    }
+
+    std::string_view data_;
+    size_t pos_;
+};
+
+// Metadata after a stream's nodes, nothing in it is needed to rebuild the entries
+void skipStreamTrailer(RdbReader& reader, uint8_t type) {
+    reader.length(); // length
+    reader.length(); // last id ms
+    reader.length(); // last id seq
+    if (type >= kTypeStreamListpacks2) {
+        reader.length(); // first id ms
+        reader.length(); // first id seq
+        reader.length(); // max deleted id ms
+        reader.length(); // max deleted id seq
+        reader.length(); // entries added
+    }
+    if (reader.length() != 0) {
+        throw RdbError("stream consumer groups are not supported");
+    }
+}
+
+Stream readStream(RdbReader& reader, uint8_t type) {
+    Stream stream;
+    uint64_t nodes = reader.length();
+    for (uint64_t n = 0; n < nodes; ++n) {
+        std::string key_scratch;
+        std::string listpack_scratch;
+        std::string_view master_key = reader.string(key_scratch);
+        std::string_view listpack = reader.string(listpack_scratch);
+        if (master_key.size() != 16) {
+            throw RdbError("bad stream node key");
+        }
+        RdbReader key_reader(master_key);
+        StreamId master{key_reader.bigEndian(8), key_reader.bigEndian(8)};
+
+        ListpackReader lp(listpack);
+        lp.integer(); // valid entries
+        lp.integer(); // deleted entries
+        int64_t master_field_count = lp.integer();
+        std::vector<std::string> master_fields;
+        for (int64_t i = 0; i < master_field_count; ++i) {
+            master_fields.push_back(lp.string());
+        }
+        lp.integer(); // end of the master entry
+
+        std::vector<std::string> fields;
+        std::vector<std::string_view> field_views;
+        while (!lp.atEnd()) {
+            int64_t flags = lp.integer();
+            StreamId id{master.ms + lp.integer(), master.seq + lp.integer()};
+            fields.clear();
+            if (flags & 2) { // same fields as the master entry, only the values are stored
+                for (const auto& field : master_fields) {
+                    fields.push_back(field);
+                    fields.push_back(lp.string());
+                }
+            } else {
+                int64_t field_count = lp.integer();
+                for (int64_t i = 0; i < field_count * 2; ++i) {
+                    fields.push_back(lp.string());
+                }
+            }
+            lp.integer(); // lp-count
+            if (!(flags & 1) && id > stream.lastId()) {
+                field_views.assign(fields.begin(), fields.end());
+                stream.append(id, field_views);
+            }
+        }
+    }
+    skipStreamTrailer(reader, type);
+    return stream;
+}
+
+void skipStream(RdbReader& reader, uint8_t type) {
+    for (uint64_t i = 0, nodes = reader.length(); i < nodes; ++i) {
+        reader.skipString(); // master ID
+        reader.skipString(); // listpack
+    }
+    skipStreamTrailer(reader, type);
+}
+
+// Steps over a value of a type this server does not store (lists, sets, hashes, sorted sets)
+void skipValue(RdbReader& reader, uint8_t type) {
+    switch (type) {
+    case kTypeList:
+    case kTypeSet:
+    case kTypeListQuicklist:
+        for (uint64_t i = 0, n = reader.length(); i < n; ++i) {
+            reader.skipString();
+        }
+        break;
+    case kTypeZset:
+        for (uint64_t i = 0, n = reader.length(); i < n; ++i) {
+            reader.skipString();
+            uint8_t score_length = reader.byte(); // 253-255 stand for nan, +inf and -inf
+            if (score_length < 253) {
+                reader.bytes(score_length);
+            }
+        }
+        break;
+    case kTypeZset2:
+        for (uint64_t i = 0, n = reader.length(); i < n; ++i) {
+            reader.skipString();
+            reader.bytes(8); // binary double
+        }
+        break;
+    case kTypeHash:
+        for (uint64_t i = 0, n = reader.length(); i < n; ++i) {
+            reader.skipString();
+            reader.skipString();
+        }
+        break;
+    case kTypeListQuicklist2:
+        for (uint64_t i = 0, n = reader.length(); i < n; ++i) {
+            reader.length(); // container kind
+            reader.skipString();
+        }
+        break;
+    case kTypeHashZipmap:
+    case kTypeListZiplist:
+    case kTypeSetIntset:
+    case kTypeZsetZiplist:
+    case kTypeHashZiplist:
+    case kTypeHashListpack:
+    case kTypeZsetListpack:
+    case kTypeSetListpack:
+        reader.skipString(); // the whole encoded collection is one string
+        break;
+    default:
+        throw RdbError("unknown RDB type " + std::to_string(type));
+    }
+}
+
+} // namespace
+
+RdbWriter::RdbWriter(int fd) : fd_(fd) {
+    buffer_.reserve(kBufferSize);
+}
+
+void RdbWriter::writeHeader() {
+    buffer_ += "REDIS0011";
+}
+
+void RdbWriter::writeAux(std::string_view key, std::string_view value) {
+    putByte(kOpAux);
+    putRawString(key);
+    putRawString(value);
+}
+
+void RdbWriter::writeSelectDb(uint64_t db) {
+    putByte(kOpSelectDb);
+    putLength(db);
+}
+
+void RdbWriter::writeResizeDb(uint64_t keys, uint64_t expires) {
+    putByte(kOpResizeDb);
+    putLength(keys);
+    putLength(expires);
+}
+
+void RdbWriter::writeString(std::string_view key, const StringValue& value, TimePoint expiry) {
+    if (expiry != TimePoint::max()) {
+        putByte(kOpExpireMs);
+        auto ms = std::chrono::duration_cast<std::chrono::milliseconds>(expiry.time_since_epoch()).count();
+        putLittleEndian(buffer_, static_cast<uint64_t>(ms), 8);
+    }
+    putByte(kTypeString);
+    putRawString(key);
+    auto integer = value.toInteger();
+    if (integer && *integer >= INT8_MIN && *integer <= INT8_MAX) {
+        putByte(0xC0 | kEncInt8);
+        putLittleEndian(buffer_, static_cast<uint64_t>(*integer), 1);
+    } else if (integer && *integer >= INT16_MIN && *integer <= INT16_MAX) {
+        putByte(0xC0 | kEncInt16);
+        putLittleEndian(buffer_, static_cast<uint64_t>(*integer), 2);
+    } else if (integer && *integer >= INT32_MIN && *integer <= INT32_MAX) {
+        putByte(0xC0 | kEncInt32);
+        putLittleEndian(buffer_, static_cast<uint64_t>(*integer), 4);
+    } else {
+        putRawString(value.str());
+    }
+    if (buffer_.size() >= kBufferSize) {
+        flushBuffer();
+    }
+}
+
+void RdbWriter::writeStream(std::string_view key, const Stream& stream) {
+    // One listpack node per kStreamNodeEntries entries, each keyed by its first ID in big endian
+    std::vector<std::pair<std::string, std::string>> nodes;
+    StreamId master;
+    ListpackBuilder entries;
+    size_t count = 0;
+    auto closeNode = [&]() {
+        ListpackBuilder node;
+        node.appendInteger(static_cast<int64_t>(count));
+        node.appendInteger(0);     // deleted
+        node.appendInteger(0);     // no master fields, every entry lists its own
+        node.appendInteger(0);     // end of the master entry
+        node.append(entries);
+        std::string node_key;
+        for (uint64_t part : {master.ms, master.seq}) {
+            for (int i = 7; i >= 0; --i) {
+                node_key.push_back(static_cast<char>(part >> (8 * i)));
+            }
+        }
+        nodes.emplace_back(std::move(node_key), node.finish());
+        entries = ListpackBuilder();
+        count = 0;
+    };
+    stream.range(StreamId::min(), StreamId::max(), [&](const StreamId& id, const std::vector<std::string_view>& fields) {
+        if (count == 0) {
+            master = id;
+        }
+        entries.appendInteger(0); // flags
+        entries.appendInteger(static_cast<int64_t>(id.ms - master.ms));
+        entries.appendInteger(static_cast<int64_t>(id.seq - master.seq));
+        entries.appendInteger(static_cast<int64_t>(fields.size() / 2));
+        for (const auto& field : fields) {
+            entries.appendString(field);
+        }
+        entries.appendInteger(static_cast<int64_t>(fields.size() + 4)); // lp-count
+        if (++count == kStreamNodeEntries) {
+            closeNode();
+        }
+    });
+    if (count > 0) {
+        closeNode();
+    }
+
+    putByte(kTypeStreamListpacks);
+    putRawString(key);
+    putLength(nodes.size());
+    for (const auto& [node_key, listpack] : nodes) {
+        putRawString(node_key);
+        putRawString(listpack);
+        if (buffer_.size() >= kBufferSize) {
+            flushBuffer();
+        }
+    }
+    putLength(stream.length());
+    putLength(stream.lastId().ms);
+    putLength(stream.lastId().seq);
+    putLength(0); // consumer groups
+}
+
+bool RdbWriter::finish() {
+    putByte(kOpEof);
+    putLittleEndian(buffer_, 0, 8); // a zero checksum tells loaders not to verify it
+    flushBuffer();
+    return !failed_;
+}
+
+void RdbWriter::putByte(uint8_t byte) {
+    buffer_.push_back(static_cast<char>(byte));
+}
+
+void RdbWriter::putLength(uint64_t length) {
+    if (length < (1 << 6)) {
+        putByte(static_cast<uint8_t>(length));
+    } else if (length < (1 << 14)) {
+        putByte(static_cast<uint8_t>((length >> 8) | 0x40));
+        putByte(static_cast<uint8_t>(length & 0xFF));
+    } else if (length <= UINT32_MAX) {
+        putByte(0x80);
+        for (int i = 3; i >= 0; --i) {
+            putByte(static_cast<uint8_t>(length >> (8 * i)));
+        }
+    } else {
+        putByte(0x81);
+        for (int i = 7; i >= 0; --i) {
+            putByte(static_cast<uint8_t>(length >> (8 * i)));
+        }
+    }
+}
+
+void RdbWriter::putRawString(std::string_view value) {
+    putLength(value.size());
+    buffer_.append(value);
+}
+
+void RdbWriter::flushBuffer() {
+    size_t done = 0;
+    while (done < buffer_.size() && !failed_) {
+        ssize_t n = ::write(fd_, buffer_.data() + done, buffer_.size() - done);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        failed_ = n <= 0;
+        done += n > 0 ? n : 0;
+    }
+    written_ += done;
+    buffer_.clear();
+}
+
+MappedFile::~MappedFile() {
+    if (data_ != nullptr) {
+        ::munmap(data_, size_);
+    }
+}
+
+bool MappedFile::open(const std::string& path, std::string& error) {
+    int fd = ::open(path.c_str(), O_RDONLY);
+    if (fd < 0) {
+        error = std::strerror(errno);
+        return false;
+    }
+    struct stat info;
+    if (::fstat(fd, &info) != 0) {
+        error = std::strerror(errno);
+        ::close(fd);
+        return false;
+    }
+    size_ = info.st_size;
+    if (size_ > 0) {
+        data_ = ::mmap(nullptr, size_, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (data_ == MAP_FAILED) {
+            error = std::strerror(errno);
+            data_ = nullptr;
+            size_ = 0;
+            ::close(fd);
+            return false;
+        }
+        ::madvise(data_, size_, MADV_SEQUENTIAL); // read-ahead aggressively, drop pages behind us
+    }
+    ::close(fd); // the mapping stays valid
+    return true;
+}
+
+namespace {
+
+void readHeader(RdbReader& reader) {
+    if (reader.bytes(5) != "REDIS") {
+        throw RdbError("not an RDB file");
+    }
+    reader.bytes(4); // version
+}
+
+// Decodes records until the EOF opcode (returns true) or until the reader reaches end (returns false)
+bool decodeRecords(RdbReader& reader, size_t end, const RdbHandler& handler) {
+    TimePoint expiry = TimePoint::max();
+    std::string scratch;
+    while (reader.position() < end) {
+        uint8_t opcode = reader.byte();
+        switch (opcode) {
+        case kOpEof:
+            return true; // the checksum after it is not verified
+        case kOpFunction:
+            reader.skipString();
+            break;
+        case kOpIdle:
+            reader.length(); // LRU idle time of the next key
+            break;
+        case kOpFreq:
+            reader.byte(); // LFU counter of the next key
+            break;
+        case kOpAux:
+            reader.skipString();
+            reader.skipString();
+            break;
+        case kOpSelectDb: {
+            uint64_t db = reader.length();
+            if (handler.on_select_db) {
+                handler.on_select_db(db);
+            }
+            break;
+        }
+        case kOpResizeDb: {
+            uint64_t keys = reader.length();
+            uint64_t expires = reader.length();
+            if (handler.on_resize) {
+                handler.on_resize(keys, expires);
+            }
+            break;
+        }
+        case kOpExpireMs:
+            expiry = TimePoint(std::chrono::milliseconds(reader.littleEndian(8)));
+            break;
+        case kOpExpireSec:
+            expiry = TimePoint(std::chrono::seconds(reader.littleEndian(4)));
+            break;
+        case kTypeString: {
+            std::string key = reader.string();
+            std::string_view value = reader.string(scratch);
+            if (handler.on_string) {
+                handler.on_string(std::move(key), StringValue(value), expiry);
+            }
+            expiry = TimePoint::max();
+            break;
+        }
+        case kTypeStreamListpacks:
+        case kTypeStreamListpacks2:
+        case kTypeStreamListpacks3: {
+            std::string key = reader.string();
+            Stream stream = readStream(reader, opcode);
+            if (handler.on_stream) {
+                handler.on_stream(std::move(key), std::move(stream));
+            }
+            expiry = TimePoint::max();
+            break;
+        }
+        default: {
+            std::string key = reader.string();
+            skipValue(reader, opcode);
+            if (handler.on_unsupported) {
+                handler.on_unsupported(key, opcode);
+            }
+            expiry = TimePoint::max();
+            break;
+        }
+        }
+    }
+    return false;
+}
+
+} // namespace
+
+bool loadRdb(std::string_view data, const RdbHandler& handler, std::string& error) {
+    try {
+        RdbReader reader(data);
+        readHeader(reader);
+        if (!decodeRecords(reader, data.size(), handler)) {
+            throw RdbError("unexpected end of file");
+        }
+        return true;
+    } catch (const RdbError& e) {
+        error = e.what();
+        return false;
+    }
+}
+
+bool splitRdb(std::string_view data, size_t count, std::vector<RdbSegment>& segments, std::string& error) {
+    try {
+        RdbReader reader(data);
+        readHeader(reader);
+        size_t target = std::max<size_t>(data.size() / std::max<size_t>(count, 1), 1);
+        uint64_t db = 0;
+        RdbSegment current{reader.position(), 0, 0};
+        bool in_record = false; // an expiry, idle or freq opcode belongs to the key that follows it
+        while (true) {
+            size_t position = reader.position();
+            if (!in_record && position - current.begin >= target) {
+                current.end = position;
+                segments.push_back(current);
+                current = RdbSegment{position, 0, db};
+            }
+            uint8_t opcode = reader.byte();
+            in_record = false;
+            switch (opcode) {
+            case kOpEof:
+                current.end = position;
+                segments.push_back(current);
+                return true;
+            case kOpFunction:
+                reader.skipString();
+                break;
+            case kOpAux:
+                reader.skipString();
+                reader.skipString();
+                break;
+            case kOpSelectDb:
+                db = reader.length();
+                break;
+            case kOpResizeDb:
+                reader.length();
+                reader.length();
+                break;
+            case kOpExpireMs:
+                reader.bytes(8);
+                in_record = true;
+                break;
+            case kOpExpireSec:
+                reader.bytes(4);
+                in_record = true;
+                break;
+            case kOpIdle:
+                reader.length();
+                in_record = true;
+                break;
+            case kOpFreq:
+                reader.byte();
+                in_record = true;
+                break;
+            case kTypeString:
+                reader.skipString();
+                reader.skipString();
+                break;
+            case kTypeStreamListpacks:
+            case kTypeStreamListpacks2:
+            case kTypeStreamListpacks3:
+                reader.skipString();
+                skipStream(reader, opcode);
+                break;
+            default:
+                reader.skipString();
+                skipValue(reader, opcode);
+                break;
+            }
+        }
+    } catch (const RdbError& e) {
+        error = e.what();
+        return false;
+    }
+}
+
+bool loadRdbSegment(std::string_view data, const RdbSegment& segment, const RdbHandler& handler, std::string& error) {
+    try {
+        RdbReader reader(data);
+        reader.seek(segment.begin);
+        if (handler.on_select_db) {
+            handler.on_select_db(segment.db);
+        }
+        decodeRecords(reader, segment.end, handler);
+        return true;
+    } catch (const RdbError& e) {
+        error = e.what();
+        return false;
+    }
+}
+
+void LoadedKeys::insertInto(Shard& shard) {
+    shard.reserve(shard.strings.size() + strings.size(), shard.deadlines.size() + expires);
+    for (auto& [key, value, expiry] : strings) {
+        shard.setString(key, std::move(value), expiry);
+    }
+    for (auto& [key, stream] : streams) {
+        shard.setStream(std::move(key), std::move(stream));
+    }
+    strings.clear();
+    streams.clear();
+    expires = 0;
+}
+
+bool writeRdb(Keyspace& keyspace, int fd, size_t* bytes_written) {
+    RdbWriter writer(fd);
+    writer.writeHeader();
+    writer.writeAux("redis-ver", "7.2.0");
+    writer.writeAux("redis-bits", "64");
+    auto now = std::chrono::system_clock::now();
+    writer.writeAux("ctime", std::to_string(std::chrono::duration_cast<std::chrono::seconds>(now.time_since_epoch()).count()));
+
+    size_t keys = 0;
+    size_t expires = 0;
+    for (size_t i = 0; i < keyspace.shardCount(); ++i) {
+        keys += keyspace.shard(i).strings.size() + keyspace.shard(i).streams.size();
+        expires += keyspace.shard(i).deadlines.size();
+    }
+    writer.writeSelectDb(0);
+    writer.writeResizeDb(keys, expires);
+    for (size_t i = 0; i < keyspace.shardCount(); ++i) {
+        Shard& shard = keyspace.shard(i);
+        for (auto it = shard.strings.begin(); it != shard.strings.end(); ++it) {
+            TimePoint expiry = shard.expiryOf(it);
+            if (expiry < now) {
+                continue; // already expired, active expiry just has not got to it yet
+            }
+            writer.writeString(it->first, it->second, expiry);
+        }
+        for (const auto& [key, stream] : shard.streams) {
+            writer.writeStream(key, stream);
+        }
+    }
+    bool ok = writer.finish();
+    if (bytes_written != nullptr) {
+        *bytes_written = writer.bytesWritten();
+    }
+    return ok;
+}
+
+bool saveRdb(Keyspace& keyspace, const std::string& path, size_t* bytes_written) {
+    std::string temp_path = path + ".tmp-" + std::to_string(getpid());
+    int fd = ::open(temp_path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) {
+        return false;
+    }
+    bool ok = writeRdb(keyspace, fd, bytes_written) && ::fsync(fd) == 0;
+    ok = ::close(fd) == 0 && ok;
+    if (!ok || ::rename(temp_path.c_str(), path.c_str()) != 0) {
+        ::unlink(temp_path.c_str());
+        return false;
+    }
+    return true;
+}
+
+pid_t forkRdbSnapshot(Keyspace& keyspace, const std::string& path, int report_fd) {
+    pid_t pid = fork();
+    if (pid != 0) {
+        return pid;
+    }
+    // Child: only reads its copy-on-write view of the keyspace, never touches locks or the event loop
+    auto start = std::chrono::steady_clock::now();
+    RdbSaveReport report;
+    bool ok = saveRdb(keyspace, path, &report.bytes);
+    report.nanoseconds = std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - start).count();
+    if (ok && report_fd >= 0) {
+        (void)!::write(report_fd, &report, sizeof(report));
+    }
+    _exit(ok ? 0 : 1);
+}
+
+} // namespace redis_server
@@ -0,0 +1,183 @@
+#include "../include/rdb_saver.hpp"
+#include "../include/core_group.hpp"
+#include "../include/logger.hpp"
+#include "../include/rdb.hpp"
+#include <charconv>
+#include <sstream>
+#include <sys/wait.h>
+#include <unistd.h>
+
+namespace redis_server {
+
+namespace {
+
+constexpr int64_t kRetryDelaySeconds = 5; // after a failed background save, before a rule may start another
+
+int64_t unixTime() {
+    return std::chrono::duration_cast<std::chrono::seconds>(std::chrono::system_clock::now().time_since_epoch()).count();
+}
+
+} // namespace
+
+RdbSaver::RdbSaver(std::shared_ptr<Keyspace> keyspace, std::string path, CoreGroup* cores)
+    : keyspace_(std::move(keyspace)), path_(std::move(path)), cores_(cores), last_save_(unixTime()) {}
+
+std::optional<std::vector<RdbSaver::Rule>> RdbSaver::parseRules(std::string_view text) {
+    std::vector<Rule> rules;
+    std::istringstream words{std::string(text)};
+    std::string seconds;
+    std::string changes;
+    while (words >> seconds) {
+        Rule rule;
+        if (!(words >> changes) ||
+            std::from_chars(seconds.data(), seconds.data() + seconds.size(), rule.seconds).ptr != seconds.data() + seconds.size() ||
+            std::from_chars(changes.data(), changes.data() + changes.size(), rule.changes).ptr != changes.data() + changes.size()) {
+            return std::nullopt;
+        }
+        rules.push_back(rule);
+    }
+    return rules;
+}
+
+void RdbSaver::setRules(std::vector<Rule> rules) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    rules_ = std::move(rules);
+}
+
+bool RdbSaver::save() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (child_ > 0) {
+        return false; // two writers would race for the same file
+    }
+    auto start = std::chrono::steady_clock::now();
+    size_t changes = changes_;
+    size_t bytes = 0;
+    bool ok = saveRdb(*keyspace_, path_, &bytes);
+    if (ok) {
+        changes_ -= changes;
+    }
+    finishSave(ok, bytes, std::chrono::steady_clock::now() - start);
+    return ok;
+}
+
+bool RdbSaver::startBackgroundSave() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (child_ > 0) {
+        return false;
+    }
+    changes_at_fork_ = changes_;
+    child_started_ = std::chrono::steady_clock::now();
+    int report_pipe[2] = {-1, -1};
+    if (::pipe(report_pipe) != 0) {
+        report_pipe[0] = report_pipe[1] = -1; // the parent's own measurement is used instead
+    }
+    child_ = forkRdbSnapshot(*keyspace_, path_, report_pipe[1]);
+    if (report_pipe[1] >= 0) {
+        ::close(report_pipe[1]);
+    }
+    report_fd_ = report_pipe[0];
+    if (child_ < 0) {
+        closeReport();
+        LOG_WARNING("Can't save in background: fork failed");
+        last_ok_ = false;
+        last_failure_ = unixTime();
+        return false;
+    }
+    LOG_NOTICE("Background saving started by pid " << child_);
+    return true;
+}
+
+bool RdbSaver::backgroundSaveInProgress() const {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return child_ > 0;
+}
+
+int64_t RdbSaver::lastSave() const {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return last_save_;
+}
+
+std::string RdbSaver::info() const {
+    std::lock_guard<std::mutex> lock(mutex_);
+    std::ostringstream out;
+    out << "# Persistence\r\n"
+        << "rdb_changes_since_last_save:" << changes_ << "\r\n"
+        << "rdb_bgsave_in_progress:" << (child_ > 0 ? 1 : 0) << "\r\n"
+        << "rdb_last_save_time:" << last_save_ << "\r\n"
+        << "rdb_last_bgsave_status:" << (last_ok_ ? "ok" : "err") << "\r\n"
+        << "rdb_last_save_time_ms:" << std::chrono::duration_cast<std::chrono::milliseconds>(last_duration_).count() << "\r\n"
+        << "rdb_last_save_bytes:" << last_bytes_ << "\r\n";
+    return out.str();
+}
+
+void RdbSaver::cron() {
+    bool start_save = false;
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        if (child_ > 0) {
+            int status = 0;
+            if (waitpid(child_, &status, WNOHANG) != child_) {
+                return; // still writing
+            }
+            bool ok = WIFEXITED(status) && WEXITSTATUS(status) == 0;
+            // The child reports how long writing took, our own clock would include up to one cron interval
+            RdbSaveReport report;
+            std::chrono::steady_clock::duration duration = std::chrono::steady_clock::now() - child_started_;
+            if (ok && report_fd_ >= 0 && ::read(report_fd_, &report, sizeof(report)) == sizeof(report)) {
+                duration = std::chrono::nanoseconds(report.nanoseconds);
+            }
+            closeReport();
+            if (ok) {
+                changes_ -= changes_at_fork_; // changes made while the child wrote are not in the file
+            }
+            child_ = -1;
+            finishSave(ok, report.bytes, duration);
+        }
+        int64_t now = unixTime();
+        // After a failure only retry once the delay passed, a full disk would otherwise fork 10 times a second
+        if (last_ok_ || now - last_failure_ >= kRetryDelaySeconds) {
+            for (const auto& rule : rules_) {
+                if (changes_ >= rule.changes && now - last_save_ >= rule.seconds) {
+                    LOG_NOTICE(rule.changes << " changes in " << rule.seconds << " seconds. Saving...");
+                    start_save = true;
+                    break;
+                }
+            }
+        }
+    }
+    if (start_save) {
+        runWithKeyspaceStill([this]() { startBackgroundSave(); });
+    }
+}
+
+bool RdbSaver::runWithKeyspaceStill(std::function<void()> fn) {
+    if (cores_ != nullptr) {
+        return cores_->runPaused(std::move(fn));
+    }
+    ShardLock lock = keyspace_->lockAll();
+    fn();
+    return true;
+}
+
+void RdbSaver::closeReport() {
+    if (report_fd_ >= 0) {
+        ::close(report_fd_);
+        report_fd_ = -1;
+    }
+}
+
+void RdbSaver::finishSave(bool ok, size_t bytes, std::chrono::steady_clock::duration duration) {
+    last_ok_ = ok;
+    last_duration_ = duration;
+    auto ms = std::chrono::duration_cast<std::chrono::milliseconds>(duration).count();
+    if (!ok) {
+        last_failure_ = unixTime();
+        LOG_WARNING("Saving the DB to " << path_ << " failed after " << ms << " ms");
+        return;
+    }
+    last_save_ = unixTime();
+    last_bytes_ = bytes;
+    LOG_NOTICE("DB saved on disk: " << bytes << " bytes written to " << path_ << " in " << ms << " ms");
+}
+
+} // namespace redis_server
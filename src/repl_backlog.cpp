@@ -0,0 +1,79 @@
+#include "../include/repl_backlog.hpp"
+#include <algorithm>
+#include <random>
+
+namespace redis_server {
+
+namespace {
+
+std::string randomReplid() {
+    static constexpr char kHex[] = "0123456789abcdef";
+    std::random_device device;
+    std::mt19937_64 engine((static_cast<uint64_t>(device()) << 32) ^ device());
+    std::string replid(40, '0');
+    for (auto& c : replid) {
+        c = kHex[engine() % 16];
+    }
+    return replid;
+}
+
+} // namespace
+
+ReplicationBacklog::ReplicationBacklog(size_t size) : replid_(randomReplid()), size_(std::max<size_t>(size, 1)) {}
+
+void ReplicationBacklog::create() {
+    if (created()) {
+        return;
+    }
+    buffer_.assign(size_, '\0');
+    head_ = 0;
+    length_ = 0;
+    created_.store(true, std::memory_order_release);
+}
+
+void ReplicationBacklog::resize(size_t size) {
+    size_ = std::max<size_t>(size, 1);
+    head_ = 0;
+    length_ = 0;
+    if (created()) {
+        buffer_.assign(size_, '\0');
+    }
+}
+
+void ReplicationBacklog::newHistory() {
+    replid_ = randomReplid();
+    head_ = 0;
+    length_ = 0;
+}
+
+void ReplicationBacklog::append(std::string_view data) {
+    end_offset_ += data.size();
+    if (!created()) {
+        return;
+    }
+    // Only the last buffer_.size() bytes can be kept
+    if (data.size() > buffer_.size()) {
+        data = data.substr(data.size() - buffer_.size());
+    }
+    size_t first = std::min(data.size(), buffer_.size() - head_);
+    std::copy_n(data.data(), first, buffer_.begin() + head_);
+    std::copy_n(data.data() + first, data.size() - first, buffer_.begin());
+    head_ = (head_ + data.size()) % buffer_.size();
+    length_ = std::min(length_ + data.size(), buffer_.size());
+}
+
+std::optional<std::string> ReplicationBacklog::copyFrom(size_t offset) const {
+    if (!created() || offset < startOffset() || offset > end_offset_) {
+        return std::nullopt;
+    }
+    size_t count = end_offset_ - offset;
+    size_t begin = (head_ + buffer_.size() - count) % buffer_.size();
+    std::string out;
+    out.reserve(count);
+    size_t first = std::min(count, buffer_.size() - begin);
+    out.append(buffer_, begin, first);
+    out.append(buffer_, 0, count - first);
+    return out;
+}
+
+} // namespace redis_server
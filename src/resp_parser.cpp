@@ -0,0 +1,159 @@
+#include "../include/resp_parser.hpp"
+#include <algorithm>
+#include <charconv>
+
+namespace redis_server {
+
+namespace {
+
+bool parseInteger(std::string_view text, long long& value) {
+    auto [ptr, ec] = std::from_chars(text.data(), text.data() + text.size(), value);
+    return ec == std::errc() && ptr == text.data() + text.size();
+}
+
+// Argument slots reserved up front, larger arrays grow as their elements actually arrive
+constexpr long long kArgsReserve = 1024;
+
+} // namespace
+
+void RespParser::reset() {
+    state_ = State::Start;
+    type_ = 0;
+    pos_ = 0;
+    scan_pos_ = 0;
+    remaining_ = 0;
+    bulk_length_ = 0;
+    is_rdb_ = false;
+    arg_offsets_.clear();
+}
+
+// Finds the CRLF ending the header that starts at pos_, without rescanning bytes seen in an earlier call
+bool RespParser::findLineEnd(std::string_view input, size_t& end) {
+    size_t from = scan_pos_ > pos_ ? scan_pos_ : pos_;
+    end = input.find("\r\n", from);
+    if (end == std::string_view::npos) {
+        // A '\r' at the very end may still be followed by '\n'
+        scan_pos_ = input.size() > pos_ ? input.size() - 1 : pos_;
+        return false;
+    }
+    scan_pos_ = 0;
+    return true;
+}
+
+RespParser::Status RespParser::finish(std::string_view input, RespFrame& frame) {
+    frame.type = is_rdb_ ? 'R' : type_;
+    frame.raw = input.substr(0, pos_);
+    frame.args.clear();
+    for (const auto& [offset, length] : arg_offsets_) {
+        frame.args.push_back(input.substr(offset, length));
+    }
+    reset();
+    return Status::Complete;
+}
+
+RespParser::Status RespParser::fail(std::string_view error) {
+    error_ = error;
+    return Status::Error;
+}
+
+RespParser::Status RespParser::parse(std::string_view input, RespFrame& frame) {
+    while (true) {
+        switch (state_) {
+        case State::Start: {
+            if (input.empty()) {
+                return Status::Incomplete;
+            }
+            type_ = input[0];
+            if (type_ == '*') {
+                state_ = State::ArrayHeader;
+            } else if (type_ == '$') {
+                state_ = State::BulkHeader; // a lone bulk string is parsed like an array element
+            } else if (type_ == '+' || type_ == '-' || type_ == ':') {
+                state_ = State::Line;
+            } else {
+                return fail("expected '*' or '$'");
+            }
+            break;
+        }
+        case State::Line: {
+            size_t end;
+            if (!findLineEnd(input, end)) {
+                return Status::Incomplete;
+            }
+            arg_offsets_.emplace_back(1, end - 1);
+            pos_ = end + 2;
+            return finish(input, frame);
+        }
+        case State::ArrayHeader: {
+            size_t end;
+            if (!findLineEnd(input, end)) {
+                return Status::Incomplete;
+            }
+            if (!parseInteger(input.substr(1, end - 1), remaining_) || remaining_ < 0 ||
+                remaining_ > kMaxMultibulkLength) {
+                return fail("invalid multibulk length");
+            }
+            pos_ = end + 2;
+            if (remaining_ == 0) {
+                return finish(input, frame);
+            }
+            arg_offsets_.reserve(std::min(remaining_, kArgsReserve));
+            state_ = State::BulkHeader;
+            break;
+        }
+        case State::BulkHeader: {
+            if (pos_ >= input.size()) {
+                return Status::Incomplete;
+            }
+            if (input[pos_] != '$') {
+                return fail("expected '$'"); // commands are arrays of bulk strings only
+            }
+            size_t end;
+            if (!findLineEnd(input, end)) {
+                return Status::Incomplete;
+            }
+            // Only the snapshot our master sends as a lone bulk string can be larger
+            if (!parseInteger(input.substr(pos_ + 1, end - pos_ - 1), bulk_length_) ||
+                (bulk_length_ > kMaxBulkLength && !(type_ == '$' && accept_rdb_))) {
+                return fail("invalid bulk length");
+            }
+            pos_ = end + 2;
+            if (bulk_length_ < 0) {
+                if (type_ == '$') {
+                    return finish(input, frame); // null bulk string
+                }
+                return fail("invalid bulk length");
+            }
+            state_ = State::BulkData;
+            break;
+        }
+        case State::BulkData: {
+            size_t available = input.size() - pos_;
+            size_t length = static_cast<size_t>(bulk_length_);
+            if (type_ == '$' && accept_rdb_) {
+                // rdb is like a bulk string but without the trailing \r\n
+                if (available < 5 && length >= 5) {
+                    return Status::Incomplete;
+                }
+                is_rdb_ = length >= 5 && input.substr(pos_, 5) == "REDIS";
+            }
+            size_t needed = is_rdb_ ? length : length + 2;
+            if (available < needed) {
+                return Status::Incomplete;
+            }
+            if (!is_rdb_ && input.substr(pos_ + length, 2) != "\r\n") {
+                return fail("expected CRLF after bulk data");
+            }
+            arg_offsets_.emplace_back(pos_, length);
+            pos_ += needed;
+            if (type_ == '$' || --remaining_ == 0) {
+                return finish(input, frame);
+            }
+            state_ = State::BulkHeader;
+            break;
+        }
+        }
+    }
+}
+
+} // namespace redis_server
@@ -0,0 +1,62 @@
+#include "../include/resp_writer.hpp"
+
+namespace redis_server {
+
+namespace {
+
+void appendHeader(std::string& out, char type, size_t count) {
+    out += type;
+    out += std::to_string(count);
+    out += "\r\n";
+}
+
+} // namespace
+
+void appendBulkString(std::string& out, std::string_view value) {
+    appendHeader(out, '$', value.size());
+    out.append(value);
+    out += "\r\n";
+}
+
+std::string formatBulkStrings(const std::vector<std::string>& messages, bool always_array) {
+    if (messages.empty()) {
+        return "$-1\r\n";
+    }
+    size_t size = 16;
+    for (const auto& message : messages) {
+        size += message.size() + 16;
+    }
+    std::string out;
+    out.reserve(size);
+    if (messages.size() > 1 || always_array) {
+        appendHeader(out, '*', messages.size());
+    }
+    for (const auto& message : messages) {
+        appendBulkString(out, message);
+    }
+    return out;
+}
+
+std::string formatRespArray(const std::vector<std::string>& messages, bool with_content) {
+    std::string out;
+    appendHeader(out, '*', messages.size());
+    if (with_content) {
+        for (const auto& message : messages) {
+            appendBulkString(out, message);
+        }
+    }
+    return out;
+}
+
+size_t appendStreamEntries(std::string& out, const Stream& stream, const StreamId& start, const StreamId& end) {
+    return stream.range(start, end, [&out](const StreamId& id, const std::vector<std::string_view>& fields) {
+        out += "*2\r\n";
+        appendBulkString(out, id.toString());
+        appendHeader(out, '*', fields.size());
+        for (const auto& field : fields) {
+            appendBulkString(out, field);
+        }
+    });
+}
+
+} // namespace redis_server
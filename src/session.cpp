@@ -1,1006 +1,1844 @@
 #include "../include/session.hpp"
-#include <iostream>
-#include <sstream>
+#include "../include/glob.hpp"
+#include "../include/logger.hpp"
+#include "../include/rdb.hpp"
+#include "../include/resp_writer.hpp"
+#include <algorithm>
+#include <charconv>
+#include <cstdio>
 #include <functional>
+#include <sys/wait.h>
+#include <unistd.h>
 
 using asio::ip::tcp; 
 namespace redis_server {
 
+namespace {
+
+// Shard a SCAN cursor continues in, an invalid cursor starts from the first one
+size_t scanCursorShard(std::string_view cursor, size_t shards) {
+    uint64_t value = 0;
+    std::from_chars(cursor.data(), cursor.data() + cursor.size(), value);
+    return value % shards;
+}
+
+// Expired keys active expiry has not reclaimed yet are left out of KEYS and SCAN, which only read
+bool isExpired(const Shard& shard, const StringStorageType::value_type& entry, TimePoint now) {
+    if (!entry.second.hasExpiry()) {
+        return false;
+    }
+    auto deadline = shard.deadlines.find(entry.first);
+    return deadline != shard.deadlines.end() && deadline->second < now;
+}
+
+// Parses a whole argument as an integer, false for anything else (ie: "abc", "10ms" or out of range)
+template <typename T>
+bool parseIntegerArgument(std::string_view text, T& value) {
+    auto [end, ec] = std::from_chars(text.data(), text.data() + text.size(), value);
+    return ec == std::errc() && end == text.data() + text.size();
+}
+
+// What replicas and the AOF get for a key removed by eviction or active expiry
+std::string formatDel(const std::string& key) {
+    return "*2\r\n$3\r\nDEL\r\n$" + std::to_string(key.size()) + "\r\n" + key + "\r\n";
+}
+
+} // namespace
+
 Session::Session(
     asio::ip::tcp::socket socket, 
-    std::shared_ptr<StringStorageType> storage,
+    std::shared_ptr<Keyspace> keyspace,
     std::string dir,
     std::string dbfilename,
     std::string masterdetails,
-    std::string master_repl_id,
-    unsigned master_repl_offset,
-    std::shared_ptr<StreamStorageType> stream_storage
+    unsigned master_repl_offset
 ) : socket_(std::move(socket)), 
-    string_storage_(storage), 
+    keyspace_(keyspace), 
     dir_(dir), 
     dbfilename_(dbfilename), 
     masterdetails_(masterdetails), 
-    master_repl_id_(master_repl_id), 
-    master_repl_offset_(master_repl_offset), 
-    stream_storage_(stream_storage) {}
+    master_repl_offset_(master_repl_offset) {}
 
-void Session::start() {
+void Session::start(std::string initial_data) {
+    // Bytes already received before the session took over the socket (ie: rdb after handshake)
+    if (!initial_data.empty()) {
+        read_buffer_ = std::move(initial_data);
+        processReadBuffer();
+    }
     read();
 }
 
-void Session::setReplica(bool replica) {
+void Session::setReplica(bool replica, size_t offset) {
     is_replica_ = replica;
+    parser_.setAcceptRdb(replica); // the full resync snapshot arrives on this connection
+    commandFromMasterSizes = offset; // replication offset the master stream continues from
 }
 
-std::vector<std::string> Session::splitString(const std::string& input, char delimiter) {
-    std::vector<std::string> tokens;
-    std::stringstream stream(input);
-    std::string token;
+void Session::setOnMasterLost(std::function<void(size_t offset)> on_master_lost) {
+    on_master_lost_ = std::move(on_master_lost);
+}
 
-    while (std::getline(stream, token, delimiter)) {
-        if (!token.empty() && token.back() == '\r') {
-            token.pop_back();
-        }
-        tokens.push_back(token);
-    }
+void Session::setCore(Core* core) {
+    core_ = core;
+}
 
-    return tokens;
+// Sends data to replica. Called from other sessions, so hop onto this session's strand first
+void Session::propagate(std::string_view command) {
+    auto self(shared_from_this());
+    asio::post(socket_.get_executor(), [this, self, message = std::string(command)]() {
+        if (sync_pending_) {
+            pending_replication_ += message; // follows the snapshot once it has been sent
+        } else {
+            queue_write(message);
+        }
+    });
 }
 
-// Splits multiple array commands up
-std::vector<std::string> Session::splitMultipleArrayCommands(const std::string &input) {
-    std::vector<std::string> tokens;
-    size_t pos = 0;
-    while (true) {
-        // Find an '*' that is immediately followed by a digit.
-        size_t start = input.find('*', pos);
-        if (start == std::string::npos)
-            break;
-        if (start + 1 >= input.size() || !std::isdigit(input[start + 1])) {
-            // If '*' is not followed by a digit, skip it.
-            pos = start + 1;
-            continue;
+// Processes every complete frame in data and returns how many bytes were consumed
+// Split data into each data type and their responding data: https://redis.io/docs/latest/develop/reference/protocol-spec/
+size_t Session::processFrames(std::string_view data) {
+    size_t consumed = 0;
+    RespFrame frame;
+    while (consumed < data.size() && !paused_) {
+        RespParser::Status status = parser_.parse(data.substr(consumed), frame);
+        if (status == RespParser::Status::Incomplete) {
+            break; // wait for more data, parser resumes where it stopped
         }
-        // Look for the next '*' that is immediately followed by a digit.
-        size_t nextPos = start + 1;
-        size_t nextDelimiter = std::string::npos;
-        while ((nextPos = input.find('*', nextPos)) != std::string::npos) {
-            if (nextPos + 1 < input.size() && std::isdigit(input[nextPos + 1])) {
-                nextDelimiter = nextPos;
-                break;
-            }
-            nextPos++;
+        if (status == RespParser::Status::Error) {
+            closeOnProtocolError();
+            return data.size();
         }
-        // If no next delimiter is found, take the rest of the input.
-        size_t end = (nextDelimiter != std::string::npos) ? nextDelimiter : input.size();
-        tokens.push_back(input.substr(start, end - start));
-        pos = end;
+        consumed += frame.raw.size();
+        processDataByType(frame);
     }
-    return tokens;
+    return consumed;
 }
 
-// Sends data to replica
-void Session::propagate(const std::string &command) {
+// Answers a malformed frame like Redis and closes the connection once the reply is out. Nothing after the
+// bad frame can be trusted, so reading stops right away.
+void Session::closeOnProtocolError() {
+    LOG_VERBOSE("Protocol error from client " << clientAddress() << ": " << parser_.error());
+    queue_write("-ERR Protocol error: " + std::string(parser_.error()) + "\r\n");
+    parser_.reset();
+    asio::error_code ec;
+    socket_.shutdown(tcp::socket::shutdown_receive, ec);
     auto self(shared_from_this());
-    asio::async_write(socket_, asio::buffer(command),
-        [this, self](asio::error_code ec, std::size_t /*length*/) {
-            if (!ec) {
-                read();
-            } else {
-                std::cerr << "Error propagating command: " << ec.message() << std::endl;
-            }
-        });
+    on_flushed_ = [this, self]() {
+        asio::error_code ec;
+        socket_.close(ec);
+    };
 }
 
-void Session::processCommands(std::string data) {
-    size_t pos = data.find("\r\n");
-    if (pos == std::string::npos) {
-        std::cerr << "Invalid data: header not found." << std::endl;
-        return;
-    }
-
-    // In the event got multiple element of type array in the array
-    std::vector<std::string> split_commands = splitMultipleArrayCommands(data);
-    for (auto split_command : split_commands) {
-        processCommand(split_command);
-    }
+// Processes the frames buffered in read_buffer_ as one batch
+void Session::processReadBuffer() {
+    in_batch_ = true;
+    size_t consumed = processFrames(read_buffer_);
+    read_buffer_.erase(0, consumed);
+    in_batch_ = false;
+    flush(); // all replies of this batch go out in one write
 }
 
-// Processes data and adds valid command into array
-// Split data into each data type and their responding data: https://redis.io/docs/latest/develop/reference/protocol-spec/
-void Session::getValidDataTypeChunks(std::string data, std::vector<std::string>& validCommands) {
-    size_t pos = data.find("\r\n");
-    if (pos == std::string::npos) {
-        std::cerr << "Invalid data" << std::endl;
-        return;
-    }
-    // Data is at least ...\r\n
-    char token = data[0];
-    if (token == '+') {
-        size_t fullCommandLength = pos + 2;
-        std::string fullCommand = data.substr(0, fullCommandLength);
-        validCommands.push_back(fullCommand);
-        if (data.size() > fullCommandLength) {
-            // Excess data, at least another command within
-            std::string remainingData = data.substr(fullCommandLength);
-            getValidDataTypeChunks(remainingData, validCommands);
-        }
-    } else if (token == '$') {
-        // Find length of data first
-        size_t headerEnd = data.find("\r\n");
-        if (headerEnd == std::string::npos) {
-            std::cerr << "Incomplete bulk string header. Skipping remainder.\n";
-            return;
-        }
-        std::string lengthStr = data.substr(1, headerEnd - 1);
-        int bulkLength = std::stoi(lengthStr);
-        
-        // Calculate total length: header + CRLF + bulk data + CRLF (if not rdb)
-        size_t totalLength;
-        if (data.find("REDIS") != std::string::npos) {
-            totalLength = headerEnd + 2 + bulkLength; // rdb is like bulk string but without the trailing \r\n
-        } else {
-            totalLength = headerEnd + 2 + bulkLength + 2;
-        }
-
-        if (data.size() < totalLength) {
-            std::cout << "Insufficient data, need to get more data" << std::endl;
-            // TODO: Instead of throwing an exception, buffer the partial data and wait for additional bytes.
-        } else if (data.size() == totalLength) {
-            std::string fullCommand = data;
-            validCommands.push_back(fullCommand);
-        } else {
-            std::string fullCommand = data.substr(0, totalLength);
-            validCommands.push_back(fullCommand);
-            std::string remainingData = data.substr(totalLength);
-            // Excess data, at least another command within
-            getValidDataTypeChunks(remainingData, validCommands);
-        }
-    } else if (token == '*') { // For now * used only for commands
-        // TODO: Currently assuming no insufficient data or excess
-        std::vector<std::string> split_commands = splitMultipleArrayCommands(data);
-        for (auto split_command : split_commands) {
-            validCommands.push_back(split_command);
+void Session::processDataByType(const RespFrame& frame) {
+    if (frame.type == '+') {
+        LOG_DEBUG("Processing data type simple string");
+    } else if (frame.type == '$') {
+        LOG_DEBUG("Processing data type bulk string");
+    } else if (frame.type == 'R') {
+        LOG_DEBUG("Processing rdb file");
+        if (!frame.args.empty()) {
+            loadSnapshot(frame.args[0]);
         }
+    } else if (frame.type == '*') { // For now * used only for commands
+        processCommand(frame);
     } else {
-        std::cout << "New token, not yet handled" << std::endl;
-    }
-}
-
-void Session::processDataByType(std::string command) {
-    char token = command[0];
-    if (token == '+') {
-        std::cout << "Processing data type simple string" << std::endl;
-    } else if (token == '$') {
-        std::cout << "Processing data type bulk string" << std::endl;
-    } else if (token == '*') { // For now * used only for commands
-        processCommands(command);
-    } else {
-        throw std::runtime_error("Unknown token: " + token);
+        LOG_DEBUG("New token, not yet handled");
     }
 }
 
-// Assume command receive is full command, no breaking
 // Data received are either 1) Commands (these are array of bulk strings) 2) RESP type, starts with + * $ etc
 // 1) send from master to replica or client to master 2) server replies or rdb file, not commands
+// Partial frames are kept in read_buffer_ until the rest arrives
 void Session::read() {
-    // https://redis.io/docs/latest/develop/reference/protocol-spec/#bulk-strings
+    if (reading_) {
+        return; // a read is already outstanding
+    }
+    reading_ = true;
     auto self(shared_from_this());
-    auto response_buffer = std::make_shared<std::string>();
-    asio::async_read_until(
-        socket_,
-        asio::dynamic_buffer(*response_buffer),
-        "\r\n",
-        [this, self, response_buffer](asio::error_code ec, std::size_t length) {
+    socket_.async_read_some(
+        asio::buffer(buffer_),
+        [this, self](asio::error_code ec, std::size_t length) {
             if (!ec) {
-                // Header and leftover not very useful now as data is sent as a whole without breaking
-                // Hence, always has left over which is essentially the part after data
-                std::string header = response_buffer->substr(0, length);
-                std::string leftover = response_buffer->substr(length);     
-                std::string data = header + leftover;
-                std::cout << "Data received: " << data << std::endl;
-                std::vector<std::string> validCommands;
-
-                getValidDataTypeChunks(data, validCommands);
-                for (auto command : validCommands) {
-                    processDataByType(command);
+                std::string_view incoming(buffer_.data(), length);
+                LOG_DEBUG("Data received: " << LogPayload{incoming});
+                if (paused_) {
+                    // Keep the order of the pipeline, these run once the other core has answered
+                    read_buffer_.append(incoming);
+                } else if (read_buffer_.empty()) {
+                    // Common case, parse straight from the socket buffer and only keep a trailing partial frame
+                    in_batch_ = true;
+                    size_t consumed = processFrames(incoming);
+                    read_buffer_.assign(incoming.substr(consumed));
+                    in_batch_ = false;
+                    flush(); // all replies of this batch go out in one write
+                } else {
+                    read_buffer_.append(incoming);
+                    processReadBuffer();
                 }
+                reading_ = false;
                 read();
-                
             } else {
+                reading_ = false;
+                if (is_replica_ && on_master_lost_) {
+                    on_master_lost_(commandFromMasterSizes); // reconnect and continue from here
+                }
+                dropReplica();
+                if (sync_pending_) {
+                    abortFullSync(); // replica went away during its full resync
+                }
+                if (blocked_read_) {
+                    // Client went away while blocked, drop its waiters so XADD stops waking it
+                    std::vector<std::string_view> keys(blocked_read_->keys.begin(), blocked_read_->keys.end());
+                    ShardLock lock = keyspace_->lockKeys(keys);
+                    cancelBlockedRead();
+                }
+                if (!watched_keys_.empty()) {
+                    ShardLock lock = lockWatchedKeys();
+                    unwatchAll();
+                }
                 if (ec != asio::error::eof) {
-                    std::cerr << "Read error: " << ec.message() << std::endl;
+                    LOG_VERBOSE("Read error: " << ec.message());
                 }
             }
         }
     );
 }
 
-// Validate data is valid command (ie: array of bulk strings) https://redis.io/docs/latest/develop/reference/protocol-spec/#resp-protocol-description
-bool Session::isDataValidRedisCommand(const std::string& data) {
-    // Check that data is not empty and starts with '*'
-    if (data.empty() || data[0] != '*')
-        return false;
-    
-    // Find end of array header (e.g., "*3\r\n")
-    size_t pos = data.find("\r\n");
-    if (pos == std::string::npos)
-        return false;
-    
-    // Parse the expected number of elements.
-    int expectedElements;
-    try {
-        expectedElements = std::stoi(data.substr(1, pos - 1));
-    } catch (const std::exception&) {
-        return false;
-    }
-    
-    // Initialize index after the header.
-    size_t index = pos + 2;
-    
-    for (int i = 0; i < expectedElements; i++) {
-        // Ensure the next character exists and is the bulk string marker '$'
-        if (index >= data.size() || data[index] != '$')
-            return false;
-        
-        // Find the end of the bulk string header (e.g., "$8\r\n")
-        size_t pos2 = data.find("\r\n", index);
-        if (pos2 == std::string::npos)
-            return false;
-        
-        // Parse the declared length for this bulk string.
-        int bulkLength;
-        try {
-            bulkLength = std::stoi(data.substr(index + 1, pos2 - index - 1));
-        } catch (const std::exception&) {
-            return false;
-        }
-        
-        // Calculate the starting index of the bulk data.
-        size_t startData = pos2 + 2;
-        
-        // Check if there are enough bytes for the bulk data plus the trailing "\r\n"
-        if (startData + bulkLength + 2 > data.size())
-            return false;
-        
-        index = startData + bulkLength + 2;
-    }
-    
-    // The command is complete only if we have parsed exactly all data.
-    return (index == data.size());
-}    
-
 bool Session::hasAcknowledged(size_t expectedOffset) {
     return lastAcknowledgedBytes >= expectedOffset;
 }
 
-bool Session::xaadIdIsGreaterThan(const std::string& newId, const std::string& oldId) {
-    size_t dashPos_newId = newId.find('-');
-    size_t dashPos_oldId = oldId.find('-');
-    int leftPart_newId = std::stoi(newId.substr(0, dashPos_newId));
-    std::string rightPart_newId = newId.substr(dashPos_newId + 1);
-    int leftPart_oldId = std::stoi(oldId.substr(0, dashPos_oldId)); // don't have * so can convert direct to int
-    int rightPart_oldId = std::stoi(oldId.substr(dashPos_oldId + 1));
-
-    if (leftPart_newId != leftPart_oldId) {
-        return leftPart_newId > leftPart_oldId;
-    }
-    // If left parts are equal, compare right parts
-    // If right part is a wild card then return true
-    if (rightPart_newId == "*") {
-        return true;
+// Helper function to get stream entries with start <= id <= end, already formatted as RESP
+std::pair<int, std::string> Session::getStreamEntries(const std::string& key, StreamId start, StreamId end) {
+    auto& streams = keyspace_->streams(key);
+    auto it_stream = streams.find(key);
+    if (it_stream == streams.end()) {
+        return {0, ""};
     }
-    return std::stoi(rightPart_newId) > rightPart_oldId;
+    std::string entries_data;
+    int entries_count = static_cast<int>(appendStreamEntries(entries_data, it_stream->second, start, end));
+    return {entries_count, entries_data};
 }
 
-bool Session::xaadIdIsLessThan(const std::string& newId, const std::string& oldId) {
-    if (oldId == "+") {
-        return true; // means max, always take till the end of the stream
+// Processes commands. Commands are sent in an array consisting of only bulk strings
+void Session::processCommand(const RespFrame& frame, bool execute) {
+    const std::vector<std::string_view>& args = frame.args;
+    if (args.empty()) {
+        return;
     }
-    size_t dashPos_newId = newId.find('-');
-    size_t dashPos_oldId = oldId.find('-');
-    int leftPart_newId = std::stoi(newId.substr(0, dashPos_newId));
-    std::string rightPart_newId = newId.substr(dashPos_newId + 1);
-    int leftPart_oldId = std::stoi(oldId.substr(0, dashPos_oldId)); // don't have * so can convert direct to int
-    int rightPart_oldId = std::stoi(oldId.substr(dashPos_oldId + 1));
 
-    if (leftPart_newId != leftPart_oldId) {
-        return leftPart_newId < leftPart_oldId;
-    }
-    // If left parts are equal, compare right parts
-    // If right part is a wild card then return true
-    if (rightPart_newId == "*") {
-        return false;
-    }
-    return std::stoi(rightPart_newId) < rightPart_oldId;
-}
+    // Commands from our master are applied silently, only GETACK is answered
+    suppress_replies_ = is_replica_ && !(equalsIgnoreCase(args[0], "REPLCONF") && args.size() >= 2 &&
+                                         equalsIgnoreCase(args[1], "GETACK"));
 
-// Helper function to get stream entries that match criteria
-std::pair<int, std::string> Session::getStreamEntries(
-    const std::string& key,
-    const std::string& start_id,
-    const std::string& end_id) {
-    
-    int entries_count = 0;
-    std::string entries_data = "";
-    
-    auto it_stream = stream_storage_->find(key);
-    if (it_stream == stream_storage_->end()) {
-        return {0, ""};
-    }
-    
-    // Start from front to back
-    auto& vector_of_tuples = it_stream->second;
-    for (const auto& tuple : vector_of_tuples) {
-        std::string id = std::get<0>(tuple);
-        std::vector<std::string> values = std::get<1>(tuple);
-        
-        bool include = false;
-        if (end_id == "&") { // xread
-            include = xaadIdIsGreaterThan(id, start_id);
-        } else { // xrange
-            include = (start_id == id || end_id == id || 
-                        (xaadIdIsGreaterThan(id, start_id) && xaadIdIsLessThan(id, end_id)));
-        }
-        
-        if (include) {
-            std::string values_message = format_resp_array(values, true);
-            entries_data += "*2\r\n$" + std::to_string(id.size()) + "\r\n" + id + "\r\n" + values_message;
-            entries_count++;
+    const CommandSpec* command = lookupCommand(args[0]);
+    if (command == nullptr) {
+        multi_error_ = in_multi_;
+        manual_write("-ERR unknown command '" + std::string(args[0]) + "'\r\n", execute);
+    } else if (!checkArity(*command, args.size())) {
+        multi_error_ = in_multi_;
+        manual_write("-ERR wrong number of arguments for '" + std::string(args[0]) + "' command\r\n", execute);
+    } else if (in_multi_ && !(command->flags & CMD_NO_QUEUE)) {
+        if (core_ != nullptr && !execute && routeToOwner(*command, frame)) {
+            multi_error_ = true; // transactions only run on keys owned by this core
+        } else {
+            queueCommand(*command, frame);
+            write_simple_string("QUEUED", execute);
         }
+    } else if (core_ != nullptr && !execute && routeToOwner(*command, frame)) {
+        // Forwarded to the core owning the keys, the reply comes back through onRemoteReply
+    } else {
+        executeCommand(*command, frame, execute);
     }
-    
-    return {entries_count, entries_data};
+    suppress_replies_ = false;
+    // Adds commands received so far
+    commandFromMasterSizes += frame.raw.size();
 }
 
-// When use lambda version it captured the for checkentries with form captured values (keys was 0)
-void Session::checkEntries(const asio::error_code& ec,
-                  std::shared_ptr<asio::steady_timer> timer,
-                  const std::vector<std::string>& keys,
-                  const std::vector<std::string>& last_seen_ids,
-                  int block_duration_ms,
-                  bool execute) {
-    if (ec) {
-        std::cout << "Error or canceled, sending null" << std::endl;
-        manual_write("$-1\r\n", execute);
-        return;
+// Runs a command that was checked already, for processCommand and for the queue of EXEC
+void Session::executeCommand(const CommandSpec& command, const RespFrame& frame, bool execute) {
+    // Lock the shards owning the keys, commands run by EXEC are covered by its lock on every shard
+    ShardLock lock;
+    if (keyspace_->lockingEnabled() && !execute) {
+        lock = (command.flags & CMD_ALL_KEYS) ? keyspace_->lockAll()
+                                              : keyspace_->lockKeys(commandKeys(command, frame.args));
     }
-
-    // Check for new entries
-    std::string result = "*" + std::to_string(keys.size()) + "\r\n";
-    bool has_new_entries = false;
-    for (size_t i = 0; i < keys.size(); i++) {
-        auto [entries_count, entries_data] = getStreamEntries(keys[i], last_seen_ids[i], "&");
-        result += "*2\r\n$" + std::to_string(keys[i].size()) + "\r\n" + keys[i] + "\r\n*" +
-                  std::to_string(entries_count) + "\r\n" + entries_data;
-        if (entries_count > 0) {
-            has_new_entries = true;
+    size_t dirty_before = dirty_;
+    rewritten_command_.clear();
+    // Replicas leave eviction to their master, whose DELs they apply
+    if ((command.flags & CMD_DENY_OOM) && !is_replica_ && !from_master_ && !loading_ && !evictForWrite(command, frame)) {
+        manual_write("-OOM command not allowed when used memory > 'maxmemory'.\r\n", execute);
+    } else if (g_command_stats.enabled() || g_slowlog.enabled()) {
+        uint64_t start = readTicks();
+        (this->*command.handler)(frame, execute);
+        uint64_t ticks = readTicks() - start;
+        if (g_command_stats.enabled()) {
+            g_command_stats.record(command, ticks);
         }
+        if (g_slowlog.isSlow(ticks)) {
+            g_slowlog.add(frame.args, ticks, clientAddress());
+        }
+    } else {
+        (this->*command.handler)(frame, execute);
     }
-
-    if (has_new_entries) {
-        manual_write(result, execute);
-        return;
+    // Only writes that changed the dataset are sent on to replicas, still under the lock to keep their order per key.
+    // A rewritten command (XADD with the ID it assigned) replaces the one received, replicas apply the same change.
+    if ((command.flags & CMD_WRITE) && dirty_ != dirty_before && !is_replica_ && !from_master_ && !loading_) {
+        propagateToReplicas(rewritten_command_.empty() ? frame.raw : std::string_view(rewritten_command_));
+    }
+    if ((command.flags & CMD_WRITE) && dirty_ != dirty_before && g_aof && !loading_) {
+        feedAppendOnly(frame);
     }
+    if (dirty_ != dirty_before && g_saver) {
+        g_saver->addChanges(dirty_ - dirty_before); // counted towards the save rules
+    }
+}
 
-    // Handle timeout or continue polling
-    if (block_duration_ms != 0 && timer->expiry() <= std::chrono::steady_clock::now()) {
-        manual_write("$-1\r\n", execute);
-        return;
+// Copies a command into the transaction buffers, keeping where each argument is for EXEC
+void Session::queueCommand(const CommandSpec& command, const RespFrame& frame) {
+    size_t offset = transaction_data_.size();
+    transaction_data_.append(frame.raw);
+    size_t first_arg = transaction_args_.size();
+    for (const auto& arg : frame.args) {
+        transaction_args_.emplace_back(offset + (arg.data() - frame.raw.data()), arg.size());
     }
+    transaction_queue_.push_back({&command, offset, frame.raw.size(), first_arg, frame.args.size()});
+}
 
-    timer->expires_after(std::chrono::milliseconds(500)); // Poll every 500ms
-    timer->async_wait([this, timer, keys, last_seen_ids, block_duration_ms, execute](const asio::error_code& ec) {
-        checkEntries(ec, timer, keys, last_seen_ids, block_duration_ms, execute);
-    });
+void Session::clearTransaction() {
+    in_multi_ = false;
+    multi_error_ = false;
+    transaction_queue_.clear();
+    transaction_args_.clear();
+    transaction_data_.clear();
+    if (transaction_data_.capacity() > kTransactionBufferKeep) {
+        transaction_data_.shrink_to_fit(); // one huge transaction should not pin its memory for good
+    }
 }
 
-// Processes commands. Commands are sent in an array consisting of only bulk strings
-void Session::processCommand(const std::string data, bool execute) {
-    if (!execute) { // if executing, don't need to add it as past commands cause it already exist
-        past_transactions.push_back(data);
+void Session::propagateToReplicas(std::string_view command) {
+    // No replica ever attached: nothing to send or record, so writes on different threads do not meet on the lock.
+    // The backlog is created with the whole keyspace held still (every shard lock, or every core parked), so no
+    // write can slip past between this check and the snapshot the first replica gets.
+    if (!g_repl_backlog.created()) {
+        return;
     }
-    int multi_index = -1;
-    int exec_index = -1;
-    for (int i = past_transactions.size() - 1; i >= 0; --i) {
-        if (multi_index == -1 && (past_transactions)[i] == "*1\r\n$5\r\nMULTI\r\n") {
-            multi_index = i;
-        }
-        
-        if (exec_index == -1 && (past_transactions)[i] == "*1\r\n$4\r\nEXEC\r\n") {
-            exec_index = i;
+    std::lock_guard<std::mutex> replicas_lock(g_replica_sessions_mutex);
+    g_repl_backlog.append(command);
+    for (auto& replica_session : g_replica_sessions) {
+        if (replica_session) {
+            replica_session->propagate(command);
         }
+    }
+}
 
-        if (multi_index != -1 && exec_index != -1) {
-            break;
+// Logs a write to the AOF. Relative expiries are followed by PEXPIREAT with the deadline they set, and XADD
+// is logged with the ID it assigned, so replaying the file later gives the same deadlines and IDs.
+void Session::feedAppendOnly(const RespFrame& frame) {
+    const auto& args = frame.args;
+    appendToAof(rewritten_command_.empty() ? frame.raw : std::string_view(rewritten_command_));
+    if (equalsIgnoreCase(args[0], "SET") || equalsIgnoreCase(args[0], "EXPIRE") || equalsIgnoreCase(args[0], "PEXPIRE")) {
+        std::string key(args[1]);
+        Shard& shard = keyspace_->shardFor(key);
+        auto it = shard.findString(key);
+        if (it != shard.strings.end() && it -> second.hasExpiry()) {
+            std::string deadline = std::to_string(std::chrono::duration_cast<std::chrono::milliseconds>(
+                shard.expiryOf(it).time_since_epoch()).count());
+            appendToAof("*3\r\n$9\r\nPEXPIREAT\r\n$" + std::to_string(key.size()) + "\r\n" + key + "\r\n$" +
+                        std::to_string(deadline.size()) + "\r\n" + deadline + "\r\n");
         }
     }
-    
-    if (!isDataValidRedisCommand(data)) {
-        std::cout << "Command not of format array of bulk strings: " << data << std::endl;
+}
+
+// Writes of a transaction are collected while EXEC runs and logged together between MULTI and EXEC, in one
+// append so no other core's write lands inside. Replaying a file cut short in the middle of one then applies
+// none of it.
+void Session::appendToAof(std::string_view command) {
+    if (exec_running_) {
+        exec_aof_.append(command);
         return;
     }
-    std::vector<std::string> split_data = splitString(data, '\n');
-    std::vector<std::string> messages;
-    bool include_size = false;
-    if (multi_index != (past_transactions.size() - 1) && multi_index > exec_index && split_data[2] != "DISCARD") {
-        write_simple_string("QUEUED", execute);
-    } else if (split_data[2] == "ECHO") {
-        // Echos back message
-        messages.push_back(split_data.back());
-        write(messages, include_size, execute); 
-    }
-    else if (split_data[2] == "SET") {
-        // Saves data from user
-        std::string key = split_data[4];
-        std::string value = split_data[6];
-        std::time_t expiry_time = 0;
-        if (split_data.size() >= 11 && split_data[8] == "px") {
-            int expiry_ms = std::stoi(split_data[10]); // milliseconds
-            auto expiry_time = std::chrono::system_clock::now() + std::chrono::milliseconds(expiry_ms);
-            (*string_storage_)[key] = std::make_tuple(value, expiry_time);
-        } else {
-            (*string_storage_)[key] = std::make_tuple(value, TimePoint::max());
-        }
-        
-        if (!is_replica_) { // propagate if not replica and respond
-            messages.push_back("OK");
-            propagatedCommandSizes += data.size(); 
-            for (auto& replica_session : g_replica_sessions) {
-                if (replica_session) {
-                    replica_session->propagate(data);
-                }
-            }
-            write(messages, include_size, execute);  
-        } else { // continue to read for replicas
-            read();
-        }
-    } 
-    else if (split_data[2] == "GET")
-    {
-        // Get data from storage
-        std::string key = split_data[4];
-
-        auto it = string_storage_->find(key);
-        if (it == string_storage_->end()) {
-        } else {
-            std::string stored_value = std::get<0>(it -> second);
-            TimePoint expiry_time = std::get<1>(it -> second);
-            
-            if (std::chrono::system_clock::now() > expiry_time) {
-                string_storage_->erase(it);
-            } else {
-                messages.push_back(stored_value);
-            }
-        }   
-        write(messages, include_size, execute);
+    size_t offset = g_aof->append(command, socket_.get_executor());
+    if (g_aof->policy() == AppendFsync::Always) {
+        aof_wait_offset_ = offset;
     }
-    else if (split_data[2] == "INCR") 
-    {
-        // INCR data from storage
-        std::string key = split_data[4];
-
-        auto it = string_storage_->find(key);
-        if (it == string_storage_->end()) {
-            (*string_storage_)[key] = std::make_tuple("1", TimePoint::max());
-            write_integer("1", execute);
-        } else {
-            std::string stored_value = std::get<0>(it -> second);
-
-            // Check if its a valid integer first
-            bool is_integer = true;
-            size_t start = 0;
-            for (size_t i = start; i < stored_value.length(); ++i) {
-                if (!std::isdigit(stored_value[i])) {
-                    manual_write("-ERR value is not an integer or out of range\r\n", execute);
-                    is_integer = false;
-                    break;
-                }
-            }
+}
 
-            if (is_integer) {
-                size_t incr_value = std::stoi(stored_value) + 1;
-                TimePoint expiry_time = std::get<1>(it -> second);
-                
-                if (std::chrono::system_clock::now() > expiry_time) {
-                    string_storage_->erase(it);
-                    write_integer("1", execute);
-                } else {
-                    (*string_storage_)[key] = std::make_tuple(std::to_string(incr_value), expiry_time);
-                    write_integer(std::to_string(incr_value), execute);
-                }
-            }
-            
-        }
+// Evicts keys until the shards owning the command's keys are back under their share of maxmemory.
+// Returns false if one of them can not be, the command is then refused.
+bool Session::evictForWrite(const CommandSpec& command, const RespFrame& frame) {
+    if (keyspace_->maxMemory() == 0) {
+        return true;
     }
-    else if (split_data[2] == "CONFIG") 
-    {
-        // Get config details
-        if (split_data[4] == "GET") {
-            std::string param_name = split_data[6];
-            std::string param_value = dir_;
-            messages.push_back(param_name);
-            messages.push_back(param_value);
-        }
-        write(messages, include_size); 
-    }
-    else if (split_data[2] == "KEYS") {
-        // Get keys of redis
-        for (const auto &entry : *string_storage_) {
-            messages.push_back(entry.first);
-        }
-        include_size = true;
-        write(messages, include_size, execute);
-    }
-    else if (split_data[2] == "INFO") {
-        if (masterdetails_ == "") {
-            // Master
-            std::string role = "role:master";
-            std::string master_repl_offset = "nmaster_repl_offset:0";
-            std::string nmaster_replid = "nmaster_replid:";
-            nmaster_replid += master_repl_id_;
-            std::string message = role + "\r\n" + master_repl_offset + "\r\n" + nmaster_replid;
-            messages.push_back(message);
-        } else {
-            // Not Master
-            messages.push_back("role:slave");
-        }
-        write(messages, include_size, execute);
-    }
-    else if (split_data[2] == "REPLCONF") {
-        if (is_replica_ && split_data[4] == "GETACK") {
-            std::string sizeStr = std::to_string(commandFromMasterSizes);
-            std::string ackMsg = "*3\r\n$8\r\nREPLCONF\r\n$3\r\nACK\r\n$" + 
-                     std::to_string(sizeStr.length()) + "\r\n" + 
-                     sizeStr + "\r\n";
-            manual_write(ackMsg, execute);
-        } else {    
-            if (!is_replica_ && split_data[4] == "ACK") {
-                size_t acknowledgedBytes = std::stoull(split_data[6]);
-                this->lastAcknowledgedBytes = acknowledgedBytes;
-            } else {
-                // Second Part of handshake with replicas
-                messages.push_back("OK");
-                write(messages, include_size, execute);  
+    std::string evicted;
+    for (const auto& key : commandKeys(command, frame.args)) {
+        Shard& shard = keyspace_->shardFor(key);
+        while (shard.overMemoryLimit()) {
+            if (!shard.evictOne(evicted)) {
+                return false;
             }
+            propagateEviction(evicted);
         }
     }
-    else if (split_data[2] == "PSYNC") {
-        if (!is_replica_) {
-            // Third Part of handshake with replicas
-            std::string message = "+FULLRESYNC " + master_repl_id_ + " " + std::to_string(master_repl_offset_);
-            messages.push_back(message);
-            write(messages, include_size, execute);
-            g_replica_sessions.push_back(shared_from_this()); // new replica connected
-            std::string empty_rdb = "\x52\x45\x44\x49\x53\x30\x30\x31\x31\xfa\x09\x72\x65\x64\x69\x73\x2d\x76\x65\x72\x05\x37\x2e\x32\x2e\x30\xfa\x0a\x72\x65\x64\x69\x73\x2d\x62\x69\x74\x73\xc0\x40\xfa\x05\x63\x74\x69\x6d\x65\xc2\x6d\x08\xbc\x65\xfa\x08\x75\x73\x65\x64\x2d\x6d\x65\x6d\xc2\xb0\xc4\x10\x00\xfa\x08\x61\x6f\x66\x2d\x62\x61\x73\x65\xc0\x00\xff\xf0\x6e\x3b\xfe\xc0\xff\x5a\xa2";
-            std::string return_msg = "$" + std::to_string(empty_rdb.length()) + "\r\n" + empty_rdb;
-            manual_write(return_msg, execute);
-        }
-    }
-    else if (split_data[2] == "WAIT") {
-        int numReplicas = std::stoi(split_data[4]);
-        int timeoutMs = std::stoi(split_data[6]);
-        if (numReplicas == 0 || timeoutMs == 0) {
-            manual_write(":0\r\n", execute);
-            return;
-        }
-        // Create a timer for the timeout
-        auto timer = std::make_shared<asio::steady_timer>(socket_.get_executor());
-        timer->expires_after(std::chrono::milliseconds(timeoutMs));        
-        // Store a reference to self to keep the session alive
-        auto self = shared_from_this();
-        
-        size_t offset = propagatedCommandSizes;
-
-        if (propagatedCommandSizes > 0) { // Only send GETACK if there’s something to acknowledge
-            std::string commandToGetACK = "*3\r\n$8\r\nREPLCONF\r\n$6\r\nGETACK\r\n$1\r\n*\r\n";
-            for (auto& replica_session : g_replica_sessions) {
-                if (replica_session) {
-                    replica_session->propagate(commandToGetACK);
-                }
-            }
-            propagatedCommandSizes += commandToGetACK.size();
-        }
-        // Define a recursive function to check acknowledgments
-        std::function<void(const asio::error_code&)> checkAcks;
+    return true;
+}
 
-        checkAcks = [this, self, timer, numReplicas, &checkAcks, offset, execute](const asio::error_code& ec) {
-            if (ec) {
-                // Timer was canceled or error occurred
-                manual_write(":0\r\n", execute);
-                return;
-            }
-            // Count acknowledged replicas
-            int replicasAcknowledged = 0;
-            for (auto& replica_session : g_replica_sessions) {
-                if (replica_session && replica_session->hasAcknowledged(offset)) {
-                    replicasAcknowledged++;
-                }
-            }
-            
-            // Check if we've reached the target or timed out
-            if (replicasAcknowledged >= numReplicas || 
-                timer->expiry() <= std::chrono::steady_clock::now()) {
-                // Complete the operation
-                manual_write(":" + std::to_string(replicasAcknowledged) + "\r\n", execute);
-                return;
-            }
-                
-            // Otherwise, schedule another check after a short delay
-            // timer->expires_after(std::chrono::milliseconds(50)); // This is less likely to be triggered since it starts after waiting for expiry_After
-            // timer->async_wait(checkAcks);
-        };
-        
-        // Start the acknowledgment checking process
-        timer->async_wait(checkAcks);            // starts after waiting for expiry_After
-    }
-    else if (split_data[2] == "TYPE") {
-        // Get type of data from storage
-        std::string key = split_data[4]; // TODO: I think by right a key can only hold one type of data at a time
-
-        auto it_stream = stream_storage_->find(key);
-        if (it_stream != stream_storage_->end()) {
-            write_simple_string("stream", execute);
-        } else {
-            auto it_string = string_storage_->find(key);
-            if (it_string == string_storage_->end()) {
-                write_simple_string("none", execute);
-            } else {
-                std::string stored_value = std::get<0>(it_string -> second);
-                TimePoint expiry_time = std::get<1>(it_string -> second);
-                
-                if (std::chrono::system_clock::now() > expiry_time) {
-                    string_storage_->erase(it_string);
-                    write_simple_string("none", execute);
-                } else {
-                    write_simple_string("string", execute); 
-                }
-            }   
-        }
-    }
-    else if (split_data[2] == "XADD" || split_data[2] == "xadd") {
-        std::string key = split_data[4];
-        std::string id = split_data[6];
-        std::string leftPart_Id, rightPart_Id;
-        std::vector<std::string> values;
-        // Start at index 7 (after command, key, ID and their length prefixes)
-        for (size_t i = 7; i < split_data.size(); i += 2) {
-            // Skip the length indicator ($3) and include only the actual value
-            if (i + 1 < split_data.size()) {
-                values.push_back(split_data[i + 1]);
-            }
-        }
-        if (id == "*") {
-            std::string generated_id = std::to_string(std::chrono::duration_cast<std::chrono::milliseconds>(
-                std::chrono::system_clock::now().time_since_epoch()).count());
-            leftPart_Id = generated_id;
-            rightPart_Id = "0";
-            id = leftPart_Id + "-" + rightPart_Id;
-        } else {
-            size_t dashPos_Id = id.find('-');
-            leftPart_Id = id.substr(0, dashPos_Id);
-            rightPart_Id = id.substr(dashPos_Id + 1);
+// An evicted key is deleted on replicas and in the AOF like any DEL, replicas do not evict on their own
+void Session::propagateEviction(const std::string& key) {
+    std::string command = formatDel(key);
+    propagateToReplicas(command);
+    if (g_aof) {
+        appendToAof(command);
+    }
+    if (g_saver) {
+        g_saver->addChanges(1);
+    }
+}
 
+void Session::propagateExpired(const std::vector<std::string>& keys, const asio::any_io_executor& executor) {
+    for (const auto& key : keys) {
+        std::string command = formatDel(key);
+        propagateToReplicas(command);
+        if (g_aof) {
+            g_aof->append(command, executor);
         }
+    }
+    if (g_saver && !keys.empty()) {
+        g_saver->addChanges(keys.size());
+    }
+}
 
-        auto it_stream = stream_storage_->find(key);
-        if (it_stream == stream_storage_->end()) {
-            // create new entry in dictionary
-            std::vector<std::tuple<std::string, std::vector<std::string>>> new_entry;
-            if (leftPart_Id == "0" && rightPart_Id == "*") {
-                id = leftPart_Id + "-" + "1"; // since lowest is 0-1
-            } else if (rightPart_Id == "*") {
-                id = leftPart_Id + "-" + "0"; // default sequence number is 0
-            }
-            new_entry.push_back(std::make_tuple(id, values));
-            (*stream_storage_)[key] = new_entry;
-            std::cout << "added as new entry with key" << key << std::endl;
-            write_bulk_string(id, execute);
-        } else {
-            // check if entry is valid
-            const auto& last_tuple = it_stream->second.back();
-            std::string id_last_entry = std::get<0>(last_tuple);
-            if (!xaadIdIsGreaterThan(id, "0-0")) {
-                manual_write("-ERR The ID specified in XADD must be greater than 0-0\r\n", execute);
-            } else if (!xaadIdIsGreaterThan(id, id_last_entry)) {
-                manual_write("-ERR The ID specified in XADD is equal or smaller than the target stream top item\r\n", execute);
-            } else {
-                if (rightPart_Id == "*") {
-                    size_t dashPos_id_last_entry = id_last_entry.find('-');
-                    std::string leftPart_Id_last_entry = id_last_entry.substr(0, dashPos_id_last_entry);
-                    int rightPart_Id_last_entry = std::stoi(id_last_entry.substr(dashPos_id_last_entry + 1));
-                    rightPart_Id_last_entry += 1;
-
-                    if (std::stoi(leftPart_Id) > std::stoi(leftPart_Id_last_entry)) {
-                        // if right side bigger and even if right part is *, just go to the new sequence with x-0
-                        id = leftPart_Id + "-" + "0";
-                    } else {
-                        id = leftPart_Id_last_entry + "-" + std::to_string(rightPart_Id_last_entry);
-                    }
-                }
-                auto& vector_of_tuples = it_stream->second;
-                vector_of_tuples.push_back(std::make_tuple(id, values));
-                write_bulk_string(id, execute);
-            }
+// Shared-nothing mode: sends commands on keys owned by another core to that core.
+// Returns true if the command was forwarded or rejected and must not run here.
+bool Session::routeToOwner(const CommandSpec& command, const RespFrame& frame) {
+    const auto& args = frame.args;
+    bool queuing = in_multi_;
+    if (command.flags & CMD_ALL_KEYS) {
+        if ((command.flags & CMD_READONLY) && !queuing) {
+            fanOutToCores(std::string(frame.raw));
+            return true;
         }
+        return false; // EXEC only runs queued commands, which are all local
     }
-    else if (split_data[2] == "XRANGE" || split_data[2] == "xrange") {
-        std::string key = split_data[4];
-        // get start
-        std::string start_id = split_data[6];
-        size_t dashPos_start_id = start_id.find('-');
-        if (start_id == "-") {
-            start_id = "0-1"; // give the smallest possible id so that it will be the beginning of the stream
-        } else if (dashPos_start_id == std::string::npos) {
-            start_id = start_id + "-0";
-        }
-        // get end
-        std::string end_id = split_data[8];
-        size_t dashPos_end_id = end_id.find('-');
-        if (end_id == "+") {
-            end_id = "+";
-        } else if (dashPos_end_id == std::string::npos) {
-            end_id = end_id + "-0";
-        }
-
-        auto [entries_count, entries_data] = getStreamEntries(key, start_id, end_id);
-        manual_write("*" + std::to_string(entries_count) + "\r\n" + entries_data, execute);
-    }
-    else if (split_data[2] == "XREAD" || split_data[2] == "xread") {
-        // Find the "block" keyword
-        size_t block_index = 0;
-        int block_duration_ms = 0;
-        for (size_t i = 0; i < split_data.size(); i++) {
-            if (split_data[i] == "block") {
-                block_index = i;
-                block_duration_ms = std::stoi(split_data[i + 2]);
-                break;
-            }
-        }
-        // Find the "STREAMS" keyword
-        size_t streams_index = 0;
-        for (size_t i = 3; i < split_data.size(); i++) {
-            if (split_data[i] == "streams") {
-                streams_index = i;
-                break;
-            }
-        }
-        
-        if (streams_index == 0) {
-            manual_write("-ERR Syntax error\r\n", execute);
-            return;
+    if (command.flags & CMD_CURSOR) {
+        if (queuing) {
+            return false;
         }
-        
-        // Extract the keys and IDs
-        std::vector<std::string> keys;
-        std::vector<std::string> ids;
-        
-        // Calculate where keys and IDs begin (since we know its half keys half ids)
-        size_t total_items = split_data.size() - streams_index - 1;
-        size_t num_keys = total_items / 2;
-        
-        // Extract keys (first half after "STREAMS")
-        for (size_t i = 1; i < num_keys; i+=2) {
-            keys.push_back(split_data[streams_index + 1 + i]);
-        }
-        
-        // Extract IDs (second half after keys)
-        for (size_t i = 1; i < num_keys; i+=2) {
-            ids.push_back(split_data[streams_index + 1 + num_keys + i]);
-        }
-        if (block_index == 0) {
-            // Non-blocking XREAD: respond immediately with existing entries
-            std::string result = "*" + std::to_string(keys.size()) + "\r\n";
-            for (size_t i = 0; i < keys.size(); i++) {
-                auto [entries_count, entries_data] = getStreamEntries(keys[i], ids[i], "&");
-                result += "*2\r\n$" + std::to_string(keys[i].size()) + "\r\n" + keys[i] + "\r\n*" +
-                          std::to_string(entries_count) + "\r\n" + entries_data;
-            }
-            manual_write(result, execute);
-        } else {
-            // Blocking XREAD
-            auto self = shared_from_this();
-            auto timer = std::make_shared<asio::steady_timer>(socket_.get_executor());
-            
-            if (block_duration_ms == 0) {
-                timer->expires_after(std::chrono::milliseconds(50)); // Initial polling interval for blocking
-            } else {
-                timer->expires_after(std::chrono::milliseconds(block_duration_ms)); // Total timeout
-            }
-
-            // Track the highest existing ID for each key as the baseline
-            std::vector<std::string> last_seen_ids(keys.size());
-            for (size_t i = 0; i < keys.size(); i++) {
-                if (ids[i] == "$") { // Not too sure why becauase I thought all blocking is to block till new entries. Currently if lets say we have 3 existing entries 1, 2, 3 and the stream id is 1, the last seen ids will take it as 3 so only checks for 4 and above
-                    // Use the current maximum ID if $ is specified
-                    auto it = stream_storage_->find(keys[i]);
-                    if (it != stream_storage_->end() && !it->second.empty()) {
-                        last_seen_ids[i] = std::get<0>(it->second.back());
-                    } else {
-                        last_seen_ids[i] = "0-0"; // Default minimal ID for empty streams
-                    }
-                } else {
-                    // Use the provided ID and update if necessary
-                    auto it = stream_storage_->find(keys[i]);
-                    if (it != stream_storage_->end() && !it->second.empty()) {
-                        last_seen_ids[i] = std::get<0>(it->second.back());
-                        if (xaadIdIsGreaterThan(ids[i], last_seen_ids[i])) { 
-                            last_seen_ids[i] = ids[i];
-                        }
-                    } else {
-                        last_seen_ids[i] = ids[i];
-                    }
-                }
-            }
-
-            // Start with an immediate async check
-            timer->async_wait([this, self, timer, keys, last_seen_ids, block_duration_ms, execute](const asio::error_code& ec) {
-                checkEntries(ec, timer, keys, last_seen_ids, block_duration_ms, execute);
-            });
+        size_t owner = scanCursorShard(args[1], core_->group->size());
+        if (owner == core_->index) {
+            return false;
         }
+        forwardToCore(owner, std::string(frame.raw));
+        return true;
     }
-    else if (split_data[2] == "MULTI") {
-        write_simple_string("OK", execute);
+    std::vector<std::string_view> keys = commandKeys(command, args);
+    if (keys.empty()) {
+        return false;
     }
-    else if (split_data[2] == "EXEC") {
-        if (past_transactions.size() >= 2) { // at least have two commands
-            if (exec_index - multi_index == 1) {
-                past_transactions.clear();
-                manual_write("*0\r\n", execute);
-            } else {
-                for (int i = multi_index + 1; i < exec_index; ++i) {
-                    std::cout << "command sent to executed: " << past_transactions[i] << i << exec_index << std::endl;
-                    std::cout << past_transactions[0] << std::endl;
-                    std::cout << past_transactions[1] << std::endl;
-                    std::cout << past_transactions[2] << std::endl;
-                    processCommand(past_transactions[i], true);
-                }
-                std::string response = "*" + std::to_string(exec_responses.size()) + "\r\n";
-                for (const auto& resp : exec_responses) {
-                    response += resp;
-                }
-                exec_responses.clear();
-                past_transactions.clear(); 
-                manual_write(response, false);
-            }
-        } else {
-            manual_write("-ERR EXEC without MULTI\r\n", execute);
+    size_t owner = core_->group->ownerOf(keys[0]);
+    for (const auto& key : keys) {
+        if (core_->group->ownerOf(key) != owner) {
+            manual_write("-CROSSSLOT Keys in request don't belong to the same core\r\n");
+            return true;
         }
     }
-    else if (split_data[2] == "DISCARD") {
-        if (multi_index == -1) {
-            manual_write("-ERR DISCARD without MULTI\r\n");
-        } else {
-            past_transactions.clear();
-            write_simple_string("OK", execute);
-        }
+    if (owner == core_->index) {
+        return false;
     }
-    else {
-        if (!is_replica_) {
-            messages.push_back("PONG");
-            write(messages, include_size);  
+    bool blocking = false;
+    if (command.flags & CMD_BLOCKING) {
+        for (const auto& arg : args) {
+            blocking = blocking || equalsIgnoreCase(arg, "BLOCK");
         }
     }
-    // Adds commands received so far
-    commandFromMasterSizes += data.size();
-}
-
-// TODO: Wrap stuff with this function
-std::string Session::format_resp_array(std::vector<std::string> messages, bool formatContent) {
-    std::stringstream msg_stream;
-    msg_stream << "*" << messages.size() << "\r\n";
-    if (formatContent) {
-        for (std::string message: messages) {
-            msg_stream << "$" << message.size() << "\r\n" << message << "\r\n";
-        }
+    // Watched keys are flagged by writers on their own core, only this core's writes can reach this client
+    if (queuing || blocking || equalsIgnoreCase(args[0], "WATCH")) {
+        manual_write("-CROSSSLOT Keys in request don't belong to this connection's core\r\n");
+        return true;
     }
-
-    return msg_stream.str();
+    forwardToCore(owner, std::string(frame.raw));
+    return true;
 }
 
-// Write without any parsing
-void Session::manual_write(std::string message, bool execute) {
+void Session::forwardToCore(size_t owner, std::string command) {
+    paused_ = true;
     auto self(shared_from_this());
-    std::cout << "MESSAGE SENT (manual)..: " << message << std::endl;
-    if (execute) {
-        exec_responses.push_back(message);
-    } else {
-        asio::async_write(socket_, asio::buffer(message, message.size()),
-            [this, self](asio::error_code ec, std::size_t /*length*/) {
-                if (!ec) {
-                    read();  // Continue reading after successful write
-                } else {
-                    std::cerr << "Write error: " << ec.message() << std::endl;
-                }
-            });
-    }
+    Core* origin = core_;
+    Core* target = &core_->group->core(owner);
+    bool from_master = is_replica_;
+    target->post([self, origin, target, command = std::move(command), from_master]() {
+        std::string reply = target->executor->executeCaptured(command, from_master);
+        // With appendfsync always the reply still waits for the AOF, on the client's connection
+        size_t aof_offset = std::exchange(target->executor->aof_wait_offset_, 0);
+        origin->post([self, reply = std::move(reply), aof_offset]() {
+            self->aof_wait_offset_ = std::max(self->aof_wait_offset_, aof_offset);
+            self->onRemoteReply(reply);
+        });
+    });
 }
 
-void Session::write_simple_string(std::string message, bool execute) {
+// Runs a whole-keyspace read on every core and merges the arrays they return
+void Session::fanOutToCores(std::string command) {
+    struct Gather {
+        std::vector<std::string> replies;
+        size_t remaining;
+    };
+    paused_ = true;
     auto self(shared_from_this());
-    std::string formatted_message = "+" + message + "\r\n";
-    std::cout << "MESSAGE SENT (simple string)..: " << formatted_message << std::endl;
-    if (execute) {
-        exec_responses.push_back(formatted_message);
-    } else {
-        asio::async_write(socket_, asio::buffer(formatted_message, formatted_message.size()),
-            [this, self](asio::error_code ec, std::size_t /*length*/) {
-                if (!ec) {
-                    read();  // Continue reading after successful write
-                } else {
-                    std::cerr << "Write error: " << ec.message() << std::endl;
+    Core* origin = core_;
+    auto gather = std::make_shared<Gather>();
+    gather->replies.resize(core_->group->size());
+    gather->remaining = core_->group->size();
+    for (size_t i = 0; i < core_->group->size(); ++i) {
+        Core* target = &core_->group->core(i);
+        target->post([self, origin, target, command, gather, i]() {
+            std::string reply = target->executor->executeCaptured(command);
+            origin->post([self, gather, i, reply = std::move(reply)]() {
+                // Only touched on the origin core, no synchronisation needed
+                gather->replies[i] = std::move(reply);
+                if (--gather->remaining > 0) {
+                    return;
+                }
+                size_t total = 0;
+                std::string body;
+                for (const auto& part : gather->replies) {
+                    size_t header_end = part.find("\r\n");
+                    if (part.empty() || part[0] != '*' || header_end == std::string::npos) {
+                        continue;
+                    }
+                    total += std::stoull(part.substr(1, header_end - 1));
+                    body.append(part, header_end + 2);
                 }
+                self->onRemoteReply("*" + std::to_string(total) + "\r\n" + body);
             });
-
+        });
     }
 }
 
-void Session::write_integer(std::string message, bool execute) {
-    auto self(shared_from_this());
-    std::string formatted_message = ":" + message + "\r\n";
-    std::cout << "MESSAGE SENT (integer)..: " << formatted_message << std::endl;
-    if (execute) {
-        exec_responses.push_back(formatted_message);
-    } else {
-        asio::async_write(socket_, asio::buffer(formatted_message, formatted_message.size()),
-            [this, self](asio::error_code ec, std::size_t /*length*/) {
-                if (!ec) {
-                    read();  // Continue reading after successful write
-                } else {
-                    std::cerr << "Write error: " << ec.message() << std::endl;
-                }
-            });
+void Session::onRemoteReply(const std::string& reply) {
+    paused_ = false;
+    if (!is_replica_) {
+        queue_write(reply);
     }
+    processReadBuffer(); // carry on with the rest of the pipeline
 }
 
-void Session::write_bulk_string(std::string message, bool execute) {
-    auto self(shared_from_this());
-    std::string formatted_message = "$" + std::to_string(message.size()) + "\r\n" + message + "\r\n";
-    std::cout << "MESSAGE SENT (bulk string)..: " << formatted_message << std::endl;
-    if (execute) {
-        exec_responses.push_back(formatted_message);
-    } else {
-        asio::async_write(socket_, asio::buffer(formatted_message, formatted_message.size()),
-            [this, self](asio::error_code ec, std::size_t /*length*/) {
-                if (!ec) {
-                    read();  // Continue reading after successful write
-                } else {
-                    std::cerr << "Write error: " << ec.message() << std::endl;
-                }
-            });
+// "ip:port" of the client, empty if the socket is not connected (ie: replaying the AOF)
+std::string Session::clientAddress() const {
+    asio::error_code ec;
+    auto endpoint = socket_.remote_endpoint(ec);
+    if (ec) {
+        return "";
     }
+    return endpoint.address().to_string() + ":" + std::to_string(endpoint.port());
 }
 
-// Write with formatting, adding size of all messages and size of individual message
-void Session::write(std::vector<std::string> messages, bool size, bool execute) {
-    // Similar to read function, creates a shared pointer
-    auto self(shared_from_this());
-    std::stringstream msg_stream;
+std::string Session::executeCaptured(std::string_view command, bool from_master) {
+    RespParser parser;
+    RespFrame frame;
+    if (parser.parse(command, frame) != RespParser::Status::Complete) {
+        return "-ERR Protocol error\r\n";
+    }
+    from_master_ = from_master;
+    processCommand(frame, true);
+    from_master_ = false;
+    std::string reply = std::move(captured_replies_);
+    captured_replies_.clear();
+    captured_count_ = 0;
+    return reply;
+}
 
-    if (messages.size() == 0) {
-        msg_stream << "$-1\r\n";
-    } else {
-        int num_messages = messages.size();
-        if (messages.size() > 1 || size) {
-            msg_stream << "*" << num_messages << "\r\n";
-        }
-        for (std::string message: messages) {
-            msg_stream << "$" << message.size() << "\r\n" << message << "\r\n";
+size_t Session::replayAppendOnly(std::string_view data) {
+    loading_ = true;
+    RespParser parser;
+    RespFrame frame;
+    size_t consumed = 0;
+    size_t multi_offset = 0; // where the transaction being replayed starts
+    while (consumed < data.size() && parser.parse(data.substr(consumed), frame) == RespParser::Status::Complete) {
+        if (!frame.args.empty() && equalsIgnoreCase(frame.args[0], "MULTI")) {
+            multi_offset = consumed;
         }
+        consumed += frame.raw.size();
+        processCommand(frame, true);
+        captured_replies_.clear();
+        captured_count_ = 0;
     }
-    std::string msg = msg_stream.str();
-    std::cout << "MESSAGE SENT..: " << msg << std::endl;
-    if (execute) {
-        exec_responses.push_back(msg);
-    } else {
-        asio::async_write(socket_, asio::buffer(msg, msg.size()),
-            [this, self](asio::error_code ec, std::size_t /*length*/) {
-                if (!ec) {
-                    read();  // Continue reading after successful write
-                } else {
-                    std::cerr << "Write error: " << ec.message() << std::endl;
+    loading_ = false;
+    if (in_multi_) {
+        // The file ends inside a transaction whose EXEC never made it, it is dropped with the incomplete command
+        clearTransaction();
+        return multi_offset;
+    }
+    return consumed;
+}
+
+void Session::pingCommand(const RespFrame& frame, bool execute) {
+    write({"PONG"}, false, execute);
+}
+
+void Session::echoCommand(const RespFrame& frame, bool execute) {
+    // Echos back message
+    write({std::string(frame.args[1])}, false, execute);
+}
+
+void Session::setCommand(const RespFrame& frame, bool execute) {
+    const auto& args = frame.args;
+    // Saves data from user
+    std::string key(args[1]);
+    TimePoint expiry_time = TimePoint::max();
+    if (args.size() >= 5 && equalsIgnoreCase(args[3], "px")) {
+        int expiry_ms; // milliseconds
+        if (!parseIntegerArgument(args[4], expiry_ms)) {
+            manual_write("-ERR value is not an integer or out of range\r\n", execute);
+            return;
+        }
+        if (expiry_ms <= 0) {
+            manual_write("-ERR invalid expire time in 'set' command\r\n", execute);
+            return;
+        }
+        expiry_time = std::chrono::system_clock::now() + std::chrono::milliseconds(expiry_ms);
+    }
+    keyspace_->shardFor(key).setString(key, StringValue(args[2]), expiry_time);
+    ++dirty_;
+    write({"OK"}, false, execute);
+}
+
+void Session::getCommand(const RespFrame& frame, bool execute) {
+    // Get data from storage
+    std::string key(frame.args[1]);
+    std::vector<std::string> messages;
+    Shard& shard = keyspace_->shardFor(key);
+
+    auto it = shard.findString(key);
+    if (it != shard.strings.end()) {
+        messages.push_back(it -> second.str());
+    }   
+    write(messages, false, execute);
+}
+
+// INCR, DECR, INCRBY and DECRBY. Counters are stored integer encoded, so this is plain arithmetic
+void Session::incrCommand(const RespFrame& frame, bool execute) {
+    const auto& args = frame.args;
+    std::string key(args[1]);
+    int64_t delta = 1;
+    if (args.size() == 3) {
+        auto amount = parseCanonicalInteger(args[2]);
+        if (!amount) {
+            manual_write("-ERR value is not an integer or out of range\r\n", execute);
+            return;
+        }
+        delta = *amount;
+    }
+    bool decrement = equalsIgnoreCase(args[0], "DECR") || equalsIgnoreCase(args[0], "DECRBY");
+    Shard& shard = keyspace_->shardFor(key);
+
+    auto it = shard.findString(key);
+    int64_t current = 0;
+    if (it != shard.strings.end()) {
+        auto stored_value = it -> second.toInteger();
+        if (!stored_value) {
+            manual_write("-ERR value is not an integer or out of range\r\n", execute);
+            return;
+        }
+        current = *stored_value;
+    }
+
+    int64_t result;
+    bool overflow = decrement ? __builtin_sub_overflow(current, delta, &result)
+                              : __builtin_add_overflow(current, delta, &result);
+    if (overflow) {
+        manual_write("-ERR increment or decrement would overflow\r\n", execute);
+        return;
+    }
+    if (it == shard.strings.end()) {
+        shard.setString(key, StringValue(result));
+    } else {
+        shard.setInteger(it, result); // keeps its expiry
+    }
+    ++dirty_;
+    write_integer(std::to_string(result), execute);
+}
+
+void Session::configCommand(const RespFrame& frame, bool execute) {
+    const auto& args = frame.args;
+    std::vector<std::string> messages;
+    // Get config details
+    if (equalsIgnoreCase(args[1], "GET") && args.size() >= 3) {
+        std::string param_name(args[2]);
+        std::string param_value = dir_;
+        messages.push_back(param_name);
+        messages.push_back(param_value);
+    }
+    write(messages, false, execute); 
+}
+
+void Session::keysCommand(const RespFrame& frame, bool execute) {
+    std::string_view pattern = frame.args[1];
+    bool match_all = pattern == "*";
+    auto now = std::chrono::system_clock::now();
+    std::vector<std::string> messages;
+    // In shared-nothing mode every core only lists its own shard, see fanOutToCores
+    size_t first = core_ != nullptr ? core_->index : 0;
+    size_t last = core_ != nullptr ? core_->index + 1 : keyspace_->shardCount();
+    for (size_t i = first; i < last; ++i) {
+        Shard& shard = keyspace_->shard(i);
+        if (globIsLiteral(pattern)) {
+            // Without wildcards the pattern names one key, a lookup replaces the walk over every key
+            std::string key(pattern);
+            auto it = shard.strings.find(key);
+            if ((it != shard.strings.end() && !isExpired(shard, *it, now)) || shard.streams.count(key)) {
+                messages.push_back(std::move(key));
+            }
+            continue;
+        }
+        for (const auto& entry : shard.strings) {
+            if (!isExpired(shard, entry, now) && (match_all || globMatch(pattern, entry.first))) {
+                messages.push_back(entry.first);
+            }
+        }
+        for (const auto& [key, stream] : shard.streams) {
+            if (match_all || globMatch(pattern, key)) {
+                messages.push_back(key);
+            }
+        }
+    }
+    if (messages.empty()) {
+        manual_write("*0\r\n", execute);
+        return;
+    }
+    write(messages, true, execute);
+}
+
+// SCAN cursor [MATCH pattern] [COUNT count] [TYPE type]. One call walks a single shard: the cursor is the
+// position in that shard's table times the shard count, plus the shard (see scanCursorShard). Stream keys,
+// few per shard, all come with the first call on their shard.
+void Session::scanCommand(const RespFrame& frame, bool execute) {
+    const auto& args = frame.args;
+    uint64_t cursor = 0;
+    if (std::from_chars(args[1].data(), args[1].data() + args[1].size(), cursor).ptr != args[1].data() + args[1].size()) {
+        manual_write("-ERR invalid cursor\r\n", execute);
+        return;
+    }
+    std::optional<std::string_view> pattern;
+    size_t count = 10;
+    std::optional<std::string_view> type;
+    for (size_t i = 2; i < args.size(); i += 2) {
+        if (i + 1 >= args.size()) {
+            manual_write("-ERR syntax error\r\n", execute);
+            return;
+        }
+        if (equalsIgnoreCase(args[i], "MATCH")) {
+            pattern = args[i + 1];
+        } else if (equalsIgnoreCase(args[i], "COUNT")) {
+            if (std::from_chars(args[i + 1].data(), args[i + 1].data() + args[i + 1].size(), count).ptr !=
+                    args[i + 1].data() + args[i + 1].size() || count == 0) {
+                manual_write("-ERR value is not an integer or out of range\r\n", execute);
+                return;
+            }
+        } else if (equalsIgnoreCase(args[i], "TYPE")) {
+            type = args[i + 1];
+        } else {
+            manual_write("-ERR syntax error\r\n", execute);
+            return;
+        }
+    }
+    if (pattern && *pattern == "*") {
+        pattern.reset();
+    }
+
+    size_t shards = keyspace_->shardCount();
+    size_t index = scanCursorShard(args[1], shards);
+    uint64_t position = cursor / shards;
+    ShardLock lock;
+    if (keyspace_->lockingEnabled() && !execute) {
+        lock = keyspace_->lockShard(index);
+    }
+    Shard& shard = keyspace_->shard(index);
+    auto now = std::chrono::system_clock::now();
+    bool strings = !type || equalsIgnoreCase(*type, "string");
+    bool streams = !type || equalsIgnoreCase(*type, "stream");
+    std::vector<std::string> keys;
+    if (position == 0 && streams) {
+        for (const auto& [key, stream] : shard.streams) {
+            if (!pattern || globMatch(*pattern, key)) {
+                keys.push_back(key);
+            }
+        }
+    }
+    // COUNT is how many keys to look at, not to return. Sparse groups are bounded too, so one call never runs long.
+    size_t visited = 0;
+    size_t steps = 0;
+    if (strings) {
+        do {
+            position = shard.strings.scan(position, [&](const StringStorageType::value_type& entry) {
+                ++visited;
+                if (!isExpired(shard, entry, now) && (!pattern || globMatch(*pattern, entry.first))) {
+                    keys.push_back(entry.first);
                 }
             });
+        } while (position != 0 && visited < count && ++steps < count * 10);
+    } else {
+        position = 0;
+    }
+    uint64_t next = 0;
+    if (position != 0) {
+        next = position * shards + index;
+    } else if (index + 1 < shards) {
+        next = index + 1;
+    }
+
+    std::string reply = "*2\r\n";
+    std::string next_text = std::to_string(next);
+    reply += "$" + std::to_string(next_text.size()) + "\r\n" + next_text + "\r\n";
+    reply += "*" + std::to_string(keys.size()) + "\r\n";
+    for (const auto& key : keys) {
+        reply += "$" + std::to_string(key.size()) + "\r\n" + key + "\r\n";
+    }
+    manual_write(reply, execute);
+}
+
+void Session::infoCommand(const RespFrame& frame, bool execute) {
+    std::vector<std::string> messages;
+    if (frame.args.size() >= 2 && equalsIgnoreCase(frame.args[1], "persistence")) {
+        messages.push_back((g_saver ? g_saver->info() : "# Persistence\r\n") + (g_aof ? g_aof->info() : "aof_enabled:0\r\n"));
+    } else if (frame.args.size() >= 2 && equalsIgnoreCase(frame.args[1], "commandstats")) {
+        messages.push_back(g_command_stats.commandStatsInfo());
+    } else if (frame.args.size() >= 2 && equalsIgnoreCase(frame.args[1], "latencystats")) {
+        messages.push_back(g_command_stats.latencyStatsInfo());
+    } else if (frame.args.size() >= 2 && equalsIgnoreCase(frame.args[1], "memory")) {
+        messages.push_back("# Memory\r\n"
+                           "used_memory:" + std::to_string(keyspace_->usedMemory()) + "\r\n"
+                           "maxmemory:" + std::to_string(keyspace_->maxMemory()) + "\r\n"
+                           "maxmemory_policy:" + std::string(evictionPolicyName(keyspace_->evictionPolicy())) + "\r\n"
+                           "evicted_keys:" + std::to_string(keyspace_->evictedKeys()) + "\r\n");
+    } else if (masterdetails_ == "") {
+        // Master
+        std::string role = "role:master";
+        std::string master_repl_offset = "nmaster_repl_offset:0";
+        std::string nmaster_replid = "nmaster_replid:";
+        {
+            std::lock_guard<std::mutex> replicas_lock(g_replica_sessions_mutex);
+            nmaster_replid += g_repl_backlog.replid();
+        }
+        std::string message = role + "\r\n" + master_repl_offset + "\r\n" + nmaster_replid;
+        messages.push_back(message);
+    } else {
+        // Not Master
+        messages.push_back("role:slave");
+    }
+    write(messages, false, execute);
+}
+
+void Session::replconfCommand(const RespFrame& frame, bool execute) {
+    const auto& args = frame.args;
+    if (is_replica_ && args.size() >= 2 && equalsIgnoreCase(args[1], "GETACK")) {
+        std::string sizeStr = std::to_string(commandFromMasterSizes);
+        std::string ackMsg = "*3\r\n$8\r\nREPLCONF\r\n$3\r\nACK\r\n$" + 
+                 std::to_string(sizeStr.length()) + "\r\n" + 
+                 sizeStr + "\r\n";
+        manual_write(ackMsg, execute);
+    } else if (!is_replica_ && args.size() >= 3 && equalsIgnoreCase(args[1], "ACK")) {
+        size_t acknowledgedBytes;
+        if (!parseIntegerArgument(args[2], acknowledgedBytes)) {
+            manual_write("-ERR value is not an integer or out of range\r\n", execute);
+            return;
+        }
+        this->lastAcknowledgedBytes = acknowledgedBytes;
+        notifyWaiters();
+    } else {
+        // Second Part of handshake with replicas
+        write({"OK"}, false, execute);  
+    }
+}
+
+void Session::psyncCommand(const RespFrame& frame, bool execute) {
+    if (is_replica_) {
+        return;
+    }
+    const auto& args = frame.args;
+    std::string requested_id(args[1]);
+    size_t requested_offset = 0;
+    bool has_offset = std::from_chars(args[2].data(), args[2].data() + args[2].size(), requested_offset).ec == std::errc();
+
+    // Registering under the lock that orders propagation means no write is missed or sent twice: everything
+    // before the offset we hand out is in the snapshot or the backlog copy, everything after reaches this
+    // session through propagate(), which runs after this handler on the session's strand.
+    if (has_offset) {
+        std::lock_guard<std::mutex> replicas_lock(g_replica_sessions_mutex);
+        auto missing = requested_id == g_repl_backlog.replid() ? g_repl_backlog.copyFrom(requested_offset) : std::nullopt;
+        if (missing) {
+            // Partial resync, the replica already has everything up to requested_offset
+            g_replica_sessions.push_back(shared_from_this());
+            lastAcknowledgedBytes = requested_offset;
+            manual_write("+CONTINUE " + g_repl_backlog.replid() + "\r\n" + *missing, execute);
+            LOG_NOTICE("Partial resync of replica, sending " << missing->size() << " backlog bytes");
+            return;
+        }
+    }
+
+    // Third Part of handshake with replicas, the snapshot is sent once a forked child has written it
+    beginFullSync();
+}
+
+// Takes a point-in-time snapshot for a full resync. The replica is registered at the same instant, so every
+// write is either in the snapshot or propagated afterwards (buffered until the snapshot has been sent).
+void Session::beginFullSync() {
+    sync_pending_ = true;
+    static std::atomic<unsigned> sync_counter = 0;
+    snapshot_path_ = (dir_.empty() ? std::string(".") : dir_) + "/temp-repl-" + std::to_string(getpid()) + "-" +
+                       std::to_string(sync_counter++) + ".rdb";
+    auto self(shared_from_this());
+    auto snapshot = [this, self, path = snapshot_path_]() {
+        std::lock_guard<std::mutex> replicas_lock(g_replica_sessions_mutex);
+        g_repl_backlog.create(); // the first replica starts recording the replication stream
+        size_t offset = g_repl_backlog.endOffset();
+        pid_t child = forkRdbSnapshot(*keyspace_, path);
+        g_replica_sessions.push_back(self);
+        lastAcknowledgedBytes = offset;
+        return std::make_tuple(child, g_repl_backlog.replid(), offset);
+    };
+    if (core_ == nullptr) {
+        // Holding every shard lock keeps other threads from changing the keyspace while we fork
+        ShardLock lock = keyspace_->lockAll();
+        auto [child, replid, offset] = snapshot();
+        startFullSync(child, replid, offset);
+        return;
+    }
+    // Shared-nothing mode: every core owns its shard, so all of them are parked while we fork
+    Core* origin = core_;
+    bool started = core_->group->runPaused([self, origin, snapshot]() {
+        auto [child, replid, offset] = snapshot();
+        origin->post([self, child, replid, offset]() { self->startFullSync(child, replid, offset); });
+    });
+    if (!started) {
+        auto timer = std::make_shared<asio::steady_timer>(socket_.get_executor(), std::chrono::milliseconds(10));
+        timer->async_wait([this, self, timer](const asio::error_code& ec) {
+            if (!ec) {
+                beginFullSync();
+            }
+        });
+    }
+}
+
+void Session::startFullSync(pid_t child, const std::string& replid, size_t offset) {
+    if (child < 0) {
+        LOG_WARNING("Could not fork the snapshot for a full resync");
+        abortFullSync();
+        return;
+    }
+    manual_write("+FULLRESYNC " + replid + " " + std::to_string(offset) + "\r\n");
+    waitForSnapshot(child);
+}
+
+// Polls the child writing the snapshot, without blocking the event loop
+void Session::waitForSnapshot(pid_t child) {
+    int status = 0;
+    pid_t done = waitpid(child, &status, WNOHANG);
+    if (done == 0) {
+        auto self(shared_from_this());
+        auto timer = std::make_shared<asio::steady_timer>(socket_.get_executor(), std::chrono::milliseconds(10));
+        timer->async_wait([this, self, timer, child](const asio::error_code& ec) {
+            if (!ec) {
+                waitForSnapshot(child);
+            }
+        });
+        return;
+    }
+    auto file = std::make_shared<std::ifstream>(snapshot_path_, std::ios::binary | std::ios::ate);
+    if (done < 0 || !WIFEXITED(status) || WEXITSTATUS(status) != 0 || !file->is_open()) {
+        LOG_WARNING("Writing the snapshot for a full resync failed");
+        abortFullSync();
+        return;
+    }
+    size_t size = file->tellg();
+    file->seekg(0);
+    LOG_NOTICE("Sending snapshot of " << size << " bytes to replica");
+    queue_write("$" + std::to_string(size) + "\r\n");
+    sendSnapshotChunk(file);
+}
+
+// Streams the snapshot file in chunks, the next one is read once the previous one has been written
+void Session::sendSnapshotChunk(std::shared_ptr<std::ifstream> file) {
+    std::string chunk(64 * 1024, '\0');
+    file->read(chunk.data(), chunk.size());
+    chunk.resize(file->gcount());
+    if (chunk.empty()) {
+        file.reset();
+        std::remove(snapshot_path_.c_str());
+        sync_pending_ = false;
+        queue_write(pending_replication_);
+        pending_replication_.clear();
+        pending_replication_.shrink_to_fit();
+        return;
+    }
+    auto self(shared_from_this());
+    on_flushed_ = [this, self, file]() { sendSnapshotChunk(file); };
+    queue_write(chunk);
+}
+
+// The replica reconnects and asks for another full resync
+void Session::abortFullSync() {
+    std::remove(snapshot_path_.c_str());
+    on_flushed_ = nullptr;
+    sync_pending_ = false;
+    pending_replication_.clear();
+    dropReplica();
+    asio::error_code ec;
+    socket_.close(ec);
+}
+
+// Replaces the whole dataset with the snapshot our master sent on a full resync
+void Session::loadSnapshot(std::string_view payload) {
+    std::vector<LoadedKeys> batches(keyspace_->shardCount());
+    // Same filters as loadDatabase, only db 0 is served and keys that expired in transit are dropped
+    TimePoint now = std::chrono::system_clock::now();
+    uint64_t db = 0;
+    RdbHandler handler;
+    handler.on_select_db = [&db](uint64_t index) { db = index; };
+    handler.on_resize = [&db, &batches](uint64_t keys, uint64_t) {
+        if (db != 0) {
+            return;
+        }
+        for (auto& batch : batches) {
+            batch.strings.reserve(keys / batches.size() + 1);
+        }
+    };
+    handler.on_string = [this, &db, now, &batches](std::string key, StringValue value, TimePoint expiry) {
+        if (db != 0 || expiry < now) {
+            return;
+        }
+        LoadedKeys& batch = batches[keyspace_->shardIndex(key)];
+        batch.expires += expiry != TimePoint::max();
+        batch.strings.emplace_back(std::move(key), std::move(value), expiry);
+    };
+    handler.on_stream = [this, &db, &batches](std::string key, Stream stream) {
+        if (db != 0) {
+            return;
+        }
+        batches[keyspace_->shardIndex(key)].streams.emplace_back(std::move(key), std::move(stream));
+    };
+    std::string error;
+    if (!loadRdb(payload, handler, error)) {
+        LOG_WARNING("Could not load the snapshot from master: " << error);
+        return;
+    }
+    // Replicas of ours must not continue from a backlog that led up to the dataset being replaced
+    {
+        std::lock_guard<std::mutex> replicas_lock(g_replica_sessions_mutex);
+        g_repl_backlog.newHistory();
+    }
+
+    // The AOF describes the dataset just replaced, it is rewritten from the new one
+    if (core_ == nullptr) {
+        ShardLock lock = keyspace_->lockAll();
+        for (size_t i = 0; i < batches.size(); ++i) {
+            keyspace_->shard(i).clear();
+            batches[i].insertInto(keyspace_->shard(i));
+        }
+        if (g_aof) {
+            g_aof->startRewrite(true);
+        }
+        return;
+    }
+    // Other cores load their part from their inbox, ahead of any command we forward to them later
+    for (size_t i = 0; i < batches.size(); ++i) {
+        Shard* shard = &keyspace_->shard(i);
+        if (i == core_->index) {
+            shard->clear();
+            batches[i].insertInto(*shard);
+            continue;
+        }
+        auto batch = std::make_shared<LoadedKeys>(std::move(batches[i]));
+        core_->group->core(i).post([shard, batch]() {
+            shard->clear();
+            batch->insertInto(*shard);
+        });
+    }
+    // Parking the cores queues behind the batches, so the fork sees every core's part loaded
+    if (g_aof && !core_->group->runPaused([]() { g_aof->startRewrite(true); })) {
+        LOG_WARNING("Could not rewrite the AOF after loading the snapshot, run BGREWRITEAOF");
+    }
+}
+
+// Forgets this session as a replica of ours once its connection is gone
+void Session::dropReplica() {
+    std::lock_guard<std::mutex> replicas_lock(g_replica_sessions_mutex);
+    std::erase_if(g_replica_sessions, [this](const std::shared_ptr<Session>& replica_session) {
+        return replica_session.get() == this;
+    });
+}
+
+void Session::waitCommand(const RespFrame& frame, bool execute) {
+    const auto& args = frame.args;
+    int numReplicas;
+    int timeoutMs;
+    if (!parseIntegerArgument(args[1], numReplicas) || !parseIntegerArgument(args[2], timeoutMs)) {
+        manual_write("-ERR value is not an integer or out of range\r\n", execute);
+        return;
+    }
+    if (timeoutMs < 0) {
+        manual_write("-ERR timeout is negative\r\n", execute);
+        return;
+    }
+
+    size_t offset;
+    {
+        std::lock_guard<std::mutex> replicas_lock(g_replica_sessions_mutex);
+        offset = g_repl_backlog.endOffset();
+    }
+    int replicasAcknowledged = countAcknowledged(offset);
+    if (replicasAcknowledged >= numReplicas || execute) {
+        manual_write(":" + std::to_string(replicasAcknowledged) + "\r\n", execute);
+        return;
+    }
+
+    // Ask every replica where it is, each ACK wakes us through notifyWaiters
+    std::string commandToGetACK = "*3\r\n$8\r\nREPLCONF\r\n$6\r\nGETACK\r\n$1\r\n*\r\n";
+    {
+        std::lock_guard<std::mutex> replicas_lock(g_replica_sessions_mutex);
+        for (auto& replica_session : g_replica_sessions) {
+            if (replica_session) {
+                replica_session->propagate(commandToGetACK);
+            }
+        }
+        g_repl_backlog.append(commandToGetACK);
+        g_waiting_sessions.push_back(weak_from_this());
+    }
+    wait_offset_ = offset;
+    wait_replicas_ = numReplicas;
+    waiting_for_acks_ = true;
+    paused_ = true; // later commands of this client run once WAIT is answered
+
+    // A timeout of 0 waits until enough replicas acknowledged
+    if (timeoutMs > 0) {
+        if (!block_timer_) {
+            block_timer_ = std::make_unique<asio::steady_timer>(socket_.get_executor());
+        }
+        std::weak_ptr<Session> weak_self = weak_from_this();
+        block_timer_->expires_after(std::chrono::milliseconds(timeoutMs));
+        block_timer_->async_wait([weak_self, generation = ++block_generation_](const asio::error_code& ec) {
+            auto self = weak_self.lock();
+            if (!ec && self && self->block_generation_ == generation) {
+                self->checkWait(true);
+            }
+        });
+    }
+}
+
+int Session::countAcknowledged(size_t offset) {
+    int replicasAcknowledged = 0;
+    std::lock_guard<std::mutex> replicas_lock(g_replica_sessions_mutex);
+    for (auto& replica_session : g_replica_sessions) {
+        if (replica_session && replica_session->hasAcknowledged(offset)) {
+            replicasAcknowledged++;
+        }
+    }
+    return replicasAcknowledged;
+}
+
+// Called on a replica's session when it ACKs, lets every client blocked in WAIT re-count on its own strand
+void Session::notifyWaiters() {
+    std::lock_guard<std::mutex> replicas_lock(g_replica_sessions_mutex);
+    for (const auto& weak_waiter : g_waiting_sessions) {
+        if (auto waiter = weak_waiter.lock()) {
+            asio::post(waiter->socket_.get_executor(), [waiter]() { waiter->checkWait(false); });
+        }
+    }
+}
+
+void Session::checkWait(bool timed_out) {
+    if (!waiting_for_acks_) {
+        return; // already answered
+    }
+    int replicasAcknowledged = countAcknowledged(wait_offset_);
+    if (replicasAcknowledged < wait_replicas_ && !timed_out) {
+        return;
+    }
+    waiting_for_acks_ = false;
+    {
+        std::lock_guard<std::mutex> replicas_lock(g_replica_sessions_mutex);
+        std::erase_if(g_waiting_sessions, [this](const std::weak_ptr<Session>& weak_waiter) {
+            auto waiter = weak_waiter.lock();
+            return !waiter || waiter.get() == this;
+        });
+    }
+    if (block_timer_) {
+        block_timer_->cancel();
+    }
+    onRemoteReply(":" + std::to_string(replicasAcknowledged) + "\r\n");
+}
+
+void Session::typeCommand(const RespFrame& frame, bool execute) {
+    const auto& args = frame.args;
+    // Get type of data from storage
+    std::string key(args[1]);
+
+    Shard& shard = keyspace_->shardFor(key);
+    auto it_stream = shard.streams.find(key);
+    if (it_stream != shard.streams.end()) {
+        write_simple_string("stream", execute);
+    } else if (shard.findString(key) != shard.strings.end()) {
+        write_simple_string("string", execute); 
+    } else {
+        write_simple_string("none", execute);
+    }
+}
+
+// EXPIRE key seconds / PEXPIRE key milliseconds, and EXPIREAT / PEXPIREAT taking a unix time instead.
+// Only string keys carry an expiry.
+void Session::expireCommand(const RespFrame& frame, bool execute) {
+    const auto& args = frame.args;
+    std::string key(args[1]);
+    long long amount;
+    try {
+        amount = std::stoll(std::string(args[2]));
+    } catch (const std::exception&) {
+        manual_write("-ERR value is not an integer or out of range\r\n", execute);
+        return;
+    }
+    bool milliseconds = equalsIgnoreCase(args[0], "PEXPIRE") || equalsIgnoreCase(args[0], "PEXPIREAT");
+    bool absolute = equalsIgnoreCase(args[0], "EXPIREAT") || equalsIgnoreCase(args[0], "PEXPIREAT");
+    auto duration = milliseconds ? std::chrono::milliseconds(amount) : std::chrono::milliseconds(amount * 1000);
+    auto now = std::chrono::system_clock::now();
+    TimePoint deadline = absolute ? TimePoint(duration) : now + duration;
+    Shard& shard = keyspace_->shardFor(key);
+    auto it = shard.findString(key);
+    if (it == shard.strings.end()) {
+        write_integer("0", execute);
+        return;
+    }
+    if (deadline <= now) {
+        shard.eraseString(it); // a deadline in the past deletes the key right away
+    } else {
+        shard.setExpiry(it, deadline);
+    }
+    ++dirty_;
+    write_integer("1", execute);
+}
+
+// TTL key / PTTL key: -2 if the key does not exist, -1 if it has no expiry
+void Session::ttlCommand(const RespFrame& frame, bool execute) {
+    std::string key(frame.args[1]);
+    Shard& shard = keyspace_->shardFor(key);
+    auto it = shard.findString(key);
+    if (it == shard.strings.end()) {
+        write_integer(shard.streams.count(key) ? "-1" : "-2", execute);
+        return;
+    }
+    TimePoint expiry_time = shard.expiryOf(it);
+    if (expiry_time == TimePoint::max()) {
+        write_integer("-1", execute);
+        return;
+    }
+    auto remaining_ms = std::chrono::duration_cast<std::chrono::milliseconds>(
+        expiry_time - std::chrono::system_clock::now()).count();
+    if (equalsIgnoreCase(frame.args[0], "PTTL")) {
+        write_integer(std::to_string(remaining_ms), execute);
+    } else {
+        write_integer(std::to_string((remaining_ms + 500) / 1000), execute);
+    }
+}
+
+void Session::delCommand(const RespFrame& frame, bool execute) {
+    const auto& args = frame.args;
+    size_t deleted = 0;
+    for (size_t i = 1; i < args.size(); ++i) {
+        std::string key(args[i]);
+        deleted += keyspace_->shardFor(key).eraseKey(key);
+    }
+    dirty_ += deleted;
+    write_integer(std::to_string(deleted), execute);
+}
+
+void Session::persistCommand(const RespFrame& frame, bool execute) {
+    std::string key(frame.args[1]);
+    Shard& shard = keyspace_->shardFor(key);
+    auto it = shard.findString(key);
+    if (it == shard.strings.end() || !it -> second.hasExpiry()) {
+        write_integer("0", execute);
+        return;
+    }
+    shard.setExpiry(it, TimePoint::max());
+    ++dirty_;
+    write_integer("1", execute);
+}
+
+void Session::xaddCommand(const RespFrame& frame, bool execute) {
+    const auto& args = frame.args;
+    std::string key(args[1]);
+    std::string_view id_arg = args[2];
+    if ((args.size() - 3) % 2 != 0) {
+        manual_write("-ERR wrong number of arguments for 'xadd' command\r\n", execute);
+        return;
+    }
+
+    auto& streams = keyspace_->streams(key);
+    auto it_stream = streams.find(key);
+    StreamId last_id = it_stream != streams.end() ? it_stream->second.lastId() : StreamId::min();
+
+    StreamId id;
+    if (id_arg == "*") {
+        uint64_t now_ms = std::chrono::duration_cast<std::chrono::milliseconds>(
+            std::chrono::system_clock::now().time_since_epoch()).count();
+        // A clock that went backwards keeps using the last millisecond
+        id = now_ms > last_id.ms ? StreamId{now_ms, 0} : last_id.next();
+    } else if (id_arg.size() > 2 && id_arg.substr(id_arg.size() - 2) == "-*") {
+        auto ms_part = StreamId::parse(id_arg.substr(0, id_arg.size() - 2));
+        if (!ms_part) {
+            manual_write("-ERR Invalid stream ID specified as stream command argument\r\n", execute);
+            return;
+        }
+        // Next sequence in the same millisecond, 0-0 is not a valid ID so an empty stream starts at 0-1
+        if (ms_part->ms == last_id.ms && it_stream != streams.end()) {
+            id = last_id.next();
+        } else {
+            id = StreamId{ms_part->ms, ms_part->ms == 0 ? 1u : 0u};
+        }
+    } else {
+        auto parsed = StreamId::parse(id_arg);
+        if (!parsed) {
+            manual_write("-ERR Invalid stream ID specified as stream command argument\r\n", execute);
+            return;
+        }
+        id = *parsed;
+    }
+
+    if (id == StreamId::min()) {
+        manual_write("-ERR The ID specified in XADD must be greater than 0-0\r\n", execute);
+        return;
+    }
+    if (it_stream != streams.end() && id <= last_id) {
+        manual_write("-ERR The ID specified in XADD is equal or smaller than the target stream top item\r\n", execute);
+        return;
+    }
+
+    std::vector<std::string_view> fields(args.begin() + 3, args.end());
+    Shard& shard = keyspace_->shardFor(key);
+    shard.appendToStream(key, id, fields);
+    shard.wakeStreamWaiters(key);
+    ++dirty_;
+    std::string id_text = id.toString();
+    if (id_arg.ends_with('*')) {
+        // An ID left to us is logged and propagated as the one we picked, replicas and replaying must not pick another
+        rewritten_command_ = "*" + std::to_string(args.size()) + "\r\n";
+        for (size_t i = 0; i < args.size(); ++i) {
+            appendBulkString(rewritten_command_, i == 2 ? std::string_view(id_text) : args[i]);
+        }
+    }
+    write_bulk_string(id_text, execute);
+}
+
+void Session::xrangeCommand(const RespFrame& frame, bool execute) {
+    const auto& args = frame.args;
+    std::string key(args[1]);
+    // "-" and "+" are the smallest and largest IDs, an ID without sequence covers the whole millisecond
+    auto start_id = args[2] == "-" ? std::optional<StreamId>(StreamId::min()) : StreamId::parse(args[2], 0);
+    auto end_id = args[3] == "+" ? std::optional<StreamId>(StreamId::max())
+                                 : StreamId::parse(args[3], std::numeric_limits<uint64_t>::max());
+    if (!start_id || !end_id) {
+        manual_write("-ERR Invalid stream ID specified as stream command argument\r\n", execute);
+        return;
+    }
+
+    auto [entries_count, entries_data] = getStreamEntries(key, *start_id, *end_id);
+    manual_write("*" + std::to_string(entries_count) + "\r\n" + entries_data, execute);
+}
+
+void Session::xreadCommand(const RespFrame& frame, bool execute) {
+    const auto& args = frame.args;
+    // Find the "block" keyword
+    size_t block_index = 0;
+    int block_duration_ms = 0;
+    for (size_t i = 0; i + 1 < args.size(); i++) {
+        if (equalsIgnoreCase(args[i], "block")) {
+            block_index = i;
+            if (!parseIntegerArgument(args[i + 1], block_duration_ms)) {
+                manual_write("-ERR timeout is not an integer or out of range\r\n", execute);
+                return;
+            }
+            if (block_duration_ms < 0) {
+                manual_write("-ERR timeout is negative\r\n", execute);
+                return;
+            }
+            break;
+        }
+    }
+    // Find the "STREAMS" keyword
+    size_t streams_index = 0;
+    for (size_t i = 1; i < args.size(); i++) {
+        if (equalsIgnoreCase(args[i], "streams")) {
+            streams_index = i;
+            break;
+        }
+    }
+    
+    if (streams_index == 0) {
+        manual_write("-ERR Syntax error\r\n", execute);
+        return;
+    }
+    
+    // Extract the keys and IDs
+    std::vector<std::string> keys;
+    
+    // Calculate where keys and IDs begin (since we know its half keys half ids)
+    size_t total_items = args.size() - streams_index - 1;
+    size_t num_keys = total_items / 2;
+    
+    // Extract keys (first half after "STREAMS")
+    for (size_t i = 0; i < num_keys; i++) {
+        keys.push_back(std::string(args[streams_index + 1 + i]));
+    }
+    
+    // Extract IDs (second half after keys), "$" means only entries added from now on
+    std::vector<StreamId> ids;
+    for (size_t i = 0; i < num_keys; i++) {
+        std::string_view id_arg = args[streams_index + 1 + num_keys + i];
+        if (id_arg == "$") {
+            auto& streams = keyspace_->streams(keys[i]);
+            auto it = streams.find(keys[i]);
+            ids.push_back(it != streams.end() ? it->second.lastId() : StreamId::min());
+            continue;
+        }
+        auto id = StreamId::parse(id_arg);
+        if (!id) {
+            manual_write("-ERR Invalid stream ID specified as stream command argument\r\n", execute);
+            return;
+        }
+        ids.push_back(*id);
+    }
+    std::string result;
+    if (readStreams(keys, ids, result) || block_index == 0) {
+        // Respond immediately with existing entries
+        manual_write(result, execute);
+    } else if (execute) {
+        manual_write("$-1\r\n", execute); // a transaction never blocks
+    } else {
+        blockOnStreams(std::move(keys), std::move(ids), block_duration_ms);
+    }
+}
+
+// Builds the XREAD reply with the entries after the given ID of every stream, returns whether there were any
+bool Session::readStreams(const std::vector<std::string>& keys, const std::vector<StreamId>& after, std::string& result) {
+    bool has_new_entries = false;
+    result = "*" + std::to_string(keys.size()) + "\r\n";
+    for (size_t i = 0; i < keys.size(); i++) {
+        auto [entries_count, entries_data] = getStreamEntries(keys[i], after[i].next(), StreamId::max());
+        result += "*2\r\n$" + std::to_string(keys[i].size()) + "\r\n" + keys[i] + "\r\n*" +
+                  std::to_string(entries_count) + "\r\n" + entries_data;
+        has_new_entries = has_new_entries || entries_count > 0;
+    }
+    return has_new_entries;
+}
+
+// Parks the client until XADD on one of the keys wakes it or the timeout fires. Runs with the keys' shards
+// locked, so no entry can be added between the check in xreadCommand and the registration here.
+// The pipeline is paused meanwhile, later commands of this client run once the read is answered.
+void Session::blockOnStreams(std::vector<std::string> keys, std::vector<StreamId> after, int block_duration_ms) {
+    std::weak_ptr<Session> weak_self = weak_from_this();
+    auto executor = socket_.get_executor();
+    auto waiter = std::make_shared<StreamWaiter>([weak_self, executor]() {
+        asio::post(executor, [weak_self]() {
+            if (auto self = weak_self.lock()) {
+                self->serveBlockedRead(false);
+            }
+        });
+    });
+    for (const auto& key : keys) {
+        keyspace_->shardFor(key).addStreamWaiter(key, waiter);
+    }
+    blocked_read_ = BlockedRead{std::move(keys), std::move(after), std::move(waiter)};
+    paused_ = true;
+
+    if (block_duration_ms > 0) {
+        if (!block_timer_) {
+            block_timer_ = std::make_unique<asio::steady_timer>(executor);
+        }
+        block_timer_->expires_after(std::chrono::milliseconds(block_duration_ms));
+        // A timeout that was already queued when an earlier read got served must not end this one
+        block_timer_->async_wait([weak_self, generation = ++block_generation_](const asio::error_code& ec) {
+            auto self = weak_self.lock();
+            if (!ec && self && self->block_generation_ == generation) {
+                self->serveBlockedRead(true);
+            }
+        });
+    }
+}
+
+void Session::serveBlockedRead(bool timed_out) {
+    if (!blocked_read_) {
+        return; // woken again after it was already served
+    }
+    std::vector<std::string_view> key_views(blocked_read_->keys.begin(), blocked_read_->keys.end());
+    ShardLock lock = keyspace_->lockKeys(key_views);
+    std::string result;
+    if (!readStreams(blocked_read_->keys, blocked_read_->after, result)) {
+        if (!timed_out) {
+            return; // nothing newer than what the client asked for yet
+        }
+        result = "$-1\r\n";
+    }
+    cancelBlockedRead();
+    lock = ShardLock();
+    onRemoteReply(result);
+}
+
+// Unregisters a blocked XREAD, the caller holds the shard locks of its keys
+void Session::cancelBlockedRead() {
+    if (!blocked_read_) {
+        return;
+    }
+    for (const auto& key : blocked_read_->keys) {
+        keyspace_->shardFor(key).removeStreamWaiter(key, blocked_read_->waiter);
+    }
+    blocked_read_.reset();
+    if (block_timer_) {
+        block_timer_->cancel();
+    }
+}
+
+void Session::multiCommand(const RespFrame& frame, bool execute) {
+    if (in_multi_) {
+        manual_write("-ERR MULTI calls can not be nested\r\n", execute);
+        return;
+    }
+    in_multi_ = true;
+    write_simple_string("OK", execute);
+}
+
+// Runs the queued commands, already parsed, and answers with all their replies in one array
+void Session::execCommand(const RespFrame& frame, bool execute) {
+    if (!in_multi_) {
+        manual_write("-ERR EXEC without MULTI\r\n", execute);
+        return;
+    }
+    // EXEC holds every shard lock, no watched key can change between this check and the queued commands
+    bool watched_key_changed = watch_flag_ && watch_flag_->load(std::memory_order_relaxed);
+    unwatchAll();
+    if (multi_error_) {
+        clearTransaction();
+        manual_write("-EXECABORT Transaction discarded because of previous errors.\r\n", execute);
+        return;
+    }
+    if (watched_key_changed) {
+        clearTransaction();
+        manual_write("*-1\r\n", execute);
+        return;
+    }
+    in_multi_ = false;
+    exec_running_ = g_aof && !loading_;
+    RespFrame& queued = transaction_frame_; // reused, so its argument vector keeps its capacity
+    queued.type = '*';
+    for (const auto& command : transaction_queue_) {
+        queued.raw = std::string_view(transaction_data_).substr(command.raw_offset, command.raw_length);
+        queued.args.clear();
+        for (size_t i = command.first_arg; i < command.first_arg + command.arg_count; ++i) {
+            queued.args.push_back(std::string_view(transaction_data_).substr(transaction_args_[i].first,
+                                                                             transaction_args_[i].second));
+        }
+        executeCommand(*command.spec, queued, true);
+    }
+    if (exec_running_) {
+        exec_running_ = false;
+        if (!exec_aof_.empty()) {
+            exec_aof_.insert(0, "*1\r\n$5\r\nMULTI\r\n");
+            exec_aof_ += "*1\r\n$4\r\nEXEC\r\n";
+            appendToAof(exec_aof_);
+            exec_aof_.clear();
+        }
+    }
+    std::string response = "*" + std::to_string(captured_count_) + "\r\n";
+    response += captured_replies_;
+    captured_replies_.clear();
+    captured_count_ = 0;
+    clearTransaction();
+    manual_write(response, execute);
+}
+
+void Session::discardCommand(const RespFrame& frame, bool execute) {
+    if (!in_multi_) {
+        manual_write("-ERR DISCARD without MULTI\r\n", execute);
+    } else {
+        clearTransaction();
+        ShardLock lock = lockWatchedKeys();
+        unwatchAll();
+        write_simple_string("OK", execute);
+    }
+}
+
+// Registers the keys in their shards, which are locked by executeCommand like for any command on them
+void Session::watchCommand(const RespFrame& frame, bool execute) {
+    if (in_multi_) {
+        multi_error_ = true;
+        manual_write("-ERR WATCH inside MULTI is not allowed\r\n", execute);
+        return;
+    }
+    if (!watch_flag_) {
+        watch_flag_ = std::make_shared<WatchFlag>(false);
+    }
+    for (size_t i = 1; i < frame.args.size(); ++i) {
+        std::string key(frame.args[i]);
+        if (std::find(watched_keys_.begin(), watched_keys_.end(), key) != watched_keys_.end()) {
+            continue;
+        }
+        Shard& shard = keyspace_->shardFor(key);
+        shard.findString(key); // an expired key is removed now, removing it later would count as a change
+        shard.addWatcher(key, watch_flag_);
+        watched_keys_.push_back(std::move(key));
+    }
+    write_simple_string("OK", execute);
+}
+
+void Session::unwatchCommand(const RespFrame& frame, bool execute) {
+    ShardLock lock = lockWatchedKeys();
+    unwatchAll();
+    write_simple_string("OK", execute);
+}
+
+ShardLock Session::lockWatchedKeys() {
+    std::vector<std::string_view> keys(watched_keys_.begin(), watched_keys_.end());
+    return keyspace_->lockKeys(keys);
+}
+
+// Unregisters every watched key, the caller holds their shard locks. Once no shard refers to the flag
+// anymore it can be cleared for the next WATCH.
+void Session::unwatchAll() {
+    for (const auto& key : watched_keys_) {
+        keyspace_->shardFor(key).removeWatcher(key, watch_flag_);
+    }
+    watched_keys_.clear();
+    if (watch_flag_) {
+        watch_flag_->store(false, std::memory_order_relaxed);
+    }
+}
+
+void Session::saveCommand(const RespFrame& frame, bool execute) {
+    if (!g_saver) {
+        manual_write("-ERR saving is not configured\r\n", execute);
+    } else if (g_saver->backgroundSaveInProgress()) {
+        manual_write("-ERR Background save already in progress\r\n", execute);
+    } else if (core_ == nullptr) {
+        // Every shard is locked for this command, so the snapshot is consistent
+        manual_write(g_saver->save() ? "+OK\r\n" : "-ERR saving the DB failed\r\n", execute);
+    } else if (execute) {
+        manual_write("-ERR SAVE inside MULTI is not supported in shared-nothing mode\r\n", execute);
+    } else {
+        // Shared-nothing mode: other cores own their shards, park them all while the file is written
+        paused_ = true;
+        auto self(shared_from_this());
+        Core* origin = core_;
+        bool started = core_->group->runPaused([self, origin]() {
+            bool ok = g_saver->save();
+            origin->post([self, ok]() { self->onRemoteReply(ok ? "+OK\r\n" : "-ERR saving the DB failed\r\n"); });
+        });
+        if (!started) {
+            paused_ = false;
+            manual_write("-ERR another operation is pausing the server, try again\r\n");
+        }
+    }
+}
+
+void Session::bgsaveCommand(const RespFrame& frame, bool execute) {
+    bool started = false;
+    if (!g_saver) {
+        manual_write("-ERR saving is not configured\r\n", execute);
+        return;
+    } else if (core_ == nullptr) {
+        started = g_saver->startBackgroundSave(); // under every shard lock, the child sees a consistent keyspace
+    } else if (!execute) {
+        // The fork happens once every core is parked, failures are logged
+        started = !g_saver->backgroundSaveInProgress() && core_->group->runPaused([]() { g_saver->startBackgroundSave(); });
+    }
+    if (started) {
+        write_simple_string("Background saving started", execute);
+    } else if (g_saver->backgroundSaveInProgress()) {
+        manual_write("-ERR Background save already in progress\r\n", execute);
+    } else {
+        manual_write("-ERR Background save could not be started\r\n", execute);
+    }
+}
+
+void Session::lastsaveCommand(const RespFrame& frame, bool execute) {
+    write_integer(std::to_string(g_saver ? g_saver->lastSave() : 0), execute);
+}
+
+void Session::bgrewriteaofCommand(const RespFrame& frame, bool execute) {
+    bool started = false;
+    if (!g_aof) {
+        manual_write("-ERR appendonly is not enabled\r\n", execute);
+        return;
+    } else if (core_ == nullptr) {
+        started = g_aof->startRewrite(); // under every shard lock, the child sees a consistent keyspace
+    } else if (!execute) {
+        started = !g_aof->rewriteInProgress() && core_->group->runPaused([]() { g_aof->startRewrite(); });
+    }
+    if (started) {
+        write_simple_string("Background append only file rewriting started", execute);
+    } else if (g_aof->rewriteInProgress()) {
+        manual_write("-ERR Background append only file rewriting already in progress\r\n", execute);
+    } else {
+        manual_write("-ERR Background append only file rewriting could not be started\r\n", execute);
+    }
+}
+
+// SLOWLOG GET [count] | LEN | RESET
+void Session::slowlogCommand(const RespFrame& frame, bool execute) {
+    const auto& args = frame.args;
+    if (equalsIgnoreCase(args[1], "GET") && args.size() <= 3) {
+        long long count = 10;
+        if (args.size() == 3) {
+            auto [end, ec] = std::from_chars(args[2].data(), args[2].data() + args[2].size(), count);
+            if (ec != std::errc() || end != args[2].data() + args[2].size() || count < -1) {
+                manual_write("-ERR count should be greater than or equal to -1\r\n", execute);
+                return;
+            }
+        }
+        manual_write(g_slowlog.format(count), execute);
+    } else if (equalsIgnoreCase(args[1], "LEN") && args.size() == 2) {
+        write_integer(std::to_string(g_slowlog.length()), execute);
+    } else if (equalsIgnoreCase(args[1], "RESET") && args.size() == 2) {
+        g_slowlog.reset();
+        write_simple_string("OK", execute);
+    } else {
+        manual_write("-ERR unknown subcommand or wrong number of arguments for '" + std::string(args[1]) +
+                         "'. Try SLOWLOG GET, LEN or RESET.\r\n", execute);
+    }
+}
+
+// Kept for the handlers that format arrays through the session, the encoding lives in formatRespArray
+std::string Session::format_resp_array(const std::vector<std::string>& messages, bool formatContent) {
+    return formatRespArray(messages, formatContent);
+}
+
+// Appends a reply to the output buffer. Replies produced while a read batch is processed
+// are only flushed once the batch is done, anything else (timers, propagation) right away
+void Session::queue_write(std::string_view message) {
+    if (suppress_replies_) {
+        return;
+    }
+    output_buffer_ += message;
+    queued_bytes_ += message.size();
+    if (!in_batch_) {
+        flush();
+    }
+}
+
+// Writes everything buffered so far. While a write is in flight new replies keep accumulating
+// and go out together once it completes.
+void Session::flush() {
+    if (!aof_waiting_ && aof_wait_offset_ > 0) {
+        // Group commit: every reply queued so far waits until the AOF is on disk up to the last write they
+        // answer, one fsync releases the replies of every client that wrote in this iteration. Replies queued
+        // meanwhile wait for the next one, without holding back those already covered.
+        size_t offset = std::exchange(aof_wait_offset_, 0);
+        size_t queued = queued_bytes_;
+        auto self(shared_from_this());
+        aof_waiting_ = !g_aof->waitDurable(offset, socket_.get_executor(), [this, self, queued]() {
+            aof_waiting_ = false;
+            released_bytes_ = queued;
+            flush();
+        });
+        if (!aof_waiting_) {
+            released_bytes_ = queued;
+        }
+    } else if (!aof_waiting_) {
+        released_bytes_ = queued_bytes_;
+    }
+    size_t releasable = released_bytes_ - sent_bytes_; // from the front of output_buffer_
+    if (writing_ || releasable == 0) {
+        return;
+    }
+    writing_ = true;
+    sent_bytes_ += releasable;
+    if (releasable == output_buffer_.size()) {
+        writing_buffer_.swap(output_buffer_); // swap keeps both allocations around for reuse
+    } else {
+        writing_buffer_.assign(output_buffer_, 0, releasable);
+        output_buffer_.erase(0, releasable);
+    }
+    auto self(shared_from_this());
+    asio::async_write(socket_, asio::buffer(writing_buffer_),
+        [this, self](asio::error_code ec, std::size_t /*length*/) {
+            writing_ = false;
+            writing_buffer_.clear();
+            if (!ec) {
+                if (output_buffer_.empty() && on_flushed_) {
+                    auto next = std::move(on_flushed_);
+                    on_flushed_ = nullptr;
+                    next();
+                }
+                flush();
+            } else {
+                LOG_VERBOSE("Write error: " << ec.message());
+            }
+        });
+}
+
+// Replies of commands run by EXEC or for another core are collected instead of sent
+void Session::captureReply(std::string_view reply) {
+    if (suppress_replies_) {
+        return;
+    }
+    captured_replies_ += reply;
+    ++captured_count_;
+}
+
+// Write without any parsing
+void Session::manual_write(std::string message, bool execute) {
+    LOG_DEBUG("Reply (manual): " << LogPayload{message});
+    if (execute) {
+        captureReply(message);
+    } else {
+        queue_write(message);
+    }
+}
+
+void Session::write_simple_string(std::string message, bool execute) {
+    std::string formatted_message = "+" + message + "\r\n";
+    LOG_DEBUG("Reply (simple string): " << LogPayload{formatted_message});
+    if (execute) {
+        captureReply(formatted_message);
+    } else {
+        queue_write(formatted_message);
+    }
+}
+
+void Session::write_integer(std::string message, bool execute) {
+    std::string formatted_message = ":" + message + "\r\n";
+    LOG_DEBUG("Reply (integer): " << LogPayload{formatted_message});
+    if (execute) {
+        captureReply(formatted_message);
+    } else {
+        queue_write(formatted_message);
+    }
+}
+
+void Session::write_bulk_string(std::string message, bool execute) {
+    std::string formatted_message = "$" + std::to_string(message.size()) + "\r\n" + message + "\r\n";
+    LOG_DEBUG("Reply (bulk string): " << LogPayload{formatted_message});
+    if (execute) {
+        captureReply(formatted_message);
+    } else {
+        queue_write(formatted_message);
+    }
+}
+
+// Write with formatting, adding size of all messages and size of individual message
+void Session::write(const std::vector<std::string>& messages, bool size, bool execute) {
+    std::string msg = formatBulkStrings(messages, size);
+    LOG_DEBUG("Reply: " << LogPayload{msg});
+    if (execute) {
+        captureReply(msg);
+    } else {
+        queue_write(msg);
     }
 }
 
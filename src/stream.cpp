@@ -0,0 +1,132 @@
+#include "../include/stream.hpp"
+#include <algorithm>
+#include <charconv>
+
+namespace redis_server {
+
+namespace {
+
+void putVarint(std::string& out, uint64_t value) {
+    while (value >= 0x80) {
+        out.push_back(static_cast<char>((value & 0x7F) | 0x80));
+        value >>= 7;
+    }
+    out.push_back(static_cast<char>(value));
+}
+
+uint64_t getVarint(const char*& p) {
+    uint64_t value = 0;
+    int shift = 0;
+    while (true) {
+        uint8_t byte = static_cast<uint8_t>(*p++);
+        value |= uint64_t(byte & 0x7F) << shift;
+        if (!(byte & 0x80)) {
+            return value;
+        }
+        shift += 7;
+    }
+}
+
+std::optional<uint64_t> parseNumber(std::string_view text) {
+    uint64_t value;
+    auto [ptr, ec] = std::from_chars(text.data(), text.data() + text.size(), value);
+    if (text.empty() || ec != std::errc() || ptr != text.data() + text.size()) {
+        return std::nullopt;
+    }
+    return value;
+}
+
+} // namespace
+
+StreamId StreamId::next() const {
+    if (seq != std::numeric_limits<uint64_t>::max()) {
+        return {ms, seq + 1};
+    }
+    if (ms != std::numeric_limits<uint64_t>::max()) {
+        return {ms + 1, 0};
+    }
+    return *this;
+}
+
+std::string StreamId::toString() const {
+    return std::to_string(ms) + "-" + std::to_string(seq);
+}
+
+std::optional<StreamId> StreamId::parse(std::string_view text, uint64_t default_seq) {
+    size_t dash = text.find('-');
+    auto ms = parseNumber(text.substr(0, dash));
+    if (!ms) {
+        return std::nullopt;
+    }
+    if (dash == std::string_view::npos) {
+        return StreamId{*ms, default_seq};
+    }
+    auto seq = parseNumber(text.substr(dash + 1));
+    if (!seq) {
+        return std::nullopt;
+    }
+    return StreamId{*ms, *seq};
+}
+
+void Stream::append(const StreamId& id, const std::vector<std::string_view>& fields) {
+    if (chunks_.empty() || chunks_.back().count >= kChunkMaxEntries || chunks_.back().data.size() >= kChunkMaxBytes) {
+        chunks_.push_back(Chunk{id, 0, {}});
+    }
+    Chunk& chunk = chunks_.back();
+    size_t data_before = chunk.data.size();
+    putVarint(chunk.data, id.ms - chunk.first.ms);
+    putVarint(chunk.data, id.ms == chunk.first.ms ? id.seq - chunk.first.seq : id.seq);
+    putVarint(chunk.data, fields.size());
+    for (const auto& field : fields) {
+        putVarint(chunk.data, field.size());
+        chunk.data.append(field);
+    }
+    data_bytes_ += chunk.data.size() - data_before;
+    ++chunk.count;
+    ++length_;
+    last_id_ = id;
+}
+
+size_t Stream::range(const StreamId& start, const StreamId& end, const Visitor& visit) const {
+    if (empty() || start > end || start > last_id_) {
+        return 0;
+    }
+    // Last chunk starting at or before start, every entry before it is smaller than start
+    auto chunk = std::upper_bound(chunks_.begin(), chunks_.end(), start,
+                                  [](const StreamId& id, const Chunk& c) { return id < c.first; });
+    if (chunk != chunks_.begin()) {
+        --chunk;
+    }
+
+    size_t visited = 0;
+    std::vector<std::string_view> fields;
+    for (; chunk != chunks_.end(); ++chunk) {
+        if (chunk->first > end) {
+            break;
+        }
+        const char* p = chunk->data.data();
+        for (size_t i = 0; i < chunk->count; ++i) {
+            StreamId id;
+            id.ms = chunk->first.ms + getVarint(p);
+            uint64_t seq = getVarint(p);
+            id.seq = id.ms == chunk->first.ms ? chunk->first.seq + seq : seq;
+            size_t field_count = getVarint(p);
+            fields.clear();
+            for (size_t f = 0; f < field_count; ++f) {
+                size_t size = getVarint(p);
+                fields.emplace_back(p, size);
+                p += size;
+            }
+            if (id > end) {
+                return visited;
+            }
+            if (id >= start) {
+                visit(id, fields);
+                ++visited;
+            }
+        }
+    }
+    return visited;
+}
+
+} // namespace redis_server
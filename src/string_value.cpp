@@ -0,0 +1,157 @@
+#include "../include/string_value.hpp"
+#include <charconv>
+#include <cstring>
+
+namespace redis_server {
+
+std::optional<int64_t> parseCanonicalInteger(std::string_view value) {
+    // Longest int64 is "-9223372036854775808", leading zeros, '+' and "-0" are not canonical
+    if (value.empty() || value.size() > 20) {
+        return std::nullopt;
+    }
+    bool negative = value[0] == '-';
+    if (value.size() > size_t(negative) + 1 && value[negative] == '0') {
+        return std::nullopt;
+    }
+    if (negative && value == "-0") {
+        return std::nullopt;
+    }
+    int64_t result;
+    auto [ptr, ec] = std::from_chars(value.data(), value.data() + value.size(), result);
+    if (ec != std::errc() || ptr != value.data() + value.size()) {
+        return std::nullopt;
+    }
+    return result;
+}
+
+StringValue::StringValue(std::string_view value) {
+    assign(value);
+}
+
+StringValue::StringValue(int64_t value) : integer_(value), encoding_(Encoding::Int) {}
+
+StringValue::StringValue(const StringValue& other) : has_expiry_(other.has_expiry_), access_(other.access_) {
+    if (other.encoding_ == Encoding::Raw) {
+        assign(std::string_view(other.heap_.data, other.heap_.size));
+    } else {
+        std::memcpy(&heap_, &other.heap_, sizeof(Heap)); // Heap is the largest member of the union
+        encoding_ = other.encoding_;
+        embedded_size_ = other.embedded_size_;
+    }
+}
+
+StringValue::StringValue(StringValue&& other) noexcept
+    : encoding_(other.encoding_), embedded_size_(other.embedded_size_), has_expiry_(other.has_expiry_),
+      access_(other.access_) {
+    std::memcpy(&heap_, &other.heap_, sizeof(Heap));
+    if (other.encoding_ == Encoding::Raw) {
+        // The buffer now belongs to this value, leave other as an empty string
+        other.encoding_ = Encoding::Embedded;
+        other.embedded_size_ = 0;
+    }
+}
+
+StringValue& StringValue::operator=(const StringValue& other) {
+    if (this != &other) {
+        StringValue copy(other);
+        *this = std::move(copy);
+    }
+    return *this;
+}
+
+StringValue& StringValue::operator=(StringValue&& other) noexcept {
+    if (this != &other) {
+        release();
+        std::memcpy(&heap_, &other.heap_, sizeof(Heap));
+        encoding_ = other.encoding_;
+        embedded_size_ = other.embedded_size_;
+        has_expiry_ = other.has_expiry_;
+        access_ = other.access_;
+        if (other.encoding_ == Encoding::Raw) {
+            other.encoding_ = Encoding::Embedded;
+            other.embedded_size_ = 0;
+        }
+    }
+    return *this;
+}
+
+StringValue::~StringValue() {
+    release();
+}
+
+void StringValue::assign(std::string_view value) {
+    if (auto number = parseCanonicalInteger(value)) {
+        integer_ = *number;
+        encoding_ = Encoding::Int;
+    } else if (value.size() <= kEmbeddedCapacity) {
+        std::memcpy(embedded_, value.data(), value.size());
+        embedded_size_ = static_cast<uint8_t>(value.size());
+        encoding_ = Encoding::Embedded;
+    } else {
+        heap_.data = new char[value.size()];
+        heap_.size = value.size();
+        std::memcpy(heap_.data, value.data(), value.size());
+        encoding_ = Encoding::Raw;
+    }
+}
+
+void StringValue::release() {
+    if (encoding_ == Encoding::Raw) {
+        delete[] heap_.data;
+        encoding_ = Encoding::Embedded;
+        embedded_size_ = 0;
+    }
+}
+
+std::optional<int64_t> StringValue::toInteger() const {
+    if (encoding_ == Encoding::Int) {
+        return integer_;
+    }
+    // Every canonical integer is stored Int encoded, so any other encoding is not a number
+    return std::nullopt;
+}
+
+void StringValue::setInteger(int64_t value) {
+    release();
+    integer_ = value;
+    encoding_ = Encoding::Int;
+}
+
+size_t StringValue::size() const {
+    switch (encoding_) {
+    case Encoding::Int: {
+        char digits[20];
+        return std::to_chars(digits, digits + sizeof(digits), integer_).ptr - digits;
+    }
+    case Encoding::Embedded:
+        return embedded_size_;
+    case Encoding::Raw:
+        return heap_.size;
+    }
+    return 0;
+}
+
+std::string StringValue::str() const {
+    std::string out;
+    appendTo(out);
+    return out;
+}
+
+void StringValue::appendTo(std::string& out) const {
+    switch (encoding_) {
+    case Encoding::Int: {
+        char digits[20];
+        auto end = std::to_chars(digits, digits + sizeof(digits), integer_).ptr;
+        out.append(digits, end);
+        break;
+    }
+    case Encoding::Embedded:
+        out.append(embedded_, embedded_size_);
+        break;
+    case Encoding::Raw:
+        out.append(heap_.data, heap_.size);
+        break;
+    }
+}
+
+} // namespace redis_server